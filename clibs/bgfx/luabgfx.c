@@ -2606,7 +2606,7 @@ lcalcTangent(lua_State *L) {
 }
 
 /*
-	userdata BGFX_MEMORY
+	userdata BGFX_MEMORY (it's only read, so it can be constant)
 	vertex_layout src
 	vertex_layout tar
 
@@ -2615,9 +2615,6 @@ lcalcTangent(lua_State *L) {
 static int
 lvertexConvert(lua_State *L) {
 	struct memory *mem = (struct memory *)luaL_checkudata(L, 1, "BGFX_MEMORY");
-	if (mem->constant) {
-		luaL_error(L, "It's constant memory object");
-	}
 	const bgfx_vertex_layout_t *src_vd = get_layout(L, 2);
 	const bgfx_vertex_layout_t *tar_vd = get_layout(L, 3);
 
@@ -24,6 +24,8 @@ struct bgfx_encoder_holder {
 };
 
 struct cull_cached;
+struct scene_cache;
+struct animation_cache;
 
 struct ecs_world {
 	struct ecs_context*           ecs;
@@ -36,8 +38,8 @@ struct ecs_world {
 	struct queue_container*       Q;
 	struct submit_cache*          submit_cache;
 	struct mesh_container*        MESH;
-	uint64_t                      unused1;
-	uint64_t                      unused2;
+	struct scene_cache*           scene_cache;
+	struct animation_cache*       animation_cache;
 };
 
 static inline struct ecs_world* getworld(lua_State* L) {
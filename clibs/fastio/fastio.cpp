@@ -3,7 +3,21 @@
 #include <string.h>
 #include <assert.h>
 #include <array>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
 #include "memfile.h"
+#include "worker.h"
 
 #include <bee/utility/zstring_view.h>
 #include <bee/win/cwtf8.h>
@@ -52,6 +66,79 @@ namespace fileutil {
         (void)rc;
         assert(rc == 0);
     }
+    struct mapping {
+        memory_file file;
+        void* addr;
+        size_t size;
+    };
+    static void unmap(void* ud) noexcept {
+        mapping* m = (mapping*)ud;
+#if defined(_WIN32)
+        UnmapViewOfFile(m->addr);
+#else
+        munmap(m->addr, m->size);
+#endif
+        ::free(m);
+    }
+    // maps the opened file read only, the mapping is still valid after the file is closed.
+    // returns NULL if it can't be mapped, the caller should read it instead.
+    static memory_file* map(FILE* f, size_t size) noexcept {
+        if (size == 0) {
+            return NULL;
+        }
+        mapping* m = (mapping*)malloc(sizeof(mapping));
+        if (!m) {
+            return NULL;
+        }
+#if defined(_WIN32)
+        HANDLE h = CreateFileMappingW((HANDLE)_get_osfhandle(_fileno(f)), NULL, PAGE_READONLY, 0, 0, NULL);
+        void* addr = h ? MapViewOfFile(h, FILE_MAP_READ, 0, 0, size) : NULL;
+        if (h) {
+            CloseHandle(h);
+        }
+        if (!addr) {
+            ::free(m);
+            return NULL;
+        }
+#else
+        void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (addr == MAP_FAILED) {
+            ::free(m);
+            return NULL;
+        }
+#endif
+        m->addr = addr;
+        m->size = size;
+        m->file.ud = m;
+        m->file.data = (const char*)addr;
+        m->file.sz = size;
+        m->file.close = unmap;
+        return &m->file;
+    }
+    // used by the worker threads, it can't allocate from lua
+    static FILE* open_native(const std::string& filename, size_t& size) noexcept {
+#if defined(_WIN32)
+        size_t wlen = wtf8_to_utf16_length(filename.data(), filename.size());
+        if (wlen == (size_t)-1) {
+            errno = EILSEQ;
+            return NULL;
+        }
+        std::wstring wfilename(wlen, L'\0');
+        wtf8_to_utf16(filename.data(), filename.size(), wfilename.data(), wlen);
+        FILE* f = _wfopen(wfilename.c_str(), L"rb");
+        if (f) {
+            struct _stat64 st;
+            size = _fstat64(_fileno(f), &st) == 0 ? (size_t)st.st_size : fileutil::size(f);
+        }
+#else
+        FILE* f = fopen(filename.c_str(), "r");
+        if (f) {
+            struct stat st;
+            size = fstat(fileno(f), &st) == 0 ? (size_t)st.st_size : fileutil::size(f);
+        }
+#endif
+        return f;
+    }
 }
 
 template <bool RAISE>
@@ -121,6 +208,7 @@ static int wrap_closure(lua_State* L) {
     if (luaL_newmetatable(L, "fastio::wrap")) {
         luaL_Reg lib[] = {
             { "__close", wrap_close },
+            { "__gc", wrap_close },
             { NULL, NULL },
         };
         luaL_setfuncs(L, lib, 0);
@@ -129,28 +217,44 @@ static int wrap_closure(lua_State* L) {
     return 3;
 }
 
-template <bool RAISE>
-static int readall_v(lua_State *L) {
-    auto filename = getfile(L);
-    lua_settop(L, 2);
-    FILE* f = fileutil::open(L, filename);
-    if (!f) {
-        return raise_error<RAISE>(L, "open", getsymbol(L, filename));
-    }
+// fastio.mmap maps the files at least this size instead of reading them, the consumers (bgfx/ozz/datalist) use the pages directly
+static constexpr size_t MMAP_THRESHOLD = 64 * 1024;
+
+// reads (or maps) the whole file, closes f
+static memory_file* readfile(lua_State *L, FILE* f, bool mapping) {
     size_t size = fileutil::size(f);
+    if (mapping && size >= MMAP_THRESHOLD) {
+        if (auto file = fileutil::map(f, size)) {
+            fileutil::close(f);
+            return file;
+        }
+    }
     auto file = memory_file_alloc(size);
     if (!file) {
         fileutil::close(f);
-        return luaL_error(L, "not enough memory");
+        luaL_error(L, "not enough memory");
+        return nullptr;
     }
     size_t nr = fileutil::read(f, (void*)file->data, file->sz);
     if (nr != size) {
         memory_file_close(file);
         fileutil::close(f);
-        return luaL_error(L, "unknown read error");
+        luaL_error(L, "unknown read error");
+        return nullptr;
     }
     fileutil::close(f);
-    lua_pushlightuserdata(L, file);
+    return file;
+}
+
+template <bool RAISE>
+static int readall_v(lua_State *L) {
+    auto filename = getfile(L);
+    lua_settop(L, 2);
+    FILE* f = fileutil::open(L, filename);
+    if (!f) {
+        return raise_error<RAISE>(L, "open", getsymbol(L, filename));
+    }
+    lua_pushlightuserdata(L, readfile(L, f, false));
     return 1;
 }
 
@@ -162,20 +266,7 @@ static int readall_f(lua_State *L) {
     if (!f) {
         return raise_error<RAISE>(L, "open", getsymbol(L, filename));
     }
-    size_t size = fileutil::size(f);
-    auto file = memory_file_alloc(size);
-    if (!file) {
-        fileutil::close(f);
-        return luaL_error(L, "not enough memory");
-    }
-    size_t nr = fileutil::read(f, (void*)file->data, file->sz);
-    if (nr != size) {
-        memory_file_close(file);
-        fileutil::close(f);
-        return luaL_error(L, "unknown read error");
-    }
-    fileutil::close(f);
-    lua_pushlightuserdata(L, file);
+    lua_pushlightuserdata(L, readfile(L, f, false));
     lua_pushcclosure(L, wrap_closure, 1);
     return 1;
 }
@@ -200,6 +291,21 @@ static int readall_s(lua_State *L) {
     return 1;
 }
 
+// same as readall_v, but the large file is mapped (unless it can't be mapped).
+// the mapping lives until the memory_file is closed, so it's only for the files never rewritten in place, e.g. content addressed cache.
+// a file truncated while it's mapped raises SIGBUS on posix, and can't be rewritten on windows.
+template <bool RAISE>
+static int mmap_v(lua_State *L) {
+    auto filename = getfile(L);
+    lua_settop(L, 2);
+    FILE* f = fileutil::open(L, filename);
+    if (!f) {
+        return raise_error<RAISE>(L, "open", getsymbol(L, filename));
+    }
+    lua_pushlightuserdata(L, readfile(L, f, true));
+    return 1;
+}
+
 static char hex[] = {
     '0', '1', '2', '3', '4', '5', '6', '7',
     '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
@@ -228,15 +334,119 @@ static int sha1(lua_State *L) {
     std::array<uint8_t, SHA1_DIGEST_SIZE> digest;
     std::array<char, SHA1_DIGEST_SIZE*2> hexdigest;
     sat_SHA1_Final(&ctx, digest.data());
-    for (size_t i = 0; i < SHA1_DIGEST_SIZE; ++i) {
-        auto u = digest[i];
-        hexdigest[2*i+0] = hex[u / 16];
-        hexdigest[2*i+1] = hex[u % 16];
-    }
+    tohex(digest, hexdigest);
     lua_pushlstring(L, hexdigest.data(), hexdigest.size());
     return 1;
 }
 
+// hashs, sizes = sha1_batch(paths [, sizes])
+//   The files are hashed by a pool of threads, each one reads with a large buffer and without stdio buffering.
+//   If sizes[i] is given and the file still has this size, hashs[i] is false, the caller keeps its cached hash.
+//   The sizes of the files are returned in the second table.
+struct sha1_batch_item {
+    std::string path;
+    size_t size;
+    bool cached;
+    bool hashed;
+    int err;
+    std::array<char, SHA1_DIGEST_SIZE*2> hexdigest;
+};
+
+static constexpr size_t SHA1_BATCH_BUFFER = 1024 * 1024;
+
+static void sha1_batch_file(sha1_batch_item& item, std::vector<uint8_t>& buffer) {
+    size_t size = 0;
+    FILE* f = fileutil::open_native(item.path, size);
+    if (!f) {
+        item.err = errno;
+        return;
+    }
+    if (item.cached && item.size == size) {
+        fileutil::close(f);
+        return;
+    }
+    setvbuf(f, NULL, _IONBF, 0);
+    if (buffer.empty()) {
+        buffer.resize(SHA1_BATCH_BUFFER);
+    }
+    SHA1_CTX ctx;
+    sat_SHA1_Init(&ctx);
+    for (;;) {
+        size_t n = fileutil::read(f, buffer.data(), buffer.size());
+        sat_SHA1_Update(&ctx, buffer.data(), n);
+        if (n != buffer.size()) {
+            break;
+        }
+    }
+    fileutil::close(f);
+    std::array<uint8_t, SHA1_DIGEST_SIZE> digest;
+    sat_SHA1_Final(&ctx, digest.data());
+    tohex(digest, item.hexdigest);
+    item.size = size;
+    item.hashed = true;
+}
+
+static int sha1_batch(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    const bool has_sizes = !lua_isnoneornil(L, 2);
+    if (has_sizes) {
+        luaL_checktype(L, 2, LUA_TTABLE);
+    }
+    const uint32_t n = (uint32_t)lua_rawlen(L, 1);
+    std::vector<sha1_batch_item> items(n);
+    for (uint32_t i = 0; i < n; ++i) {
+        auto& item = items[i];
+        if (lua_rawgeti(L, 1, i+1) != LUA_TSTRING) {
+            return luaL_error(L, "paths[%d] is not a string", i+1);
+        }
+        size_t len = 0;
+        const char* path = lua_tolstring(L, -1, &len);
+        item.path.assign(path, len);
+        lua_pop(L, 1);
+        item.size = 0;
+        item.cached = false;
+        item.hashed = false;
+        item.err = 0;
+        if (has_sizes) {
+            if (lua_rawgeti(L, 2, i+1) == LUA_TNUMBER) {
+                item.size = (size_t)lua_tointeger(L, -1);
+                item.cached = true;
+            }
+            lua_pop(L, 1);
+        }
+    }
+
+    worker_pool pool;
+    const uint32_t nthread = std::thread::hardware_concurrency();
+    if (nthread > 1 && n > 1) {
+        pool.resize(std::min(nthread, n) - 1);
+    }
+    std::vector<std::vector<uint8_t>> buffers(pool.size() + 1);
+    pool.run(n, [&](uint32_t idx, uint32_t worker) {
+        sha1_batch_file(items[idx], buffers[worker]);
+    });
+
+    lua_createtable(L, n, 0);
+    lua_createtable(L, n, 0);
+    for (uint32_t i = 0; i < n; ++i) {
+        auto& item = items[i];
+        if (item.err) {
+            errno = item.err;
+            return raise_error<true>(L, "open", item.path.c_str());
+        }
+        if (item.hashed) {
+            lua_pushlstring(L, item.hexdigest.data(), item.hexdigest.size());
+        }
+        else {
+            lua_pushboolean(L, 0);
+        }
+        lua_rawseti(L, -3, i+1);
+        lua_pushinteger(L, (lua_Integer)item.size);
+        lua_rawseti(L, -2, i+1);
+    }
+    return 2;
+}
+
 static int str2sha1(lua_State *L) {
 	size_t sz = 0;
 	const uint8_t * buffer = (const uint8_t *)luaL_checklstring(L, 1, &sz);
@@ -246,11 +456,7 @@ static int str2sha1(lua_State *L) {
     std::array<uint8_t, SHA1_DIGEST_SIZE> digest;
     std::array<char, SHA1_DIGEST_SIZE*2> hexdigest;
     sat_SHA1_Final(&ctx, digest.data());
-    for (size_t i = 0; i < SHA1_DIGEST_SIZE; ++i) {
-        auto u = digest[i];
-        hexdigest[2*i+0] = hex[u / 16];
-        hexdigest[2*i+1] = hex[u % 16];
-    }
+    tohex(digest, hexdigest);
     lua_pushlstring(L, hexdigest.data(), hexdigest.size());
     return 1;
 }
@@ -331,7 +537,10 @@ luaopen_fastio(lua_State* L) {
         {"readall_f", readall_f<true>},
         {"readall_s", readall_s<true>},
         {"readall_s_noerr", readall_s<false>},
+        {"mmap", mmap_v<true>},
+        {"mmap_noerr", mmap_v<false>},
         {"sha1", sha1<true>},
+        {"sha1_batch", sha1_batch},
         {"str2sha1", str2sha1},
         {"wrap", wrap},
         {"tostring", tostring},
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+
+// fixed size thread pool, the thread calling run() also takes jobs as worker 0
+struct worker_pool {
+    using job_func = std::function<void (uint32_t idx, uint32_t worker)>;
+
+    ~worker_pool(){
+        resize(0);
+    }
+
+    uint32_t size() const {
+        return (uint32_t)threads.size();
+    }
+
+    void resize(uint32_t n){
+        if (n == size())
+            return;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wakeup.notify_all();
+        for (auto &t : threads){
+            t.join();
+        }
+        threads.clear();
+
+        quit = false;
+        for (uint32_t ii=0; ii<n; ++ii){
+            threads.emplace_back(&worker_pool::loop, this, ii+1, generation);
+        }
+    }
+
+    // call job(idx, worker) for idx in [0, count), return after all jobs are done
+    void run(uint32_t count, const job_func &job){
+        if (threads.empty() || count <= 1){
+            for (uint32_t ii=0; ii<count; ++ii){
+                job(ii, 0);
+            }
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            current = &job;
+            jobcount = count;
+            next.store(0);
+            pending = size();
+            ++generation;
+        }
+        wakeup.notify_all();
+
+        work(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this]{ return pending == 0; });
+        current = nullptr;
+    }
+
+private:
+    void work(uint32_t worker){
+        for (uint32_t idx = next.fetch_add(1); idx < jobcount; idx = next.fetch_add(1)){
+            (*current)(idx, worker);
+        }
+    }
+
+    void loop(uint32_t worker, uint64_t seen){
+        for (;;){
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeup.wait(lock, [&]{ return quit || generation != seen; });
+                if (quit)
+                    return;
+                seen = generation;
+            }
+
+            work(worker);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            if (--pending == 0){
+                done.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread>    threads;
+    std::mutex                  mutex;
+    std::condition_variable     wakeup;
+    std::condition_variable     done;
+    std::atomic<uint32_t>       next{0};
+    const job_func*             current = nullptr;
+    uint32_t                    jobcount = 0;
+    uint32_t                    pending = 0;
+    uint64_t                    generation = 0;
+    bool                        quit = false;
+};
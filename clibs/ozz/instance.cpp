@@ -0,0 +1,297 @@
+#include <lua.hpp>
+#include <bee/lua/binding.h>
+
+#include "ozz.h"
+
+#include <ozz/animation/runtime/local_to_model_job.h>
+
+#include <algorithm>
+#include <cstdint>
+
+static inline void
+build_skinning_matrices(const ozzAnimationInstance::Skin& skin, const ozzMatrixVector& models) {
+	auto& matrices = *skin.matrices;
+	auto& inverse_bind_matrices = *skin.inverse_bind_matrices;
+	if (skin.joints_remap) {
+		auto& jarray = *skin.joints_remap;
+		for (size_t ii = 0; ii < jarray.size(); ++ii) {
+			matrices[ii] = models[jarray[ii]] * inverse_bind_matrices[ii];
+		}
+	} else {
+		for (size_t ii = 0; ii < inverse_bind_matrices.size(); ++ii) {
+			matrices[ii] = models[ii] * inverse_bind_matrices[ii];
+		}
+	}
+}
+
+bool ozzAnimationInstance::sample_pose(ozz::span<const ozz::math::SoaTransform>& pose) {
+	size_t n = 0;
+	bool masked = false;
+	for (auto& layer : layers) {
+		if (layer.weight <= 0.f)
+			continue;
+		ozz::animation::SamplingJob job;
+		job.animation = layer.animation;
+		job.context = layer.context.get();
+		job.ratio = layer.ratio;
+		job.output = ozz::make_span(locals[n]);
+		if (!job.Run())
+			return false;
+		auto& bl = blending[n];
+		bl.transform = ozz::make_span(locals[n]);
+		bl.weight = layer.weight;
+		if (layer.joint_weights) {
+			bl.joint_weights = ozz::make_span(*layer.joint_weights);
+			masked = true;
+		} else {
+			bl.joint_weights = {};
+		}
+		++n;
+	}
+
+	if (n == 0) {
+		pose = skeleton->joint_rest_poses();
+	} else if (n == 1 && !masked) {
+		pose = ozz::make_span(locals[0]);
+	} else {
+		// the joints masked out by joint weights are blended with rest pose
+		ozz::animation::BlendingJob job;
+		job.layers = ozz::span<const ozz::animation::BlendingJob::Layer>(blending.data(), n);
+		job.output = ozz::make_span(locals[n]);
+		job.threshold = threshold;
+		job.rest_pose = skeleton->joint_rest_poses();
+		if (!job.Run())
+			return false;
+		pose = ozz::make_span(locals[n]);
+	}
+	return true;
+}
+
+bool ozzAnimationInstance::build(ozz::span<const ozz::math::SoaTransform> input) {
+	ozz::animation::LocalToModelJob ltm;
+	ltm.skeleton = skeleton;
+	ltm.input = input;
+	ltm.output = ozz::make_span(*models);
+	if (!ltm.Run())
+		return false;
+
+	for (auto const& skin : skins) {
+		build_skinning_matrices(skin, *models);
+	}
+	return true;
+}
+
+bool ozzAnimationInstance::sample() {
+	ozz::span<const ozz::math::SoaTransform> pose;
+	return sample_pose(pose) && build(pose);
+}
+
+bool ozzAnimationInstance::schedule(bool changed) {
+	pending = pending || changed;
+	if (rate <= 1) {
+		// the key poses are out of date once it leaves the interpolated rates
+		nkey = 0;
+		if (rate == 0 || !pending)
+			return false;
+		pending = false;
+		action = Action::sample;
+		return true;
+	}
+	if (nkey == 0 || step >= rate) {
+		if (!pending)
+			return false;
+		pending = false;
+		current ^= 1;
+		if (nkey < 2)
+			++nkey;
+		// the first key is held for a random part of the rate, so the instances entering the same lod don't key in the same frame
+		step = nkey == 1 ? (uint8_t)(1 + ((uintptr_t)this >> 6) % rate) : 1;
+		action = Action::key;
+		return true;
+	}
+	++step;
+	if (nkey < 2)
+		return false;
+	action = Action::interpolate;
+	return true;
+}
+
+bool ozzAnimationInstance::update() {
+	const Action a = action;
+	action = Action::sample;
+	if (a == Action::sample)
+		return sample();
+	auto& key = keys[current];
+	if (a == Action::key) {
+		ozz::span<const ozz::math::SoaTransform> pose;
+		if (!sample_pose(pose))
+			return false;
+		std::copy(pose.begin(), pose.end(), key.begin());
+	}
+	if (nkey < 2 || step >= rate)
+		return build(ozz::make_span(key));
+
+	// the pose is one key behind, it goes from the last key to the current one in `rate` frames
+	const float t = (float)step / rate;
+	ozz::animation::BlendingJob::Layer lerp[2];
+	lerp[0].transform = ozz::make_span(keys[current ^ 1]);
+	lerp[0].weight = 1.f - t;
+	lerp[1].transform = ozz::make_span(key);
+	lerp[1].weight = t;
+	ozz::animation::BlendingJob job;
+	job.layers = ozz::span<const ozz::animation::BlendingJob::Layer>(lerp, 2);
+	job.output = ozz::make_span(interpolated);
+	job.rest_pose = skeleton->joint_rest_poses();
+	if (!job.Run())
+		return false;
+	return build(ozz::make_span(interpolated));
+}
+
+ozzAnimationInstance::Layer* ozzAnimationInstance::single_layer() {
+	Layer* single = nullptr;
+	for (auto& layer : layers) {
+		if (layer.weight <= 0.f)
+			continue;
+		if (single || layer.joint_weights)
+			return nullptr;
+		single = &layer;
+	}
+	return single;
+}
+
+void ozzAnimationInstance::share(const ozzAnimationInstance& from) {
+	action = Action::sample;
+	std::copy(from.models->begin(), from.models->end(), models->begin());
+	for (auto const& skin : skins) {
+		build_skinning_matrices(skin, *models);
+	}
+}
+
+namespace ozzlua::AnimationInstance {
+	static int add_layer(lua_State* L) {
+		auto& inst = bee::lua::checkudata<ozzAnimationInstance>(L, 1);
+		auto& animation = bee::lua::checkudata<ozz::animation::Animation>(L, 2);
+		if (animation.num_tracks() != inst.skeleton->num_joints()) {
+			return luaL_error(L, "animation has %d tracks, but skeleton has %d joints", animation.num_tracks(), inst.skeleton->num_joints());
+		}
+		ozzAnimationInstance::Layer layer;
+		layer.animation = &animation;
+		layer.context = ozz::make_unique<ozz::animation::SamplingJob::Context>(animation.num_tracks());
+		layer.joint_weights = nullptr;
+		layer.ratio = 0.f;
+		layer.weight = 0.f;
+		inst.layers.emplace_back(std::move(layer));
+		inst.blending.resize(inst.layers.size());
+		const size_t num_soa_joints = (size_t)inst.skeleton->num_soa_joints();
+		while (inst.locals.size() < inst.layers.size() + 1) {
+			inst.locals.emplace_back(num_soa_joints);
+		}
+		lua_pushinteger(L, (lua_Integer)inst.layers.size());
+		return 1;
+	}
+	static int add_skin(lua_State* L) {
+		auto& inst = bee::lua::checkudata<ozzAnimationInstance>(L, 1);
+		ozzAnimationInstance::Skin skin;
+		skin.matrices = &bee::lua::checkudata<ozzMatrixVector>(L, 2);
+		skin.inverse_bind_matrices = &bee::lua::checkudata<ozzMatrixVector>(L, 3);
+		skin.joints_remap = lua_isnoneornil(L, 4) ? nullptr : &bee::lua::checkudata<ozzUint16Verctor>(L, 4);
+		const size_t n = skin.joints_remap ? skin.joints_remap->size() : skin.inverse_bind_matrices->size();
+		if (skin.matrices->size() < n || (!skin.joints_remap && inst.models->size() != n)) {
+			return luaL_error(L, "invalid skinning matrices and inverse bind matrices");
+		}
+		inst.skins.push_back(skin);
+		return 0;
+	}
+	// 3: ozz.JointWeights or nil, it masks the joints of the layer, they are blended with other layers or rest pose
+	static int joint_weights(lua_State* L) {
+		auto& inst = bee::lua::checkudata<ozzAnimationInstance>(L, 1);
+		const lua_Integer idx = luaL_checkinteger(L, 2);
+		if (idx < 1 || idx > (lua_Integer)inst.layers.size()) {
+			return luaL_error(L, "Invalid layer index: %d", (int)idx);
+		}
+		const ozzJointWeights* jw = nullptr;
+		if (!lua_isnoneornil(L, 3)) {
+			jw = &bee::lua::checkudata<ozzJointWeights>(L, 3);
+			if (jw->size() != (size_t)inst.skeleton->num_soa_joints()) {
+				return luaL_error(L, "joint weights don't match the skeleton");
+			}
+		}
+		inst.layers[idx - 1].joint_weights = jw;
+		return 0;
+	}
+	// 2: { status, ... }, the status of i-th layer, reads .ratio and .weight
+	static int sync(lua_State* L) {
+		auto& inst = bee::lua::checkudata<ozzAnimationInstance>(L, 1);
+		luaL_checktype(L, 2, LUA_TTABLE);
+		const size_t n = inst.layers.size();
+		for (size_t ii = 0; ii < n; ++ii) {
+			auto& layer = inst.layers[ii];
+			if (lua_geti(L, 2, (lua_Integer)ii + 1) != LUA_TTABLE) {
+				return luaL_error(L, "Missing status of layer %d", (int)ii + 1);
+			}
+			lua_getfield(L, -1, "ratio");
+			layer.ratio = (float)lua_tonumber(L, -1);
+			lua_getfield(L, -2, "weight");
+			layer.weight = (float)lua_tonumber(L, -1);
+			lua_pop(L, 3);
+		}
+		return 0;
+	}
+	static int sample(lua_State* L) {
+		auto& inst = bee::lua::checkudata<ozzAnimationInstance>(L, 1);
+		if (!inst.sample()) {
+			return luaL_error(L, "Animation sampling failed!");
+		}
+		return 0;
+	}
+	static int threshold(lua_State* L) {
+		auto& inst = bee::lua::checkudata<ozzAnimationInstance>(L, 1);
+		inst.threshold = (float)luaL_checknumber(L, 2);
+		return 0;
+	}
+	static int pointer(lua_State* L) {
+		auto& inst = bee::lua::checkudata<ozzAnimationInstance>(L, 1);
+		lua_pushlightuserdata(L, &inst);
+		return 1;
+	}
+	static void metatable(lua_State* L) {
+		static luaL_Reg lib[] = {
+			{ "add_layer", add_layer },
+			{ "add_skin", add_skin },
+			{ "joint_weights", joint_weights },
+			{ "sync", sync },
+			{ "sample", sample },
+			{ "threshold", threshold },
+			{ "pointer", pointer },
+			{ nullptr, nullptr }
+		};
+		luaL_newlibtable(L, lib);
+		luaL_setfuncs(L, lib, 0);
+		lua_setfield(L, -2, "__index");
+	}
+	static int create(lua_State* L) {
+		auto& ske = bee::lua::checkudata<ozz::animation::Skeleton>(L, 1);
+		auto& models = bee::lua::checkudata<ozzMatrixVector>(L, 2);
+		if (models.size() != (size_t)ske.num_joints()) {
+			return luaL_error(L, "models has %d matrices, but skeleton has %d joints", (int)models.size(), ske.num_joints());
+		}
+		bee::lua::newudata<ozzAnimationInstance>(L, &ske, &models);
+		return 1;
+	}
+}
+
+void init_instance(lua_State* L) {
+	static luaL_Reg lib[] = {
+		{ "AnimationInstance", ozzlua::AnimationInstance::create },
+		{ NULL, NULL },
+	};
+	luaL_setfuncs(L, lib, 0);
+}
+
+namespace bee::lua {
+	template <>
+	struct udata<ozzAnimationInstance> {
+		static inline auto name = "ozzAnimationInstance";
+		static inline auto metatable = ozzlua::AnimationInstance::metatable;
+	};
+}
@@ -31,7 +31,13 @@ namespace ozzlua::BlendingJobLayerVector {
             vec[n-1].transform = ozz::make_span(locals);
         }
         vec[n-1].weight = (float)luaL_optnumber(L, 4, 1.0);
-        // TODO: joint_weights
+        if (lua_isnoneornil(L, 5)) {
+            vec[n-1].joint_weights = {};
+        }
+        else {
+            auto& jw = bee::lua::checkudata<ozzJointWeights>(L, 5);
+            vec[n-1].joint_weights = ozz::make_span(jw);
+        }
         return 0;
     }
     static void metatable(lua_State* L) {
@@ -50,6 +56,28 @@ namespace ozzlua::BlendingJobLayerVector {
     }
 }
 
+namespace ozzlua::JointWeights {
+    static void metatable(lua_State* L) {
+    }
+    // 2: { weight, ... }, weight of each joint, the missing ones are 1.0
+    static int create(lua_State* L) {
+        auto& ske = bee::lua::checkudata<ozz::animation::Skeleton>(L, 1);
+        luaL_checktype(L, 2, LUA_TTABLE);
+        const int num_soa_joints = ske.num_soa_joints();
+        auto& jw = bee::lua::newudata<ozzJointWeights>(L, (size_t)num_soa_joints);
+        for (int ii = 0; ii < num_soa_joints; ++ii) {
+            float w[4];
+            for (int jj = 0; jj < 4; ++jj) {
+                lua_geti(L, 2, ii * 4 + jj + 1);
+                w[jj] = (float)luaL_optnumber(L, -1, 1.0);
+                lua_pop(L, 1);
+            }
+            jw[ii] = ozz::math::simd_float4::LoadPtrU(w);
+        }
+        return 1;
+    }
+}
+
 static int SamplingJob(lua_State* L) {
     auto& animation = bee::lua::checkudata<ozz::animation::Animation>(L, 1);
     auto& context = bee::lua::checkudata<ozz::animation::SamplingJob::Context>(L, 2);
@@ -110,6 +138,7 @@ void init_job(lua_State* L) {
     static luaL_Reg lib[] = {
         { "SamplingJobContext", ozzlua::SamplingJobContext::create },
         { "BlendingJobLayerVector", ozzlua::BlendingJobLayerVector::create },
+        { "JointWeights", ozzlua::JointWeights::create },
         { "SamplingJob", SamplingJob },
         { "BlendingJob", BlendingJob },
         { "LocalToModelJob", LocalToModelJob },
@@ -129,4 +158,9 @@ namespace bee::lua {
         static inline auto name = "ozzBlendingJobLayerVector";
         static inline auto metatable = ozzlua::BlendingJobLayerVector::metatable;
     };
+    template <>
+    struct udata<ozzJointWeights> {
+        static inline auto name = "ozzJointWeights";
+        static inline auto metatable = ozzlua::JointWeights::metatable;
+    };
 }
@@ -18,6 +18,7 @@ lm:lua_src "ozz" {
         "job.cpp",
         "skeleton.cpp",
         "skinning.cpp",
+        "instance.cpp",
     },
 }
 
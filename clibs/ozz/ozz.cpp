@@ -114,6 +114,7 @@ extern void init_animation(lua_State* L);
 extern void init_skeleton(lua_State* L);
 extern void init_skinning(lua_State* L);
 extern void init_job(lua_State* L);
+extern void init_instance(lua_State* L);
 
 extern "C" int
 luaopen_ozz(lua_State *L) {
@@ -124,6 +125,7 @@ luaopen_ozz(lua_State *L) {
 	init_skeleton(L);
 	init_skinning(L);
 	init_job(L);
+	init_instance(L);
 	lua_pushcfunction(L, lmemory);
 	lua_setfield(L, -2, "memory");
 	lua_pushcfunction(L, lload);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <ozz/base/containers/vector.h>
+#include <ozz/base/memory/unique_ptr.h>
 #include <ozz/base/maths/simd_math.h>
 #include <ozz/base/maths/soa_transform.h>
 
@@ -49,3 +50,70 @@ struct ozzBlendingJobLayerVector: public ozz::vector<ozz::animation::BlendingJob
 		: ozz::vector<ozz::animation::BlendingJob::Layer>()
 	{}
 };
+
+// per joint weights of a blending layer, in soa layout: one SimdFloat4 for 4 joints
+struct ozzJointWeights: public ozz::vector<ozz::math::SimdFloat4> {
+	ozzJointWeights(size_t n)
+		: ozz::vector<ozz::math::SimdFloat4>(n)
+	{}
+};
+
+// all the jobs of one animated skeleton: sample the weighted layers, blend them, local to model, then build the skinning matrices.
+// skeleton, animations and matrices are lua objects, they are kept alive by the lua side
+struct ozzAnimationInstance {
+	struct Layer {
+		const ozz::animation::Animation* animation;
+		ozz::unique_ptr<ozz::animation::SamplingJob::Context> context;
+		const ozzJointWeights* joint_weights;
+		float ratio;
+		float weight;
+	};
+	struct Skin {
+		ozzMatrixVector* matrices;
+		const ozzMatrixVector* inverse_bind_matrices;
+		const ozzUint16Verctor* joints_remap;
+	};
+	const ozz::animation::Skeleton* skeleton;
+	ozzMatrixVector* models;
+	float threshold = 0.1f;
+	ozz::vector<Layer> layers;
+	ozz::vector<Skin> skins;
+	// locals[i] is the output of the i-th active layer, the last one is the blending output. they are allocated with layers, the jobs don't allocate
+	ozz::vector<ozz::vector<ozz::math::SoaTransform>> locals;
+	ozzBlendingJobLayerVector blending;
+
+	// lod: the pose is sampled every `rate` frames, and the frames between are interpolated from the last two sampled poses.
+	// rate 1 samples every changed frame, rate 0 freezes the pose, the changes are kept pending until it's updated again
+	enum class Action : uint8_t {
+		sample,			// full rate
+		key,			// sample a new key pose, then interpolate
+		interpolate,	// interpolate the key poses only
+	};
+	uint8_t rate = 1;
+	uint8_t step = 0;		// frames since the last key pose
+	uint8_t nkey = 0;		// number of valid key poses, interpolation needs 2
+	uint8_t current = 0;	// keys[current] is the last key pose
+	bool pending = false;	// changed since it's updated
+	bool visible = false;
+	Action action = Action::sample;
+	ozz::vector<ozz::math::SoaTransform> keys[2];
+	ozz::vector<ozz::math::SoaTransform> interpolated;
+
+	ozzAnimationInstance(const ozz::animation::Skeleton* s, ozzMatrixVector* m)
+		: skeleton(s)
+		, models(m)
+		, keys{ozz::vector<ozz::math::SoaTransform>(s->num_soa_joints()), ozz::vector<ozz::math::SoaTransform>(s->num_soa_joints())}
+		, interpolated(s->num_soa_joints())
+	{}
+	bool sample();
+	// lod step of this frame, it only changes the lod states. returns false if the models keep unchanged in this frame
+	bool schedule(bool changed);
+	// runs the scheduled action, it can run in worker threads
+	bool update();
+	// the only weighted layer without joint weights, the models of it only depend on the animation and ratio. nullptr if the pose is blended
+	Layer* single_layer();
+	// takes the models of another instance which samples the same pose, then builds its own skins
+	void share(const ozzAnimationInstance& from);
+	bool sample_pose(ozz::span<const ozz::math::SoaTransform>& pose);
+	bool build(ozz::span<const ozz::math::SoaTransform> input);
+};
@@ -0,0 +1,822 @@
+#define LUA_LIB
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "zlib-ng.h"
+#include "luazip.h"
+#include "memfile.h"
+#include "bundle.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// Content addressed bundle (00.bundle), little endian :
+//   header : 24 bytes, magic, version, count, align, capacity, reserved
+//   index : capacity slots, the first count entries are sorted by hash, for binary search
+//   payload : each entry starts at a BUNDLE_ALIGN boundary, stored or deflated
+// The reader maps the whole file, the stored entries are returned without copy.
+// New entries can be appended to a bundle, the index is rewritten in place while it's not full.
+// The payload of the removed entries is garbage until the bundle is rebuilt.
+
+#define BUNDLE_MAGIC "ANTB"
+#define BUNDLE_VERSION 2
+#define BUNDLE_ALIGN 4096
+#define BUNDLE_HASHSIZE 20
+#define BUNDLE_CHUNK (4096 * 4)
+// files deflated together in bundle_job_run
+#define BUNDLE_BATCH 64
+
+#define BUNDLE_REMOVED 0xffffffff
+
+struct bundle_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t count;
+	uint32_t align;
+	uint32_t capacity;
+	uint32_t reserved;
+};
+
+struct bundle_entry {
+	uint8_t hash[BUNDLE_HASHSIZE];
+	uint32_t method;
+	uint64_t offset;
+	uint64_t size;
+	uint64_t raw_size;
+};
+
+static int
+hexvalue(int c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// hash is the sha1 in hex (the name of the file in vfs)
+static int
+parse_hash(const char *str, size_t sz, uint8_t hash[BUNDLE_HASHSIZE]) {
+	if (sz != BUNDLE_HASHSIZE * 2)
+		return 0;
+	int i;
+	for (i=0;i<BUNDLE_HASHSIZE;i++) {
+		int h = hexvalue(str[i*2]);
+		int l = hexvalue(str[i*2+1]);
+		if (h < 0 || l < 0)
+			return 0;
+		hash[i] = (uint8_t)(h << 4 | l);
+	}
+	return 1;
+}
+
+static void
+push_hash(lua_State *L, const uint8_t hash[BUNDLE_HASHSIZE]) {
+	static const char hex[] = "0123456789abcdef";
+	char str[BUNDLE_HASHSIZE * 2];
+	int i;
+	for (i=0;i<BUNDLE_HASHSIZE;i++) {
+		str[i*2] = hex[hash[i] >> 4];
+		str[i*2+1] = hex[hash[i] & 0xf];
+	}
+	lua_pushlstring(L, str, sizeof(str));
+}
+
+static inline uint64_t
+align_offset(uint64_t offset) {
+	return (offset + BUNDLE_ALIGN - 1) & ~(uint64_t)(BUNDLE_ALIGN - 1);
+}
+
+// reader
+
+struct bundle_reader {
+	const uint8_t *addr;
+	size_t size;
+	const struct bundle_entry *index;
+	uint32_t count;
+};
+
+static void
+unmap_file(const void *addr, size_t size) {
+#ifdef _WIN32
+	(void)size;
+	UnmapViewOfFile(addr);
+#else
+	munmap((void *)addr, size);
+#endif
+}
+
+static const uint8_t *
+map_file(FILE *f, size_t size) {
+#ifdef _WIN32
+	HANDLE h = CreateFileMappingW((HANDLE)_get_osfhandle(_fileno(f)), NULL, PAGE_READONLY, 0, 0, NULL);
+	if (h == NULL)
+		return NULL;
+	void *addr = MapViewOfFile(h, FILE_MAP_READ, 0, 0, size);
+	CloseHandle(h);
+	return (const uint8_t *)addr;
+#else
+	void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+	return (const uint8_t *)addr;
+#endif
+}
+
+static size_t
+file_size(FILE *f) {
+#ifdef _WIN32
+	_fseeki64(f, 0, SEEK_END);
+	long long size = _ftelli64(f);
+#else
+	fseeko(f, 0, SEEK_END);
+	off_t size = ftello(f);
+#endif
+	return size < 0 ? 0 : (size_t)size;
+}
+
+static struct bundle_reader *
+check_reader(lua_State *L) {
+	struct bundle_reader *r = (struct bundle_reader *)luaL_checkudata(L, 1, "ZIP_BUNDLE");
+	if (r->addr == NULL)
+		luaL_error(L, "Error: closed");
+	return r;
+}
+
+static const struct bundle_entry *
+find_entry(lua_State *L, struct bundle_reader *r, int index) {
+	size_t sz;
+	const char *name = luaL_checklstring(L, index, &sz);
+	uint8_t hash[BUNDLE_HASHSIZE];
+	if (!parse_hash(name, sz, hash))
+		return NULL;
+	uint32_t begin = 0;
+	uint32_t end = r->count;
+	while (begin < end) {
+		uint32_t mid = (begin + end) / 2;
+		const struct bundle_entry *e = &r->index[mid];
+		int c = memcmp(hash, e->hash, BUNDLE_HASHSIZE);
+		if (c == 0) {
+			if (e->offset + e->size > r->size)
+				luaL_error(L, "Error: bundle entry %s out of range", name);
+			return e;
+		}
+		if (c < 0)
+			end = mid;
+		else
+			begin = mid + 1;
+	}
+	return NULL;
+}
+
+static void
+uncompress_entry(lua_State *L, struct bundle_reader *r, const struct bundle_entry *e, void *buffer) {
+	size_t dsz = (size_t)e->raw_size;
+	int err = zng_uncompress(buffer, &dsz, r->addr + e->offset, (size_t)e->size);
+	if (err != Z_OK || dsz != e->raw_size)
+		luaL_error(L, "Error: uncompress %s", lua_tostring(L, 2));
+}
+
+static int
+bundle_reader_call(lua_State *L) {
+	struct bundle_reader *r = check_reader(L);
+	const struct bundle_entry *e = find_entry(L, r, 2);
+	if (e == NULL)
+		return 0;
+	struct memory_file *mf;
+	if (e->method == BUNDLE_STORE) {
+		// points to the mapping, it should be closed before the bundle
+		mf = memory_file_cstr((const char *)r->addr + e->offset, (size_t)e->size);
+		if (mf == NULL)
+			return luaL_error(L, "Out of memory for file %s", lua_tostring(L, 2));
+	} else {
+		mf = memory_file_alloc((size_t)e->raw_size);
+		if (mf == NULL)
+			return luaL_error(L, "Out of memory for file %s", lua_tostring(L, 2));
+		uncompress_entry(L, r, e, (void *)mf->data);
+	}
+	lua_pushlightuserdata(L, mf);
+	return 1;
+}
+
+static int
+bundle_reader_readfile(lua_State *L) {
+	struct bundle_reader *r = check_reader(L);
+	const struct bundle_entry *e = find_entry(L, r, 2);
+	if (e == NULL)
+		return 0;
+	if (e->method == BUNDLE_STORE) {
+		lua_pushlstring(L, (const char *)r->addr + e->offset, (size_t)e->size);
+	} else {
+		luaL_Buffer b;
+		void *buffer = luaL_buffinitsize(L, &b, (size_t)e->raw_size);
+		uncompress_entry(L, r, e, buffer);
+		luaL_pushresultsize(&b, (size_t)e->raw_size);
+	}
+	return 1;
+}
+
+static int
+bundle_reader_exist(lua_State *L) {
+	struct bundle_reader *r = check_reader(L);
+	lua_pushboolean(L, find_entry(L, r, 2) != NULL);
+	return 1;
+}
+
+static int
+bundle_reader_size(lua_State *L) {
+	struct bundle_reader *r = check_reader(L);
+	const struct bundle_entry *e = find_entry(L, r, 2);
+	if (e == NULL)
+		return 0;
+	lua_pushinteger(L, (lua_Integer)e->raw_size);
+	return 1;
+}
+
+static int
+bundle_reader_list(lua_State *L) {
+	struct bundle_reader *r = check_reader(L);
+	lua_createtable(L, r->count, 0);
+	uint32_t i;
+	for (i=0;i<r->count;i++) {
+		push_hash(L, r->index[i].hash);
+		lua_rawseti(L, -2, i+1);
+	}
+	return 1;
+}
+
+static int
+bundle_reader_close(lua_State *L) {
+	struct bundle_reader *r = (struct bundle_reader *)luaL_checkudata(L, 1, "ZIP_BUNDLE");
+	if (r->addr) {
+		unmap_file(r->addr, r->size);
+		r->addr = NULL;
+	}
+	return 0;
+}
+
+int
+lbundle_open(lua_State *L) {
+	const char *filename = luaL_checkstring(L, 1);
+	FILE *f = luazip_fopen(filename, "rb");
+	if (f == NULL)
+		return 0;
+	size_t size = file_size(f);
+	const uint8_t *addr = size >= sizeof(struct bundle_header) ? map_file(f, size) : NULL;
+	fclose(f);
+	if (addr == NULL)
+		return 0;
+	const struct bundle_header *h = (const struct bundle_header *)addr;
+	if (memcmp(h->magic, BUNDLE_MAGIC, 4) != 0
+		|| h->version != BUNDLE_VERSION
+		|| h->count > h->capacity
+		|| sizeof(*h) + (uint64_t)h->capacity * sizeof(struct bundle_entry) > size) {
+		unmap_file(addr, size);
+		return 0;
+	}
+	struct bundle_reader *r = (struct bundle_reader *)lua_newuserdatauv(L, sizeof(*r), 0);
+	r->addr = addr;
+	r->size = size;
+	r->index = (const struct bundle_entry *)(h + 1);
+	r->count = h->count;
+	if (luaL_newmetatable(L, "ZIP_BUNDLE")) {
+		luaL_Reg l[] = {
+			{ "__index", NULL },
+			{ "__gc", bundle_reader_close },
+			{ "__call", bundle_reader_call },
+			{ "close", bundle_reader_close },
+			{ "readfile", bundle_reader_readfile },
+			{ "exist", bundle_reader_exist },
+			{ "size", bundle_reader_size },
+			{ "list", bundle_reader_list },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+int
+bundle_deflate(const void *src, size_t sz, int level, void **out, size_t *outsz) {
+	*out = NULL;
+	*outsz = 0;
+	if (level < 0 || sz == 0)
+		return BUNDLE_STORE;
+	size_t len = zng_compressBound(sz);
+	void *buf = malloc(len);
+	if (buf == NULL)
+		return BUNDLE_STORE;
+	if (zng_compress2(buf, &len, src, sz, level) != Z_OK || len >= sz - sz / 8) {
+		free(buf);
+		return BUNDLE_STORE;
+	}
+	*out = buf;
+	*outsz = len;
+	return BUNDLE_DEFLATE;
+}
+
+// writer
+
+struct bundle_writer {
+	FILE *f;
+	uint64_t offset;
+	uint32_t capacity;
+	uint32_t count;
+	uint32_t loaded;	// entries from the old bundle (append mode), sorted
+	uint32_t removed;
+	uint64_t written;	// payload written by this writer
+	uint64_t copied;	// payload written by copyfrom
+	uint64_t garbage;	// payload of the removed entries
+	struct bundle_entry *entries;
+};
+
+static struct bundle_writer *
+check_writer(lua_State *L) {
+	struct bundle_writer *w = (struct bundle_writer *)luaL_checkudata(L, 1, "ZIP_BUNDLE_WRITE");
+	if (w->f == NULL)
+		luaL_error(L, "Error: closed");
+	return w;
+}
+
+static void
+write_data(lua_State *L, struct bundle_writer *w, const void *data, size_t sz) {
+	if (sz > 0 && fwrite(data, 1, sz, w->f) != sz)
+		luaL_error(L, "Error: write bundle");
+	w->offset += sz;
+	w->written += sz;
+}
+
+// pads to the alignment, and returns a new entry starts from there
+static struct bundle_entry *
+new_entry(lua_State *L, struct bundle_writer *w, const char *name, size_t sz) {
+	if (w->count - w->removed >= w->capacity)
+		luaL_error(L, "Error: more than %d files in bundle", (int)w->capacity);
+	struct bundle_entry *e = &w->entries[w->count];
+	if (!parse_hash(name, sz, e->hash))
+		luaL_error(L, "Error: invalid hash name %s", name);
+	static const uint8_t zero[BUNDLE_ALIGN] = { 0 };
+	size_t pad = (size_t)(align_offset(w->offset) - w->offset);
+	if (pad > 0 && fwrite(zero, 1, pad, w->f) != pad)
+		luaL_error(L, "Error: write bundle");
+	w->offset += pad;
+	e->offset = w->offset;
+	e->method = BUNDLE_STORE;
+	e->size = 0;
+	e->raw_size = 0;
+	return e;
+}
+
+static struct bundle_entry *
+new_entry_arg(lua_State *L, struct bundle_writer *w, int index) {
+	size_t sz;
+	const char *name = luaL_checklstring(L, index, &sz);
+	return new_entry(L, w, name, sz);
+}
+
+static void
+write_content(lua_State *L, struct bundle_writer *w, struct bundle_entry *e, const void *content, size_t sz, int level) {
+	void *buf;
+	size_t len;
+	e->raw_size = sz;
+	if (bundle_deflate(content, sz, level, &buf, &len) == BUNDLE_DEFLATE) {
+		e->method = BUNDLE_DEFLATE;
+		e->size = len;
+		if (fwrite(buf, 1, len, w->f) != len) {
+			free(buf);
+			luaL_error(L, "Error: write bundle");
+		}
+		free(buf);
+		w->offset += len;
+		w->written += len;
+		return;
+	}
+	e->method = BUNDLE_STORE;
+	e->size = sz;
+	write_data(L, w, content, sz);
+}
+
+static int
+bundle_writer_add(lua_State *L) {
+	struct bundle_writer *w = check_writer(L);
+	size_t sz;
+	const char *content = luaL_checklstring(L, 3, &sz);
+	int level = (int)luaL_optinteger(L, 4, -1);
+	struct bundle_entry *e = new_entry_arg(L, w, 2);
+	write_content(L, w, e, content, sz, level);
+	w->count++;
+	return 0;
+}
+
+// streams the file into the bundle without compression
+static void
+store_file(lua_State *L, struct bundle_writer *w, const char *name, size_t namesz, const char *addfile) {
+	struct bundle_entry *e = new_entry(L, w, name, namesz);
+	FILE *f = luazip_fopen(addfile, "rb");
+	if (f == NULL)
+		luaL_error(L, "Can't open %s", addfile);
+	char buf[BUNDLE_CHUNK];
+	uint64_t sz = 0;
+	for (;;) {
+		size_t bytes = fread(buf, 1, BUNDLE_CHUNK, f);
+		if (bytes > 0 && fwrite(buf, 1, bytes, w->f) != bytes) {
+			fclose(f);
+			luaL_error(L, "Error: write bundle");
+		}
+		sz += bytes;
+		if (bytes < BUNDLE_CHUNK) {
+			if (ferror(f)) {
+				fclose(f);
+				luaL_error(L, "Error: read file %s", addfile);
+			}
+			break;
+		}
+	}
+	fclose(f);
+	w->offset += sz;
+	w->written += sz;
+	e->size = sz;
+	e->raw_size = sz;
+	w->count++;
+}
+
+static int
+bundle_writer_addfile(lua_State *L) {
+	struct bundle_writer *w = check_writer(L);
+	size_t namesz;
+	const char *name = luaL_checklstring(L, 2, &namesz);
+	const char *addfile = luaL_checkstring(L, 3);
+	int level = (int)luaL_optinteger(L, 4, -1);
+	if (level < 0) {
+		store_file(L, w, name, namesz, addfile);
+		return 0;
+	}
+	struct bundle_job job;
+	job.filename = addfile;
+	job.level = level;
+	bundle_job_run(&job, 1);
+	if (job.err != BUNDLE_JOB_OK)
+		return luaL_error(L, "Error: read file %s", addfile);
+	struct bundle_entry *e = new_entry(L, w, name, namesz);
+	e->method = job.method;
+	e->size = job.size;
+	e->raw_size = job.raw_size;
+	int ok = job.size == 0 || fwrite(job.data, 1, job.size, w->f) == job.size;
+	free(job.data);
+	if (!ok)
+		return luaL_error(L, "Error: write bundle");
+	w->offset += job.size;
+	w->written += job.size;
+	w->count++;
+	return 0;
+}
+
+static void
+free_jobs(struct bundle_job *jobs, int from, int n) {
+	int i;
+	for (i=from;i<n;i++) {
+		free(jobs[i].data);
+		jobs[i].data = NULL;
+	}
+}
+
+// writes the jobs from the list (the table at index 2), slots are the indices of the items
+static void
+write_jobs(lua_State *L, struct bundle_writer *w, struct bundle_job *jobs, const int *slots, int n) {
+	bundle_job_run(jobs, n);
+	int i;
+	for (i=0;i<n;i++) {
+		struct bundle_job *job = &jobs[i];
+		if (job->err != BUNDLE_JOB_OK) {
+			free_jobs(jobs, i, n);
+			luaL_error(L, "Error: read file %s", job->filename);
+		}
+		lua_rawgeti(L, 2, slots[i]);
+		lua_rawgeti(L, -1, 1);
+		size_t namesz;
+		const char *name = lua_tolstring(L, -1, &namesz);
+		lua_pop(L, 2);	// the name is referenced by the list
+		struct bundle_entry *e = new_entry(L, w, name, namesz);
+		e->method = job->method;
+		e->size = job->size;
+		e->raw_size = job->raw_size;
+		if (job->size > 0 && fwrite(job->data, 1, job->size, w->f) != job->size) {
+			free_jobs(jobs, i, n);
+			luaL_error(L, "Error: write bundle");
+		}
+		free(job->data);
+		job->data = NULL;
+		w->offset += job->size;
+		w->written += job->size;
+		w->count++;
+	}
+}
+
+// addfiles { { hash, localpath [, level] }, ... }
+//   the files with level are read and deflated by a pool of threads, BUNDLE_BATCH files each time.
+//   the others are stored.
+static int
+bundle_writer_addfiles(lua_State *L) {
+	struct bundle_writer *w = check_writer(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	int n = (int)lua_rawlen(L, 2);
+	struct bundle_job jobs[BUNDLE_BATCH];
+	int slots[BUNDLE_BATCH];
+	int njob = 0;
+	int i;
+	for (i=1;i<=n;i++) {
+		if (lua_rawgeti(L, 2, i) != LUA_TTABLE)
+			return luaL_error(L, "Error: invalid file %d", i);
+		int item = lua_gettop(L);
+		lua_rawgeti(L, item, 1);
+		lua_rawgeti(L, item, 2);
+		lua_rawgeti(L, item, 3);
+		size_t namesz;
+		const char *name = luaL_checklstring(L, item + 1, &namesz);
+		const char *filename = luaL_checkstring(L, item + 2);
+		int level = (int)luaL_optinteger(L, item + 3, -1);
+		lua_settop(L, item - 1);	// the strings are referenced by the list
+		if (level < 0) {
+			store_file(L, w, name, namesz, filename);
+		} else {
+			jobs[njob].filename = filename;
+			jobs[njob].level = level;
+			slots[njob] = i;
+			if (++njob == BUNDLE_BATCH) {
+				write_jobs(L, w, jobs, slots, njob);
+				njob = 0;
+			}
+		}
+	}
+	write_jobs(L, w, jobs, slots, njob);
+	return 0;
+}
+
+// copies the entry from another bundle as it is, without recompressing
+static int
+bundle_writer_copyfrom(lua_State *L) {
+	struct bundle_writer *w = check_writer(L);
+	struct bundle_reader *r = (struct bundle_reader *)luaL_checkudata(L, 3, "ZIP_BUNDLE");
+	if (r->addr == NULL)
+		return luaL_error(L, "Error: closed");
+	const struct bundle_entry *src = find_entry(L, r, 2);
+	if (src == NULL)
+		return luaL_error(L, "Error: %s not in bundle", lua_tostring(L, 2));
+	struct bundle_entry *e = new_entry_arg(L, w, 2);
+	e->method = src->method;
+	e->size = src->size;
+	e->raw_size = src->raw_size;
+	write_data(L, w, r->addr + src->offset, (size_t)src->size);
+	w->written -= src->size;
+	w->copied += src->size;
+	w->count++;
+	return 0;
+}
+
+// the entries loaded from the old bundle, append mode only
+static struct bundle_entry *
+find_loaded(lua_State *L, struct bundle_writer *w, int index) {
+	size_t sz;
+	const char *name = luaL_checklstring(L, index, &sz);
+	uint8_t hash[BUNDLE_HASHSIZE];
+	if (!parse_hash(name, sz, hash))
+		return NULL;
+	uint32_t begin = 0;
+	uint32_t end = w->loaded;
+	while (begin < end) {
+		uint32_t mid = (begin + end) / 2;
+		struct bundle_entry *e = &w->entries[mid];
+		int c = memcmp(hash, e->hash, BUNDLE_HASHSIZE);
+		if (c == 0)
+			return e->method == BUNDLE_REMOVED ? NULL : e;
+		if (c < 0)
+			end = mid;
+		else
+			begin = mid + 1;
+	}
+	return NULL;
+}
+
+static int
+bundle_writer_exist(lua_State *L) {
+	struct bundle_writer *w = check_writer(L);
+	lua_pushboolean(L, find_loaded(L, w, 2) != NULL);
+	return 1;
+}
+
+// removes the entry from the index, its payload is garbage
+static int
+bundle_writer_remove(lua_State *L) {
+	struct bundle_writer *w = check_writer(L);
+	struct bundle_entry *e = find_loaded(L, w, 2);
+	if (e == NULL)
+		return 0;
+	e->method = BUNDLE_REMOVED;
+	w->garbage += e->size;
+	w->removed++;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int
+bundle_writer_list(lua_State *L) {
+	struct bundle_writer *w = check_writer(L);
+	lua_createtable(L, w->loaded, 0);
+	uint32_t i;
+	int n = 0;
+	for (i=0;i<w->loaded;i++) {
+		if (w->entries[i].method != BUNDLE_REMOVED) {
+			push_hash(L, w->entries[i].hash);
+			lua_rawseti(L, -2, ++n);
+		}
+	}
+	return 1;
+}
+
+static int
+bundle_writer_stat(lua_State *L) {
+	struct bundle_writer *w = check_writer(L);
+	lua_createtable(L, 0, 8);
+	lua_pushinteger(L, w->count - w->removed);
+	lua_setfield(L, -2, "count");
+	lua_pushinteger(L, w->capacity);
+	lua_setfield(L, -2, "capacity");
+	lua_pushinteger(L, w->loaded - w->removed);
+	lua_setfield(L, -2, "reused");
+	lua_pushinteger(L, w->removed);
+	lua_setfield(L, -2, "removed");
+	lua_pushinteger(L, (lua_Integer)w->written);
+	lua_setfield(L, -2, "written");
+	lua_pushinteger(L, (lua_Integer)w->copied);
+	lua_setfield(L, -2, "copied");
+	lua_pushinteger(L, (lua_Integer)w->garbage);
+	lua_setfield(L, -2, "garbage");
+	lua_pushinteger(L, (lua_Integer)w->offset);
+	lua_setfield(L, -2, "size");
+	return 1;
+}
+
+static int
+compare_entry(const void *a, const void *b) {
+	const struct bundle_entry *ea = (const struct bundle_entry *)a;
+	const struct bundle_entry *eb = (const struct bundle_entry *)b;
+	return memcmp(ea->hash, eb->hash, BUNDLE_HASHSIZE);
+}
+
+static void
+free_writer(struct bundle_writer *w) {
+	if (w->f) {
+		fclose(w->f);
+		w->f = NULL;
+	}
+	free(w->entries);
+	w->entries = NULL;
+}
+
+static int
+write_header(FILE *f, const struct bundle_header *h) {
+	return fseek(f, 0, SEEK_SET) == 0
+		&& fwrite(h, sizeof(*h), 1, f) == 1
+		&& fflush(f) == 0;
+}
+
+static int
+bundle_writer_close(lua_State *L) {
+	struct bundle_writer *w = check_writer(L);
+	uint32_t i;
+	uint32_t n = 0;
+	for (i=0;i<w->count;i++) {
+		if (w->entries[i].method != BUNDLE_REMOVED)
+			w->entries[n++] = w->entries[i];
+	}
+	w->count = n;
+	qsort(w->entries, w->count, sizeof(struct bundle_entry), compare_entry);
+	for (i=1;i<w->count;i++) {
+		if (memcmp(w->entries[i-1].hash, w->entries[i].hash, BUNDLE_HASHSIZE) == 0) {
+			push_hash(L, w->entries[i].hash);
+			free_writer(w);
+			return luaL_error(L, "Error: %s exist", lua_tostring(L, -1));
+		}
+	}
+	struct bundle_header h;
+	memset(&h, 0, sizeof(h));
+	h.version = BUNDLE_VERSION;
+	h.count = w->count;
+	h.align = BUNDLE_ALIGN;
+	h.capacity = w->capacity;
+	// the magic is written at last, the bundle is invalid if it's interrupted while the index is rewriting
+	int ok = fflush(w->f) == 0
+		&& write_header(w->f, &h)
+		&& (w->count == 0 || fwrite(w->entries, sizeof(struct bundle_entry), w->count, w->f) == w->count)
+		&& fflush(w->f) == 0;
+	if (ok) {
+		memcpy(h.magic, BUNDLE_MAGIC, 4);
+		ok = write_header(w->f, &h);
+	}
+	ok = (fclose(w->f) == 0) && ok;
+	w->f = NULL;
+	free_writer(w);
+	if (!ok)
+		return luaL_error(L, "Error: close bundle");
+	return 0;
+}
+
+static int
+bundle_writer_gc(lua_State *L) {
+	struct bundle_writer *w = (struct bundle_writer *)luaL_checkudata(L, 1, "ZIP_BUNDLE_WRITE");
+	// the index is not written, a new bundle is invalid, and an appended one keeps the old index
+	free_writer(w);
+	return 0;
+}
+
+static struct bundle_writer *
+new_writer(lua_State *L) {
+	struct bundle_writer *w = (struct bundle_writer *)lua_newuserdatauv(L, sizeof(*w), 0);
+	memset(w, 0, sizeof(*w));
+	if (luaL_newmetatable(L, "ZIP_BUNDLE_WRITE")) {
+		luaL_Reg l[] = {
+			{ "__index", NULL },
+			{ "__gc", bundle_writer_gc },
+			{ "add", bundle_writer_add },
+			{ "addfile", bundle_writer_addfile },
+			{ "addfiles", bundle_writer_addfiles },
+			{ "copyfrom", bundle_writer_copyfrom },
+			{ "exist", bundle_writer_exist },
+			{ "remove", bundle_writer_remove },
+			{ "list", bundle_writer_list },
+			{ "stat", bundle_writer_stat },
+			{ "close", bundle_writer_close },
+			{ "abort", bundle_writer_gc },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, l, 0);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	return w;
+}
+
+// capacity is the max number of files, the index is reserved at the head
+int
+lbundle_writer(lua_State *L) {
+	const char *filename = luaL_checkstring(L, 1);
+	lua_Integer capacity = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, capacity >= 0 && capacity <= UINT32_MAX, 2, "invalid capacity");
+	struct bundle_writer *w = new_writer(L);
+	w->capacity = (uint32_t)capacity;
+	w->entries = (struct bundle_entry *)calloc(capacity > 0 ? capacity : 1, sizeof(struct bundle_entry));
+	if (w->entries == NULL)
+		return luaL_error(L, "Bundle OOM");
+	w->f = luazip_fopen(filename, "wb");
+	if (w->f == NULL)
+		return luaL_error(L, "Can't open %s", filename);
+	w->offset = align_offset(sizeof(struct bundle_header) + (uint64_t)capacity * sizeof(struct bundle_entry));
+	if (fseek(w->f, (long)w->offset, SEEK_SET) != 0)
+		return luaL_error(L, "Error: seek %s", filename);
+	return 1;
+}
+
+// opens a bundle to append, returns nil if it's not a valid bundle
+int
+lbundle_append(lua_State *L) {
+	const char *filename = luaL_checkstring(L, 1);
+	FILE *f = luazip_fopen(filename, "r+b");
+	if (f == NULL)
+		return 0;
+	struct bundle_header h;
+	if (fread(&h, sizeof(h), 1, f) != 1
+		|| memcmp(h.magic, BUNDLE_MAGIC, 4) != 0
+		|| h.version != BUNDLE_VERSION
+		|| h.count > h.capacity) {
+		fclose(f);
+		return 0;
+	}
+	struct bundle_writer *w = new_writer(L);
+	w->f = f;
+	w->capacity = h.capacity;
+	w->count = h.count;
+	w->loaded = h.count;
+	// the removed entries keep their slots until close
+	w->entries = (struct bundle_entry *)calloc((size_t)h.capacity + h.count + 1, sizeof(struct bundle_entry));
+	if (w->entries == NULL)
+		return luaL_error(L, "Bundle OOM");
+	if (h.count > 0 && fread(w->entries, sizeof(struct bundle_entry), h.count, f) != h.count) {
+		free_writer(w);
+		return 0;
+	}
+	w->offset = file_size(f);
+	return 1;
+}
@@ -0,0 +1,32 @@
+#ifndef zip_bundle_h
+#define zip_bundle_h
+
+#include <stddef.h>
+
+#define BUNDLE_STORE 0
+#define BUNDLE_DEFLATE 1
+
+// deflates src if it saves at least 1/8, *out is malloced (NULL if it's stored)
+int bundle_deflate(const void *src, size_t sz, int level, void **out, size_t *outsz);
+
+#define BUNDLE_JOB_OK 0
+#define BUNDLE_JOB_OPEN 1
+#define BUNDLE_JOB_READ 2
+#define BUNDLE_JOB_MEMORY 3
+
+// read a file and deflate it, in bundle_job.cpp
+struct bundle_job {
+	const char *filename;
+	int level;
+	// results
+	int err;
+	int method;
+	void *data;		// malloced, the content or the compressed content
+	size_t size;
+	size_t raw_size;
+};
+
+// runs the jobs in a pool of threads, returns after all of them are done
+void bundle_job_run(struct bundle_job *jobs, int n);
+
+#endif
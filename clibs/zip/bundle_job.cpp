@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include "worker.h"
+
+extern "C" {
+#include "bundle.h"
+FILE * luazip_fopen(const char *filename, const char *mode);
+}
+
+static size_t
+file_size(FILE *f) {
+#ifdef _WIN32
+	_fseeki64(f, 0, SEEK_END);
+	long long size = _ftelli64(f);
+	_fseeki64(f, 0, SEEK_SET);
+#else
+	fseeko(f, 0, SEEK_END);
+	off_t size = ftello(f);
+	fseeko(f, 0, SEEK_SET);
+#endif
+	return size < 0 ? 0 : (size_t)size;
+}
+
+static void
+run_job(bundle_job &job) {
+	FILE *f = luazip_fopen(job.filename, "rb");
+	if (f == NULL) {
+		job.err = BUNDLE_JOB_OPEN;
+		return;
+	}
+	size_t sz = file_size(f);
+	void *content = malloc(sz > 0 ? sz : 1);
+	if (content == NULL) {
+		fclose(f);
+		job.err = BUNDLE_JOB_MEMORY;
+		return;
+	}
+	size_t bytes = fread(content, 1, sz, f);
+	fclose(f);
+	if (bytes != sz) {
+		free(content);
+		job.err = BUNDLE_JOB_READ;
+		return;
+	}
+	job.raw_size = sz;
+	void *compressed = NULL;
+	size_t len = 0;
+	if (bundle_deflate(content, sz, job.level, &compressed, &len) == BUNDLE_DEFLATE) {
+		free(content);
+		job.method = BUNDLE_DEFLATE;
+		job.data = compressed;
+		job.size = len;
+	} else {
+		job.method = BUNDLE_STORE;
+		job.data = content;
+		job.size = sz;
+	}
+}
+
+void
+bundle_job_run(struct bundle_job *jobs, int n) {
+	for (int i = 0; i < n; ++i) {
+		jobs[i].err = BUNDLE_JOB_OK;
+		jobs[i].method = BUNDLE_STORE;
+		jobs[i].data = NULL;
+		jobs[i].size = 0;
+		jobs[i].raw_size = 0;
+	}
+	worker_pool pool;
+	uint32_t nthread = std::thread::hardware_concurrency();
+	if (nthread > 1 && n > 1) {
+		pool.resize(std::min(nthread, (uint32_t)n) - 1);
+	}
+	pool.run((uint32_t)n, [jobs](uint32_t idx, uint32_t) {
+		run_job(jobs[idx]);
+	});
+}
@@ -132,6 +132,11 @@ file_open(lua_State *L, const char *filename, const char *mode) {
 
 #endif
 
+FILE *
+luazip_fopen(const char *filename, const char *mode) {
+	return file_open(NULL, filename, mode);
+}
+
 struct ziphandle {
 	zipFile h;
 };
@@ -881,6 +886,9 @@ luaopen_zip(lua_State *L) {
 		{ "reader", lreader },
 		{ "reader_consume", lreader_consume },
 		{ "reader_dump", lreader_dump },
+		{ "bundle", lbundle_open },
+		{ "bundle_writer", lbundle_writer },
+		{ "bundle_append", lbundle_append },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L, l);
@@ -2,7 +2,16 @@
 #define luazip_h
 
 #include <stddef.h>
+#include <stdio.h>
 
 int luaopen_zip(lua_State *L);
 
+// utf8 filename
+FILE * luazip_fopen(const char *filename, const char *mode);
+
+// bundle.c
+int lbundle_open(lua_State *L);
+int lbundle_writer(lua_State *L);
+int lbundle_append(lua_State *L);
+
 #endif
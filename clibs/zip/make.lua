@@ -254,7 +254,10 @@ lm:lua_src "zip-binding" {
         ZLIBDIR,
         "$builddir/gen-zlib",
     },
-    sources = "*.c",
+    sources = {
+        "*.c",
+        "*.cpp",
+    },
 }
 
 lm:lua_src "zip" {
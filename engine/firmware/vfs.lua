@@ -68,13 +68,21 @@ function vfs.new(config)
 		root = nil,
 		ziproot = "",
 	}
-	local zipfile = zip.open(repo.bundlepath.."00.zip", "r")
-	if not zipfile then
-		print("Can't open " .. repo.bundlepath .. "00.zip")
-	else
-		repo.zipfile = zipfile
-		repo.zipreader = zip.reader(zipfile, repo.cachesize)
+	local bundle = zip.bundle(repo.bundlepath.."00.bundle")
+	if bundle then
+		-- the stored files are returned from the mapping without copy
+		repo.zipfile = bundle
+		repo.zipreader = bundle
 		repo.ziproot = fastio.readall_s(repo.bundlepath .. "00.hash")
+	else
+		local zipfile = zip.open(repo.bundlepath.."00.zip", "r")
+		if not zipfile then
+			print("Can't open " .. repo.bundlepath .. "00.bundle")
+		else
+			repo.zipfile = zipfile
+			repo.zipreader = zip.reader(zipfile, repo.cachesize)
+			repo.ziproot = fastio.readall_s(repo.bundlepath .. "00.hash")
+		end
 	end
 	setmetatable(repo, vfs)
 	return repo
@@ -114,7 +122,8 @@ function vfs:open(hash)
 			return c
 		end
 	end
-	return fastio.readall_v_noerr(self.localpath .. "/" .. hash)
+	-- the cache is named by hash and never rewritten, so it can be mapped
+	return fastio.mmap_noerr(self.localpath .. "/" .. hash)
 end
 
 local function get_cachepath(setting, name)
@@ -0,0 +1,347 @@
+#include "ecs/world.h"
+#include "ecs/select.h"
+#include "ecs/component.hpp"
+
+#include "worker.h"
+#include "ozz.h"
+#include "render/queue.h"
+
+extern "C" {
+	#include "math3d.h"
+}
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include <cmath>
+
+// the animation instances of animation_changed entities are sampled in one pass, each instance owns its own
+// contexts and outputs, and skeletons/animations are read only, so the list can be split across worker threads
+struct animation_cache {
+	// lists smaller than this are sampled in the calling thread
+	static constexpr uint32_t PARALLEL_SIZE = 32;
+	static constexpr uint32_t JOB_SIZE = 8;
+
+	// the lod of the instances is decided by the cull results of their skinned meshes and the distance to camera.
+	// cull runs after animation, so it's the results of last frame
+	struct lod_level {
+		float	distance;	// squared
+		uint8_t	rate;
+	};
+	struct lod_config {
+		bool					enable = false;
+		uint8_t					invisible = 0;	// rate of the instances which are not visible in any queue
+		std::vector<uint8_t>	queues;
+		std::vector<lod_level>	levels;			// sorted by distance
+	};
+
+	// the instances which sample one animation at the same quantized ratio share one pose in a frame:
+	// the first one samples it, the others copy its models. 0 fps disables it
+	struct pose_key {
+		const ozz::animation::Animation*	animation;
+		const ozz::animation::Skeleton*		skeleton;
+		uint32_t							frame;
+		bool operator==(const pose_key&) const = default;
+	};
+	struct pose_hash {
+		size_t operator()(const pose_key& k) const {
+			return std::hash<const void*>()(k.animation) ^ (std::hash<const void*>()(k.skeleton) << 1) ^ ((size_t)k.frame * 0x9e3779b97f4a7c15ull);
+		}
+	};
+	struct pose_follower {
+		ozzAnimationInstance*		inst;
+		const ozzAnimationInstance*	from;
+	};
+	struct pose_cache {
+		float											fps = 0.f;
+		std::unordered_map<pose_key, ozzAnimationInstance*, pose_hash>	poses;
+		std::vector<pose_follower>						followers;
+		uint64_t										sampled = 0;
+		uint64_t										shared = 0;
+	};
+
+	std::vector<ozzAnimationInstance*>	instances;
+	worker_pool							workers;
+	lod_config							lod;
+	pose_cache							cache;
+};
+
+static int
+animation_init(lua_State *L) {
+	auto w = getworld(L);
+	w->animation_cache = new animation_cache;
+	return 0;
+}
+
+static int
+animation_exit(lua_State *L) {
+	auto w = getworld(L);
+	delete w->animation_cache;
+	w->animation_cache = nullptr;
+	return 0;
+}
+
+static int
+set_workers(lua_State *L) {
+	auto w = getworld(L);
+	const lua_Integer n = luaL_checkinteger(L, 1);
+	if (n < 0 || n > 64) {
+		return luaL_error(L, "Invalid animation workers: %d", (int)n);
+	}
+	w->animation_cache->workers.resize((uint32_t)n);
+	return 0;
+}
+
+static uint8_t
+check_rate(lua_State *L, lua_Integer rate) {
+	if (rate < 0 || rate > 255) {
+		luaL_error(L, "Invalid animation lod rate: %d", (int)rate);
+	}
+	return (uint8_t)rate;
+}
+
+// 1: { enable = bool, invisible = rate, queues = { queue_index, ... }, levels = { { distance, rate }, ... } }
+static int
+set_lod(lua_State *L) {
+	auto w = getworld(L);
+	luaL_checktype(L, 1, LUA_TTABLE);
+	animation_cache::lod_config lod;
+	lua_getfield(L, 1, "enable");
+	lod.enable = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	lua_getfield(L, 1, "invisible");
+	lod.invisible = check_rate(L, luaL_optinteger(L, -1, 0));
+	lua_pop(L, 1);
+	if (lua_getfield(L, 1, "queues") == LUA_TTABLE) {
+		const lua_Integer n = luaL_len(L, -1);
+		for (lua_Integer ii = 1; ii <= n; ++ii) {
+			lua_geti(L, -1, ii);
+			const lua_Integer q = luaL_checkinteger(L, -1);
+			if (q < 0 || q >= MAX_VISIBLE_QUEUE) {
+				return luaL_error(L, "Invalid queue index: %d", (int)q);
+			}
+			lod.queues.push_back((uint8_t)q);
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+	if (lua_getfield(L, 1, "levels") == LUA_TTABLE) {
+		const lua_Integer n = luaL_len(L, -1);
+		for (lua_Integer ii = 1; ii <= n; ++ii) {
+			lua_geti(L, -1, ii);
+			luaL_checktype(L, -1, LUA_TTABLE);
+			lua_geti(L, -1, 1);
+			const float d = (float)luaL_checknumber(L, -1);
+			lua_geti(L, -2, 2);
+			const uint8_t rate = check_rate(L, luaL_checkinteger(L, -1));
+			lod.levels.push_back({ d * d, rate });
+			lua_pop(L, 3);
+		}
+	}
+	lua_pop(L, 1);
+	std::sort(lod.levels.begin(), lod.levels.end(), [](auto const& a, auto const& b) { return a.distance < b.distance; });
+	auto ac = w->animation_cache;
+	ac->lod = std::move(lod);
+	if (!ac->lod.enable) {
+		for (auto& e : ecs::select<component::animation_instance>(w->ecs)) {
+			auto inst = (ozzAnimationInstance*)e.get<component::animation_instance>().instance;
+			if (inst && inst->rate != 1) {
+				inst->rate = 1;
+				if (inst->pending) {
+					e.enable_tag<component::animation_changed>();
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static inline bool
+visible_in_queues(struct queue_container* Q, const component::render_object& ro, std::vector<uint8_t> const& queues) {
+	for (auto q : queues) {
+		if (queue_check(Q, ro.visible_idx, q) && !queue_check(Q, ro.cull_idx, q))
+			return true;
+	}
+	return false;
+}
+
+// 1-3: camera position
+// it sets the lod rate of every instance, and fixes animation_changed by the lod: the skipped ones are removed, the interpolated ones are added
+static int
+lod(lua_State *L) {
+	auto w = getworld(L);
+	auto& cfg = w->animation_cache->lod;
+	if (!cfg.enable) {
+		return 0;
+	}
+	const float camera[3] = {
+		(float)luaL_checknumber(L, 1),
+		(float)luaL_checknumber(L, 2),
+		(float)luaL_checknumber(L, 3),
+	};
+
+	// the instances without skins can't be culled, they follow the distance only
+	for (auto& e : ecs::select<component::animation_instance>(w->ecs)) {
+		auto inst = (ozzAnimationInstance*)e.get<component::animation_instance>().instance;
+		if (inst) {
+			inst->visible = inst->skins.empty();
+		}
+	}
+	for (auto& e : ecs::select<component::animation_skin, component::render_object>(w->ecs)) {
+		auto inst = (ozzAnimationInstance*)e.get<component::animation_skin>().instance;
+		if (inst && !inst->visible && visible_in_queues(w->Q, e.get<component::render_object>(), cfg.queues)) {
+			inst->visible = true;
+		}
+	}
+
+	auto math3d = w->math3d->M;
+	for (auto& e : ecs::select<component::animation_instance, component::scene>(w->ecs)) {
+		auto inst = (ozzAnimationInstance*)e.get<component::animation_instance>().instance;
+		if (!inst)
+			continue;
+		uint8_t rate = cfg.invisible;
+		if (inst->visible) {
+			rate = 1;
+			auto const& s = e.get<component::scene>();
+			if (!math_isnull(s.worldmat)) {
+				const float *t = math_value(math3d, s.worldmat) + 12;
+				const float dx = t[0] - camera[0], dy = t[1] - camera[1], dz = t[2] - camera[2];
+				const float d = dx * dx + dy * dy + dz * dz;
+				for (auto const& level : cfg.levels) {
+					if (d < level.distance)
+						break;
+					rate = level.rate;
+				}
+			}
+		}
+		inst->rate = rate;
+		const bool changed = e.component<component::animation_changed>();
+		if (inst->schedule(changed)) {
+			if (!changed)
+				e.enable_tag<component::animation_changed>();
+		} else if (changed) {
+			e.disable_tag<component::animation_changed>();
+		}
+	}
+	return 0;
+}
+
+// f(index) for [0, num), split into jobs on the workers if the list is large enough
+template <typename F>
+static void
+run(animation_cache* ac, uint32_t num, F&& f) {
+	if (num < animation_cache::PARALLEL_SIZE || ac->workers.size() == 0) {
+		for (uint32_t ii = 0; ii < num; ++ii) {
+			f(ii);
+		}
+	} else {
+		ac->workers.run((num + animation_cache::JOB_SIZE - 1) / animation_cache::JOB_SIZE, [&](uint32_t job, uint32_t) {
+			const uint32_t from = job * animation_cache::JOB_SIZE;
+			const uint32_t to = std::min(from + animation_cache::JOB_SIZE, num);
+			for (uint32_t ii = from; ii < to; ++ii) {
+				f(ii);
+			}
+		});
+	}
+}
+
+static int
+sample(lua_State *L) {
+	auto w = getworld(L);
+	auto ac = w->animation_cache;
+	auto& instances = ac->instances;
+	instances.clear();
+	for (auto& e : ecs::select<component::animation_changed, component::animation_instance>(w->ecs)) {
+		auto& ai = e.get<component::animation_instance>();
+		if (ai.instance) {
+			instances.push_back((ozzAnimationInstance*)ai.instance);
+		}
+	}
+
+	std::atomic<bool> failed{false};
+	auto& cache = ac->cache;
+	if (cache.fps > 0.f) {
+		// the owners stay in instances, the followers wait for them
+		cache.poses.clear();
+		cache.followers.clear();
+		size_t n = 0;
+		for (auto inst : instances) {
+			auto layer = inst->action == ozzAnimationInstance::Action::sample ? inst->single_layer() : nullptr;
+			if (layer) {
+				const float frames = layer->animation->duration() * cache.fps;
+				const uint32_t frame = (uint32_t)std::lround(layer->ratio * frames);
+				auto [it, inserted] = cache.poses.try_emplace(animation_cache::pose_key { layer->animation, inst->skeleton, frame }, inst);
+				if (!inserted) {
+					cache.followers.push_back({ inst, it->second });
+					continue;
+				}
+				layer->ratio = frames > 0.f ? std::min((float)frame / frames, 1.f) : 0.f;
+			}
+			instances[n++] = inst;
+		}
+		instances.resize(n);
+		cache.sampled += n;
+		cache.shared += cache.followers.size();
+	}
+
+	run(ac, (uint32_t)instances.size(), [&](uint32_t ii) {
+		if (!instances[ii]->update())
+			failed = true;
+	});
+	if (failed) {
+		return luaL_error(L, "Animation sampling failed!");
+	}
+	auto& followers = cache.followers;
+	run(ac, (uint32_t)followers.size(), [&](uint32_t ii) {
+		followers[ii].inst->share(*followers[ii].from);
+	});
+	followers.clear();
+	return 0;
+}
+
+// 1: fps of the quantized ratio, 0 disables the pose cache
+static int
+set_pose_cache(lua_State *L) {
+	auto w = getworld(L);
+	const float fps = (float)luaL_checknumber(L, 1);
+	if (fps < 0.f) {
+		return luaL_error(L, "Invalid pose cache fps: %f", fps);
+	}
+	w->animation_cache->cache.fps = fps;
+	return 0;
+}
+
+static int
+pose_cache_stat(lua_State *L) {
+	auto w = getworld(L);
+	auto& cache = w->animation_cache->cache;
+	lua_createtable(L, 0, 3);
+	lua_pushnumber(L, cache.fps);
+	lua_setfield(L, -2, "fps");
+	lua_pushinteger(L, (lua_Integer)cache.sampled);
+	lua_setfield(L, -2, "sampled");
+	lua_pushinteger(L, (lua_Integer)cache.shared);
+	lua_setfield(L, -2, "shared");
+	return 1;
+}
+
+extern "C" int
+luaopen_system_animation(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{ "init", animation_init },
+		{ "exit", animation_exit },
+		{ "set_workers", set_workers },
+		{ "set_lod", set_lod },
+		{ "lod", lod },
+		{ "sample", sample },
+		{ "set_pose_cache", set_pose_cache },
+		{ "pose_cache_stat", pose_cache_stat },
+		{ NULL, NULL },
+	};
+	luaL_newlibtable(L,l);
+	lua_pushnil(L);
+	luaL_setfuncs(L,l,1);
+	return 1;
+}
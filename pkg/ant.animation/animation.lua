@@ -6,87 +6,54 @@ local assetmgr = import_package "ant.asset"
 local skinning = ecs.require "skinning"
 
 local ozz = require "ozz"
+local animation = world:clibs "system.animation"
 local api = {}
 
 function api.create(filename)
     local data = assetmgr.resource(filename)
     local skeleton = data.skeleton
+    local models = ozz.MatrixVector(skeleton:num_joints())
+    local instance = ozz.AnimationInstance(skeleton, models)
     local status = {}
+    local layers = {}
     local skins = {}
     for name, handle in pairs(data.animations) do
-        status[name] = {
+        local s = {
             handle = handle,
-            sampling = ozz.SamplingJobContext(handle:num_tracks()),
             ratio = 0,
             weight = 0,
         }
+        status[name] = s
+        layers[instance:add_layer(handle)] = s
     end
     if data.skins then
         for i, skin in ipairs(data.skins) do
-            skins[i] = skinning.create(skin, skeleton)
+            local obj = skinning.create(skin, skeleton)
+            instance:add_skin(obj.matrices, obj.inverseBindMatrices, obj.jointsRemap)
+            skins[i] = obj
         end
     end
     local obj = {
         skeleton = skeleton,
         status = status,
-        blending_layers = ozz.BlendingJobLayerVector(),
-        blending_threshold = 0.1,
-        locals_pool = {},
-        models = ozz.MatrixVector(skeleton:num_joints()),
+        -- status of the instance layers, in layer order
+        layers = layers,
+        instance = instance,
+        models = models,
         skins = skins,
     }
     return obj
 end
 
-local function resize_locals(ani, n)
-    local locals = ani.locals_pool
-    if #locals < n then
-        local size = ani.skeleton:num_soa_joints()
-        for i = #locals + 1, n do
-            locals[i] = ozz.SoaTransformVector(size)
-        end
-    end
-end
-
-local function sampling(ani)
-    local skeleton = ani.skeleton
-    local layer = {}
-    for _, status in pairs(ani.status) do
-        if status.weight > 0 then
-            layer[#layer+1] = status
-        end
-    end
-    if #layer == 0 then
-        ozz.LocalToModelJob(skeleton, nil, ani.models)
-        return
-    elseif #layer == 1 then
-        resize_locals(ani, 1)
-        local status = layer[1]
-        local locals = ani.locals_pool[1]
-        ozz.SamplingJob(status.handle, status.sampling, locals, status.ratio)
-        ozz.LocalToModelJob(skeleton, locals, ani.models)
-        return
-    end
-    local layers = ani.blending_layers
-    layers:resize(#layer)
-    resize_locals(ani, #layer + 1)
-    for i = 1, #layer do
-        local status = layer[i]
-        local locals = ani.locals_pool[i]
-        ozz.SamplingJob(status.handle, status.sampling, locals, status.ratio)
-        layers:set(i, locals, status.weight)
-    end
-    local locals = ani.locals_pool[#layer + 1]
-    ozz.BlendingJob(layers, locals, skeleton, ani.blending_threshold)
-    ozz.LocalToModelJob(skeleton, locals, ani.models)
+-- the weights and ratios are written by lua in status, copy them into the instance before sampling
+function api.sync(obj)
+    obj.instance:sync(obj.layers)
 end
 
 function api.sample(e)
     local obj = e.animation
-    sampling(obj)
-    for _, skin in ipairs(obj.skins) do
-        skinning.build(obj.models, skin)
-    end
+    api.sync(obj)
+    obj.instance:sample()
 end
 
 function api.set_status(e, name, ratio, weight)
@@ -138,4 +105,9 @@ function api.get_duration(e, name)
     end
 end
 
+-- { fps, sampled, shared }: the number of poses sampled and shared since startup
+function api.pose_cache_stat()
+    return animation.pose_cache_stat()
+end
+
 return api
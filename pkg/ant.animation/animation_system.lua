@@ -2,17 +2,65 @@ local ecs   = ...
 local world = ecs.world
 local w     = world.w
 
+local setting = import_package "ant.settings"
+local ANIMATION_WORKERS<const> = setting:get "animation/workers" or 0
+local ENABLE_LOD<const> = setting:get "animation/lod/enable"
+local POSE_CACHE_FPS<const> = setting:get "animation/pose_cache/fps" or 0
+
+local math3d = require "math3d"
+
 local iani  = ecs.require "ant.animation|animation"
+local queuemgr = ecs.require "ant.render|queue_mgr"
+local irq   = ecs.require "ant.render|renderqueue"
+local animation = world:clibs "system.animation"
 
 local m = ecs.system "animation_system"
 
+function m:init()
+    animation.init()
+end
+
+local function lod_config()
+    local queues = { queuemgr.queue_index "main_queue" }
+    if setting:get "animation/lod/shadow" then
+        for i = 1, 4 do
+            queues[#queues+1] = queuemgr.queue_index("csm" .. i .. "_queue")
+        end
+    end
+    local levels = {}
+    local distances = setting:get "animation/lod/distances" or {}
+    local rates = setting:get "animation/lod/rates" or {}
+    for i, d in ipairs(distances) do
+        levels[i] = { d, rates[i] or 1 }
+    end
+    return {
+        enable = true,
+        invisible = setting:get "animation/lod/invisible" or 0,
+        queues = queues,
+        levels = levels,
+    }
+end
+
+function m:post_init()
+    animation.set_workers(ANIMATION_WORKERS)
+    animation.set_pose_cache(POSE_CACHE_FPS)
+    if ENABLE_LOD then
+        animation.set_lod(lod_config())
+    end
+end
+
+function m:exit()
+    animation.exit()
+end
+
 function m:component_init()
     local animations = {}
-    for e in w:select "INIT scene:in eid:in animation?update skinning?update animation_changed?out" do
+    for e in w:select "INIT scene:in eid:in animation?update skinning?update animation_changed?out animation_instance?out animation_skin?out" do
         if e.animation ~= nil then
             local obj = iani.create(e.animation)
             e.animation = obj
             e.animation_changed = true
+            e.animation_instance = { instance = obj.instance:pointer() }
             animations[e.eid] = obj
         elseif e.scene.parent ~= 0 then
             local obj = animations[e.scene.parent]
@@ -20,6 +68,7 @@ function m:component_init()
                 animations[e.eid] = obj
                 if e.skinning ~= nil then
                     e.skinning = obj.skins[e.skinning]
+                    e.animation_skin = { instance = obj.instance:pointer() }
                 end
             end
         end
@@ -27,11 +76,18 @@ function m:component_init()
 end
 
 function m:animation_sample()
+    if ENABLE_LOD then
+        local ce = irq.main_camera_entity "scene:in"
+        if ce then
+            animation.lod(math3d.index(math3d.index(ce.scene.worldmat, 4), 1, 2, 3))
+        end
+    end
     for e in w:select "animation_changed animation:in" do
-        iani.sample(e)
+        iani.sync(e.animation)
     end
+    animation.sample()
 end
 
 function m:final()
     w:clear "animation_changed"
-end
\ No newline at end of file
+end
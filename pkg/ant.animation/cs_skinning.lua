@@ -0,0 +1,245 @@
+local ecs = ...
+local world = ecs.world
+local w = world.w
+
+local setting = import_package "ant.settings"
+local USE_CS_SKINNING <const> = setting:get "graphic/skinning/use_cs"
+
+-- compute skinning: a visible skinned mesh is skinned once in a frame into a range of the output arena, then all the passes
+-- (shadow/pre-depth/main) draw the range. The input is converted from the mesh vertex buffer, it's shared by the instances of the mesh.
+-- The output is in model space, and every vertex is bound to joint 0 with weight 1, so the vertex shader skinning only applies the world matrix.
+-- The meshes which don't get a range (over budget, or not visible) keep the vertex shader skinning, so do the ones whose matrices
+-- don't fit in the matrix buffer of this frame.
+local m = ecs.system "cs_skinning_system"
+local api = {}
+
+if not USE_CS_SKINNING then
+	return api
+end
+
+-- size of the output arena in vertices
+local BUDGET <const>		= setting:get "graphic/skinning/cs_budget" or 131072
+-- max matrices uploaded in one frame
+local MAX_MATRICES <const>	= setting:get "graphic/skinning/cs_max_matrices" or 16384
+-- the range of a mesh is released after it's not visible for these frames
+local IDLE_FRAMES <const>	= setting:get "graphic/skinning/cs_idle_frames" or 60
+local OUTPUT_LAYOUT <const>	= "p40NIf|n40NIf|T40NIf|i40Nii|w40NIh"
+local MATRIX_LAYOUT <const>	= "p40NIf"
+
+local bgfx		= require "bgfx"
+local math3d	= require "math3d"
+local hwi		= import_package "ant.hwi"
+local layoutmgr = import_package "ant.render".layoutmgr
+
+local icompute	= ecs.require "ant.render|compute.compute"
+local queuemgr	= ecs.require "ant.render|queue_mgr"
+
+local Q			= world:clibs "render.queue"
+local MESH		= world:clibs "render.mesh"
+
+local viewid <const> = hwi.viewid_get "skinning"
+
+local SKINNING_EID
+local READY
+local ARENA_HANDLE, MATRIX_HANDLE
+local QUEUES
+local FRAME = 0
+local NUM_MATRICES = 0
+
+-- eid -> { vb, start, num, frame, fallback }
+local SKINNED = {}
+-- eid -> true, the skeleton has more matrices than MAX_MATRICES, it's always vertex shader skinned
+local OVERSIZE = {}
+
+-- free ranges of the arena, { start, num }, sorted by start
+local FREE = { { 0, BUDGET } }
+
+local function arena_alloc(num)
+	for i, r in ipairs(FREE) do
+		if r[2] >= num then
+			local start = r[1]
+			if r[2] == num then
+				table.remove(FREE, i)
+			else
+				r[1], r[2] = start + num, r[2] - num
+			end
+			return start
+		end
+	end
+end
+
+local function arena_free(start, num)
+	local i = 1
+	while FREE[i] and FREE[i][1] < start do
+		i = i + 1
+	end
+	table.insert(FREE, i, { start, num })
+	local r, n = FREE[i], FREE[i+1]
+	if n and r[1] + r[2] == n[1] then
+		r[2] = r[2] + n[2]
+		table.remove(FREE, i+1)
+	end
+	local p = FREE[i-1]
+	if p and p[1] + p[2] == r[1] then
+		p[2] = p[2] + r[2]
+		table.remove(FREE, i)
+	end
+end
+
+local function buffer_property(handle, stage, access)
+	return {
+		type	= "b",
+		value	= handle,
+		stage	= stage,
+		access	= access,
+	}
+end
+
+local function on_ready(e)
+	w:extend(e, "dispatch:in")
+	local mi = e.dispatch.material
+	mi.b_skinning_matrices	= buffer_property(MATRIX_HANDLE, 0, "r")
+	mi.b_skinning_out		= buffer_property(ARENA_HANDLE, 2, "w")
+	READY = true
+end
+
+function m:init()
+	ARENA_HANDLE	= bgfx.create_dynamic_vertex_buffer(BUDGET, layoutmgr.get(OUTPUT_LAYOUT).handle, "w")
+	MATRIX_HANDLE	= bgfx.create_dynamic_vertex_buffer(MAX_MATRICES * 4, layoutmgr.get(MATRIX_LAYOUT).handle, "r")
+	SKINNING_EID	= world:create_entity {
+		policy = { "ant.render|compute" },
+		data = {
+			material	= "/pkg/ant.resources/materials/skinning/skinning.material",
+			dispatch	= { size = {1, 1, 1} },
+			on_ready	= on_ready,
+		}
+	}
+	QUEUES = { queuemgr.queue_index "main_queue" }
+	for i = 1, 4 do
+		QUEUES[#QUEUES+1] = queuemgr.queue_index("csm" .. i .. "_queue")
+	end
+end
+
+function m:exit()
+	bgfx.destroy(ARENA_HANDLE)
+	bgfx.destroy(MATRIX_HANDLE)
+	ARENA_HANDLE, MATRIX_HANDLE = nil, nil
+end
+
+-- cull runs after skinning, so it's the result of last frame
+local function visible(ro)
+	for i = 1, #QUEUES do
+		local q = QUEUES[i]
+		if Q.check(ro.visible_idx, q) and not Q.check(ro.cull_idx, q) then
+			return true
+		end
+	end
+end
+
+local function alloc(eid, ro, vb)
+	if not vb.cs_handle or OVERSIZE[eid] then
+		return
+	end
+	local start = arena_alloc(vb.num)
+	if start then
+		local declname = "|" .. vb.declname
+		SKINNED[eid] = {
+			vb				= vb,
+			start			= start,
+			num				= vb.num,
+			frame			= FRAME,
+			tangent_frame	= declname:match "|T" and not declname:match "|n",
+		}
+		MESH.set(ro.mesh_idx, "vb0", start, vb.num, ARENA_HANDLE)
+		return true
+	end
+end
+
+local function release(eid, ro)
+	local s = SKINNED[eid]
+	SKINNED[eid] = nil
+	arena_free(s.start, s.num)
+	if ro then
+		local vb = s.vb
+		MESH.set(ro.mesh_idx, "vb0", vb.start, vb.num, vb.handle)
+	end
+end
+
+-- allocates ranges for the skinned meshes which become visible, and releases the idle ones.
+-- the changed ones are marked as animation_changed, their skinning is updated in this frame
+function api.update()
+	if not READY then
+		return
+	end
+	FRAME = FRAME + 1
+	NUM_MATRICES = 0
+	for e in w:select "skinning render_object:in mesh_result:in eid:in animation_changed?update" do
+		local ro = e.render_object
+		local s = SKINNED[e.eid]
+		if visible(ro) then
+			if s then
+				s.frame = FRAME
+				if s.fallback then
+					-- the matrices didn't fit in the last frame, skin it again
+					e.animation_changed = true
+				end
+			elseif alloc(e.eid, ro, e.mesh_result.vb) then
+				e.animation_changed = true
+			end
+		elseif s and FRAME - s.frame > IDLE_FRAMES then
+			release(e.eid, ro)
+			e.animation_changed = true
+		end
+	end
+end
+
+-- skins the mesh into its range, returns false if it's not compute skinned in this frame
+function api.dispatch(e, skinning)
+	w:extend(e, "eid:in render_object:in")
+	local s = SKINNED[e.eid]
+	if not s then
+		return false
+	end
+	local sm = skinning.matrices
+	local count = sm:count()
+	if count > MAX_MATRICES then
+		OVERSIZE[e.eid] = true
+		release(e.eid, e.render_object)
+		return false
+	end
+	if NUM_MATRICES + count > MAX_MATRICES then
+		-- keep the range, draw the source vertices with vertex shader skinning in this frame
+		if not s.fallback then
+			s.fallback = true
+			local vb = s.vb
+			MESH.set(e.render_object.mesh_idx, "vb0", vb.start, vb.num, vb.handle)
+		end
+		return false
+	end
+	if s.fallback then
+		s.fallback = nil
+		MESH.set(e.render_object.mesh_idx, "vb0", s.start, s.num, ARENA_HANDLE)
+	end
+	bgfx.update(MATRIX_HANDLE, NUM_MATRICES * 4, bgfx.memory_buffer(sm:pointer(), 64 * count))
+
+	local ds = world:entity(SKINNING_EID, "dispatch:in").dispatch
+	local mi = ds.material
+	mi.b_skinning_in		= buffer_property(s.vb.cs_handle, 1, "r")
+	mi.u_skinning_param		= math3d.vector(s.num, s.vb.start, s.start, NUM_MATRICES)
+	mi.u_skinning_layout	= math3d.vector(s.tangent_frame and 1 or 0, 0, 0, 0)
+	ds.size[1] = (s.num + 63) // 64
+	icompute.dispatch(viewid, ds)
+	NUM_MATRICES = NUM_MATRICES + count
+	return true
+end
+
+function m:entity_remove()
+	for e in w:select "REMOVED skinning eid:in" do
+		if SKINNED[e.eid] then
+			release(e.eid)
+		end
+		OVERSIZE[e.eid] = nil
+	end
+end
+
+return api
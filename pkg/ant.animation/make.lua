@@ -0,0 +1,22 @@
+local lm = require "luamake"
+
+lm:lua_src "animation" {
+    deps = {
+        "ozz-animation-runtime",
+        "render_core",
+    },
+    includes = {
+        lm.AntDir .. "/3rd/luaecs",
+        lm.AntDir .. "/3rd/ozz-animation/include",
+        lm.AntDir .. "/3rd/bee.lua",
+        lm.AntDir .. "/3rd/math3d",
+        lm.AntDir .. "/clibs/ecs",
+        lm.AntDir .. "/clibs/foundation",
+        lm.AntDir .. "/clibs/ozz",
+        lm.AntDir .. "/pkg/ant.render",
+    },
+    sources = {
+        "animation.cpp",
+    },
+    objdeps = "compile_ecs",
+}
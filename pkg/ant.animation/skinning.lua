@@ -4,9 +4,6 @@ local w = world.w
 
 local setting = import_package "ant.settings"
 local USE_CS_SKINNING <const> = setting:get "graphic/skinning/use_cs"
-if USE_CS_SKINNING then
-	return
-end
 local ENABLE_TAA <const> = setting:get "graphic/postprocess/taa/enable"
 
 local imaterial = ecs.require "ant.render|material"
@@ -15,6 +12,7 @@ local mathpkg = import_package "ant.math"
 local assetmgr = import_package "ant.asset"
 local ozz = require "ozz"
 local math3d = require "math3d"
+local ics = ecs.require "cs_skinning"
 
 local r2l_mat <const> = mathpkg.constant.R2L_MAT
 
@@ -28,17 +26,25 @@ function m:component_init()
 end
 
 function m:follow_scene_update()
+	if USE_CS_SKINNING then
+		ics.update()
+	end
 	for e in w:select "scene_changed animation animation_changed?out" do
 		e.animation_changed = true
 	end
 	w:propagate("scene", "animation_changed")
 	for e in w:select "animation_changed skinning:in scene:in" do
 		local skinning = e.skinning
-		local sm = skinning.matrices
-		local matrices = math3d.array_matrix_ref(sm:pointer(), sm:count())
 		local mat = math3d.mul(e.scene.worldmat, r2l_mat)
 		math3d.unmark(skinning.matrices_id)
-		skinning.matrices_id = math3d.mark(math3d.mul_array(mat, matrices))
+		if USE_CS_SKINNING and ics.dispatch(e, skinning) then
+			-- the vertices are skinned in model space, they are all bound to joint 0
+			skinning.matrices_id = math3d.mark(mat)
+		else
+			local sm = skinning.matrices
+			local matrices = math3d.array_matrix_ref(sm:pointer(), sm:count())
+			skinning.matrices_id = math3d.mark(math3d.mul_array(mat, matrices))
+		end
 	end
 end
 
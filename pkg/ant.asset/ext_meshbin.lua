@@ -6,9 +6,14 @@ local layoutmgr = import_package "ant.render".layoutmgr
 local serialize = import_package "ant.serialize"
 
 local USE_CS_SKINNING <const> = setting:get "graphic/skinning/use_cs"
+-- the input of compute skinning: position, normal, tangent, indices and weights, all of them are float4
+local CS_SKINNING_LAYOUT <const> = "p40NIf|n40NIf|T40NIf|i40NIf|w40NIf"
 
 local function is_cs_skinning_buffer(layoutname)
-    return USE_CS_SKINNING and ("iw"):match(layoutname:sub(1, 1))
+    if USE_CS_SKINNING then
+        local l = "|" .. layoutname
+        return l:match "|i" and l:match "|w"
+    end
 end
 
 local proxy_vb = {}
@@ -46,13 +51,21 @@ function proxy_vb:__index(k)
         local membuf = mem2bgfx(self)
         local layoutname = self.declname
         local layouthandle = layoutmgr.get(layoutname).handle
-        local h = is_cs_skinning_buffer(layoutname) and
-                bgfx.create_dynamic_vertex_buffer(membuf, layouthandle, "r") or
-                bgfx.create_vertex_buffer(membuf, layouthandle)
+        if is_cs_skinning_buffer(layoutname) then
+            -- it's converted once for the mesh, and shared by all the skinned instances of it
+            local cslayout = layoutmgr.get(CS_SKINNING_LAYOUT).handle
+            self.cs_handle = bgfx.create_dynamic_vertex_buffer(bgfx.vertex_convert(membuf, layouthandle, cslayout), cslayout, "r")
+        end
+        local h = bgfx.create_vertex_buffer(membuf, layouthandle)
         self.handle = h
         return h
     end
 
+    if k == "cs_handle" then
+        local _ = self.handle
+        return rawget(self, "cs_handle")
+    end
+
     if k == "str" then
         local str = mem2str(self)
         self.str = str
@@ -101,7 +114,13 @@ local function destroy_handle(v)
 end
 
 local function delete(mesh)
-    destroy_handle(mesh.vb)
+    local vb = mesh.vb
+    local cs_handle = rawget(vb, "cs_handle")
+    if cs_handle then
+        bgfx.destroy(cs_handle)
+        vb.cs_handle = nil
+    end
+    destroy_handle(vb)
     destroy_handle(mesh.ib)
 end
 
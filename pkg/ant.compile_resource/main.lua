@@ -65,6 +65,13 @@ local function compile_file(setting, vpath, lpath)
     return output:string()
 end
 
+-- returns the output path, and true if it should be compiled. it doesn't touch the output.
+local function check_file(setting, vpath, lpath)
+    local ext = vpath:match "[^/]%.([%w*?_%-]*)$"
+    local output = setting.respath / ext / get_filename(vpath)
+    return output:string(), depends.dirty(setting, output / ".dep") ~= nil
+end
+
 local function verify_file(setting, vpath, lpath)
     assert(lpath:sub(1,1) ~= ".")
     if setting.compiling[lpath] then
@@ -84,4 +91,5 @@ return {
     init_setting  = init_setting,
     compile_file = compile_file,
     verify_file = verify_file,
+    check_file = check_file,
 }
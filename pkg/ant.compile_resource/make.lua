@@ -0,0 +1,7 @@
+local lm = require "luamake"
+
+lm:lua_src "compile_resource" {
+    sources = {
+        "src/meshopt.cpp",
+    }
+}
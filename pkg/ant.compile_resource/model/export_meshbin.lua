@@ -3,6 +3,8 @@ local utility   = require "model.utility"
 local meshutil	= require "model.meshutil"
 local packer 	= require "model.pack_vertex_data"
 local pack_vertex_data = packer.pack
+local L			= import_package "ant.render.core".layout
+local meshopt	= require "meshopt"
 
 local function get_layout(name, accessor)
 	local attribname, channel = name:match"(%w+)_(%d+)"
@@ -452,6 +454,61 @@ end
 
 -- end
 
+-- half float keeps 1/1024 precision in [-2, 2], the texcoords out of it (tiling) stay in float
+local HALF_TEXCOORD_RANGE<const> = 2.0
+
+local function elem_offset(declname, pattern)
+	local offset = 0
+	for e in declname:gmatch "%w+" do
+		if e:match(pattern) then
+			return offset
+		end
+		offset = offset + L.elem_size(e)
+	end
+end
+
+local function quantize_texcoords(vb)
+	local elems = {}
+	local offset = 0
+	for e in vb.declname:gmatch "%w+" do
+		if e:match "^t%d%dNIf$" then
+			local bin = meshopt.half(vb.memory[1], vb.num, offset, tonumber(e:sub(2, 2)), HALF_TEXCOORD_RANGE)
+			if bin then
+				vb.memory = {bin, 1, #bin}
+				e = e:sub(1, 5) .. 'h'
+			end
+		end
+		elems[#elems+1] = e
+		offset = offset + L.elem_size(e)
+	end
+	vb.declname = table.concat(elems, "|")
+end
+
+-- merges the same vertices, reorders the triangles for vertex cache and overdraw, then reorders the vertices for vertex fetch.
+-- the mesh without index buffer gets one
+local function optimize_mesh(group, name)
+	local vb, vb2, ib = group.vb, group.vb2, group.ib
+	local numv = vb.num
+	local r = meshopt.optimize {
+		num		= numv,
+		ib		= ib and ib.memory[1],
+		index32	= ib and ib.flag == 'd',
+		position= elem_offset(vb.declname, "^p3%dNIf$"),
+		vb		= { vb.memory[1], vb2 and vb2.memory[1] },
+	}
+	if r then
+		vb.memory, vb.num = {r.vb[1], 1, #r.vb[1]}, r.num
+		if vb2 then
+			vb2.memory, vb2.num = {r.vb[2], 1, #r.vb[2]}, r.num
+		end
+		group.ib = to_ib(r.ib, r.index32 and 'd' or '', #r.ib // (r.index32 and 4 or 2))
+		log.info(("mesh optimize %s: vertices %d -> %d, ACMR %.3f -> %.3f"):format(name, numv, r.num, r.acmr_before, r.acmr_after))
+	end
+	if vb2 then
+		quantize_texcoords(vb2)
+	end
+end
+
 local function save_meshbin_files(status, resname, meshgroup)
 	local cfgname = ("meshes/%s.meshbin"):format(resname)
 
@@ -506,6 +563,7 @@ end
 			end
 
 			local stemname = ("%s_P%d"):format(meshname, primidx)
+			optimize_mesh(group, stemname)
 
 			meshexport.meshbinfile = save_meshbin_files(status, stemname, group)
 			meshexport.declname = {
@@ -1 +1 @@
-return 27
+return 28
@@ -0,0 +1,543 @@
+#include <lua.hpp>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+// mesh optimization for the model exporter:
+//	1. merge the vertices which are same in all the streams, and remove the degenerate triangles
+//	2. reorder the triangles for the post-transform vertex cache (Tom Forsyth, Linear-Speed Vertex Cache Optimisation)
+//	3. sort the clusters of triangles from outside to inside to reduce overdraw (Sander et al., Fast Triangle Reordering)
+//	4. reorder the vertices by the first use for the vertex fetch
+// ACMR (average cache miss ratio) is simulated in a FIFO cache of 16 vertices
+
+namespace meshopt {
+	static constexpr uint32_t STAT_CACHE_SIZE = 16;
+	static constexpr uint32_t CACHE_SIZE = 32;
+	static constexpr float OVERDRAW_THRESHOLD = 1.05f;
+
+	struct stream {
+		const uint8_t* data;
+		size_t stride;
+	};
+
+	struct vertex_hash {
+		const std::vector<stream>* streams;
+		size_t operator()(uint32_t v) const {
+			uint64_t h = 14695981039346656037ull;
+			for (auto const& s : *streams) {
+				const uint8_t* p = s.data + v * s.stride;
+				for (size_t i = 0; i < s.stride; ++i) {
+					h = (h ^ p[i]) * 1099511628211ull;
+				}
+			}
+			return (size_t)h;
+		}
+	};
+
+	struct vertex_equal {
+		const std::vector<stream>* streams;
+		bool operator()(uint32_t a, uint32_t b) const {
+			for (auto const& s : *streams) {
+				if (memcmp(s.data + a * s.stride, s.data + b * s.stride, s.stride) != 0)
+					return false;
+			}
+			return true;
+		}
+	};
+
+	static float acmr(const std::vector<uint32_t>& indices, uint32_t numv) {
+		size_t numtri = indices.size() / 3;
+		if (numtri == 0)
+			return 0.f;
+		std::vector<uint32_t> timestamps(numv, 0);
+		uint32_t time = STAT_CACHE_SIZE + 1;
+		uint32_t misses = 0;
+		for (uint32_t v : indices) {
+			if (time - timestamps[v] > STAT_CACHE_SIZE) {
+				timestamps[v] = time++;
+				++misses;
+			}
+		}
+		return (float)misses / numtri;
+	}
+
+	// indices are remapped to the first one of the same vertices
+	static void deduplicate(std::vector<uint32_t>& indices, uint32_t numv, const std::vector<stream>& streams) {
+		std::unordered_map<uint32_t, uint32_t, vertex_hash, vertex_equal> vertices(numv, vertex_hash { &streams }, vertex_equal { &streams });
+		std::vector<uint32_t> remap(numv);
+		for (uint32_t v = 0; v < numv; ++v) {
+			remap[v] = vertices.emplace(v, v).first->second;
+		}
+		size_t n = 0;
+		for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+			uint32_t a = remap[indices[i]], b = remap[indices[i+1]], c = remap[indices[i+2]];
+			if (a != b && b != c && c != a) {
+				indices[n++] = a;
+				indices[n++] = b;
+				indices[n++] = c;
+			}
+		}
+		indices.resize(n);
+	}
+
+	static float vertex_score(int cache_pos, uint32_t live) {
+		if (live == 0)
+			return -1.f;
+		float score = 0.f;
+		if (cache_pos >= 0) {
+			if (cache_pos < 3) {
+				score = 0.75f;
+			} else {
+				score = powf(1.f - (float)(cache_pos - 3) / (CACHE_SIZE - 3), 1.5f);
+			}
+		}
+		return score + 2.f * powf((float)live, -0.5f);
+	}
+
+	static void optimize_vertex_cache(std::vector<uint32_t>& indices, uint32_t numv) {
+		size_t numtri = indices.size() / 3;
+		std::vector<uint32_t> live(numv, 0);
+		for (uint32_t v : indices) {
+			++live[v];
+		}
+		std::vector<uint32_t> offsets(numv + 1, 0);
+		for (uint32_t v = 0; v < numv; ++v) {
+			offsets[v+1] = offsets[v] + live[v];
+		}
+		std::vector<uint32_t> adjacency(indices.size());
+		{
+			std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+			for (size_t i = 0; i < indices.size(); ++i) {
+				adjacency[fill[indices[i]]++] = (uint32_t)(i / 3);
+			}
+		}
+		std::vector<int> cache_pos(numv, -1);
+		std::vector<float> vscore(numv);
+		for (uint32_t v = 0; v < numv; ++v) {
+			vscore[v] = vertex_score(-1, live[v]);
+		}
+		std::vector<float> tscore(numtri);
+		std::vector<uint8_t> emitted(numtri, 0);
+		uint32_t best = 0;
+		for (size_t t = 0; t < numtri; ++t) {
+			const uint32_t* tri = &indices[t * 3];
+			tscore[t] = vscore[tri[0]] + vscore[tri[1]] + vscore[tri[2]];
+			if (tscore[t] > tscore[best])
+				best = (uint32_t)t;
+		}
+
+		std::vector<uint32_t> result;
+		result.reserve(indices.size());
+		uint32_t cache[CACHE_SIZE + 3];
+		uint32_t cache_size = 0;
+		size_t cursor = 0;
+		for (;;) {
+			emitted[best] = 1;
+			const uint32_t* tri = &indices[best * 3];
+			uint32_t newcache[CACHE_SIZE + 3];
+			uint32_t newsize = 0;
+			for (int i = 0; i < 3; ++i) {
+				uint32_t v = tri[i];
+				result.push_back(v);
+				newcache[newsize++] = v;
+				// remove the triangle from the adjacency of v
+				uint32_t* adj = &adjacency[offsets[v]];
+				uint32_t n = live[v];
+				for (uint32_t j = 0; j < n; ++j) {
+					if (adj[j] == best) {
+						adj[j] = adj[n-1];
+						break;
+					}
+				}
+				--live[v];
+			}
+			for (uint32_t i = 0; i < cache_size; ++i) {
+				uint32_t v = cache[i];
+				if (v != tri[0] && v != tri[1] && v != tri[2])
+					newcache[newsize++] = v;
+			}
+			for (uint32_t i = CACHE_SIZE; i < newsize; ++i) {
+				cache_pos[newcache[i]] = -1;
+				vscore[newcache[i]] = vertex_score(-1, live[newcache[i]]);
+			}
+			cache_size = std::min(newsize, CACHE_SIZE);
+			memcpy(cache, newcache, cache_size * sizeof(uint32_t));
+			for (uint32_t i = 0; i < cache_size; ++i) {
+				uint32_t v = cache[i];
+				cache_pos[v] = (int)i;
+				vscore[v] = vertex_score((int)i, live[v]);
+			}
+
+			// only the triangles use the vertices in cache change their score
+			float best_score = -1.f;
+			for (uint32_t i = 0; i < cache_size; ++i) {
+				uint32_t v = cache[i];
+				const uint32_t* adj = &adjacency[offsets[v]];
+				for (uint32_t j = 0; j < live[v]; ++j) {
+					uint32_t t = adj[j];
+					const uint32_t* ti = &indices[t * 3];
+					float s = vscore[ti[0]] + vscore[ti[1]] + vscore[ti[2]];
+					tscore[t] = s;
+					if (s > best_score) {
+						best_score = s;
+						best = t;
+					}
+				}
+			}
+			if (best_score < 0.f) {
+				while (cursor < numtri && emitted[cursor])
+					++cursor;
+				if (cursor == numtri)
+					break;
+				best = (uint32_t)cursor;
+			}
+		}
+		indices.swap(result);
+	}
+
+	static void triangle_normal(const float* a, const float* b, const float* c, float n[3]) {
+		float e1[3] = { b[0]-a[0], b[1]-a[1], b[2]-a[2] };
+		float e2[3] = { c[0]-a[0], c[1]-a[1], c[2]-a[2] };
+		n[0] = e1[1]*e2[2] - e1[2]*e2[1];
+		n[1] = e1[2]*e2[0] - e1[0]*e2[2];
+		n[2] = e1[0]*e2[1] - e1[1]*e2[0];
+	}
+
+	// the clusters are split at where the cache is cold (all 3 vertices miss), so sorting them doesn't hurt the cache much.
+	// the outer clusters facing outside are drawn first, the normal of the triangle (a, b, c) is cross(b-a, c-a)
+	static bool optimize_overdraw(std::vector<uint32_t>& indices, uint32_t numv, const stream& position, float acmr_limit) {
+		size_t numtri = indices.size() / 3;
+		auto pos = [&](uint32_t v) {
+			return (const float*)(position.data + v * position.stride);
+		};
+
+		std::vector<uint32_t> clusters;
+		{
+			std::vector<uint32_t> timestamps(numv, 0);
+			uint32_t time = STAT_CACHE_SIZE + 1;
+			for (size_t t = 0; t < numtri; ++t) {
+				uint32_t misses = 0;
+				for (int i = 0; i < 3; ++i) {
+					uint32_t v = indices[t * 3 + i];
+					if (time - timestamps[v] > STAT_CACHE_SIZE) {
+						timestamps[v] = time++;
+						++misses;
+					}
+				}
+				if (t == 0 || misses == 3)
+					clusters.push_back((uint32_t)t);
+			}
+		}
+		if (clusters.size() < 2)
+			return false;
+		clusters.push_back((uint32_t)numtri);
+
+		float center[3] = { 0, 0, 0 };
+		float total_area = 0.f;
+		struct cluster_info {
+			uint32_t first;
+			uint32_t last;
+			float sort_key;
+		};
+		std::vector<cluster_info> infos(clusters.size() - 1);
+		std::vector<float> centroids((clusters.size() - 1) * 3);
+		std::vector<float> normals((clusters.size() - 1) * 3);
+		for (size_t c = 0; c + 1 < clusters.size(); ++c) {
+			float* cc = &centroids[c * 3];
+			float* cn = &normals[c * 3];
+			cc[0] = cc[1] = cc[2] = 0.f;
+			cn[0] = cn[1] = cn[2] = 0.f;
+			float area = 0.f;
+			for (uint32_t t = clusters[c]; t < clusters[c+1]; ++t) {
+				const float* a = pos(indices[t * 3]);
+				const float* b = pos(indices[t * 3 + 1]);
+				const float* d = pos(indices[t * 3 + 2]);
+				float n[3];
+				triangle_normal(a, b, d, n);
+				float w = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+				for (int i = 0; i < 3; ++i) {
+					cn[i] += n[i];
+					cc[i] += (a[i] + b[i] + d[i]) * w / 3.f;
+				}
+				area += w;
+			}
+			for (int i = 0; i < 3; ++i) {
+				center[i] += cc[i];
+			}
+			total_area += area;
+			if (area > 0.f) {
+				for (int i = 0; i < 3; ++i) {
+					cc[i] /= area;
+				}
+			}
+			infos[c].first = clusters[c];
+			infos[c].last = clusters[c+1];
+		}
+		if (total_area <= 0.f)
+			return false;
+		for (int i = 0; i < 3; ++i) {
+			center[i] /= total_area;
+		}
+		for (size_t c = 0; c < infos.size(); ++c) {
+			const float* cc = &centroids[c * 3];
+			const float* cn = &normals[c * 3];
+			float len = sqrtf(cn[0]*cn[0] + cn[1]*cn[1] + cn[2]*cn[2]);
+			float key = 0.f;
+			if (len > 0.f) {
+				key = ((cc[0] - center[0]) * cn[0] + (cc[1] - center[1]) * cn[1] + (cc[2] - center[2]) * cn[2]) / len;
+			}
+			infos[c].sort_key = key;
+		}
+		std::stable_sort(infos.begin(), infos.end(), [](const cluster_info& a, const cluster_info& b) {
+			return a.sort_key > b.sort_key;
+		});
+
+		std::vector<uint32_t> result;
+		result.reserve(indices.size());
+		for (auto const& c : infos) {
+			result.insert(result.end(), indices.begin() + c.first * 3, indices.begin() + c.last * 3);
+		}
+		if (acmr(result, numv) > acmr_limit)
+			return false;
+		indices.swap(result);
+		return true;
+	}
+
+	// returns the number of the vertices used, and the indices are remapped to the new order
+	static uint32_t optimize_vertex_fetch(std::vector<uint32_t>& indices, uint32_t numv, std::vector<uint32_t>& order) {
+		std::vector<uint32_t> remap(numv, UINT32_MAX);
+		order.clear();
+		for (uint32_t& v : indices) {
+			if (remap[v] == UINT32_MAX) {
+				remap[v] = (uint32_t)order.size();
+				order.push_back(v);
+			}
+			v = remap[v];
+		}
+		return (uint32_t)order.size();
+	}
+
+	static uint16_t float_to_half(float f) {
+		uint32_t x;
+		memcpy(&x, &f, sizeof(x));
+		uint32_t sign = (x >> 16) & 0x8000;
+		int32_t exp = (int32_t)((x >> 23) & 0xff) - 127 + 15;
+		uint32_t mantissa = x & 0x7fffff;
+		if (exp <= 0) {
+			if (exp < -10)
+				return (uint16_t)sign;
+			mantissa |= 0x800000;
+			uint32_t shift = (uint32_t)(14 - exp);
+			uint32_t h = mantissa >> shift;
+			if ((mantissa >> (shift - 1)) & 1)
+				++h;
+			return (uint16_t)(sign | h);
+		}
+		if (exp >= 31) {
+			// inf and nan
+			return (uint16_t)(sign | 0x7c00 | (mantissa && ((x >> 23) & 0xff) == 0xff ? 0x200 : 0));
+		}
+		uint32_t h = sign | ((uint32_t)exp << 10) | (mantissa >> 13);
+		if (mantissa & 0x1000)
+			++h;	// may carry into the exponent, it's still right
+		return (uint16_t)h;
+	}
+}
+
+static const uint8_t*
+check_stream(lua_State* L, int idx, uint32_t numv, size_t& stride) {
+	size_t sz;
+	const char* data = luaL_checklstring(L, idx, &sz);
+	if (numv == 0 || sz % numv != 0)
+		luaL_error(L, "Invalid vertex buffer size %d for %d vertices", (int)sz, (int)numv);
+	stride = sz / numv;
+	return (const uint8_t*)data;
+}
+
+static uint32_t
+getfield_integer(lua_State* L, int idx, const char* key) {
+	if (lua_getfield(L, idx, key) != LUA_TNUMBER)
+		luaL_error(L, "Need .%s", key);
+	uint32_t v = (uint32_t)lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	return v;
+}
+
+static void
+push_stream(lua_State* L, const meshopt::stream& s, const std::vector<uint32_t>& order) {
+	luaL_Buffer b;
+	uint8_t* out = (uint8_t*)luaL_buffinitsize(L, &b, order.size() * s.stride);
+	for (size_t i = 0; i < order.size(); ++i) {
+		memcpy(out + i * s.stride, s.data + order[i] * s.stride, s.stride);
+	}
+	luaL_pushresultsize(&b, order.size() * s.stride);
+}
+
+/*
+	{
+		num = number of vertices,
+		ib = index buffer (string) or nil for the sequential triangles,
+		index32 = ib is 32 bits,
+		position = offset of the float3 position in vb[1], or nil to skip overdraw optimization,
+		vb = { vertex buffer (string), ... },
+	}
+	returns nil if there is no triangle, or
+	{
+		num, ib, index32, vb,
+		acmr_before, acmr_after,
+	}
+*/
+static int
+loptimize(lua_State* L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	uint32_t numv = getfield_integer(L, 1, "num");
+	if (numv == 0)
+		return 0;
+
+	std::vector<meshopt::stream> streams;
+	if (lua_getfield(L, 1, "vb") != LUA_TTABLE)
+		return luaL_error(L, "Need .vb");
+	int vbidx = lua_gettop(L);
+	lua_Integer nstream = luaL_len(L, vbidx);
+	for (lua_Integer i = 1; i <= nstream; ++i) {
+		lua_geti(L, vbidx, i);
+		meshopt::stream s;
+		s.data = check_stream(L, -1, numv, s.stride);
+		streams.push_back(s);
+		lua_pop(L, 1);
+	}
+	if (streams.empty())
+		return luaL_error(L, "Need .vb[1]");
+
+	std::vector<uint32_t> indices;
+	if (lua_getfield(L, 1, "ib") == LUA_TSTRING) {
+		size_t sz;
+		const char* ib = lua_tolstring(L, -1, &sz);
+		lua_getfield(L, 1, "index32");
+		bool index32 = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		size_t n = sz / (index32 ? 4 : 2);
+		indices.resize(n - n % 3);
+		for (size_t i = 0; i < indices.size(); ++i) {
+			uint32_t v;
+			if (index32) {
+				memcpy(&v, ib + i * 4, 4);
+			} else {
+				uint16_t v16;
+				memcpy(&v16, ib + i * 2, 2);
+				v = v16;
+			}
+			if (v >= numv)
+				return luaL_error(L, "Invalid index %d (%d vertices)", (int)v, (int)numv);
+			indices[i] = v;
+		}
+	} else {
+		indices.resize(numv - numv % 3);
+		for (uint32_t i = 0; i < indices.size(); ++i) {
+			indices[i] = i;
+		}
+	}
+	lua_pop(L, 1);
+
+	meshopt::stream position { nullptr, 0 };
+	if (lua_getfield(L, 1, "position") == LUA_TNUMBER) {
+		size_t offset = (size_t)lua_tointeger(L, -1);
+		if (offset + 3 * sizeof(float) > streams[0].stride)
+			return luaL_error(L, "Invalid position offset %d", (int)offset);
+		position.data = streams[0].data + offset;
+		position.stride = streams[0].stride;
+	}
+	lua_pop(L, 1);
+
+	float acmr_before = meshopt::acmr(indices, numv);
+	meshopt::deduplicate(indices, numv, streams);
+	if (indices.empty())
+		return 0;
+	meshopt::optimize_vertex_cache(indices, numv);
+	if (position.data) {
+		meshopt::optimize_overdraw(indices, numv, position, meshopt::acmr(indices, numv) * meshopt::OVERDRAW_THRESHOLD);
+	}
+	std::vector<uint32_t> order;
+	uint32_t newnum = meshopt::optimize_vertex_fetch(indices, numv, order);
+	float acmr_after = meshopt::acmr(indices, newnum);
+
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, newnum);
+	lua_setfield(L, -2, "num");
+	bool index32 = newnum > 0xffff;
+	if (index32) {
+		lua_pushlstring(L, (const char*)indices.data(), indices.size() * sizeof(uint32_t));
+	} else {
+		std::vector<uint16_t> ib16(indices.begin(), indices.end());
+		lua_pushlstring(L, (const char*)ib16.data(), ib16.size() * sizeof(uint16_t));
+	}
+	lua_setfield(L, -2, "ib");
+	lua_pushboolean(L, index32);
+	lua_setfield(L, -2, "index32");
+	lua_createtable(L, (int)streams.size(), 0);
+	for (size_t i = 0; i < streams.size(); ++i) {
+		push_stream(L, streams[i], order);
+		lua_seti(L, -2, (lua_Integer)(i + 1));
+	}
+	lua_setfield(L, -2, "vb");
+	lua_pushnumber(L, acmr_before);
+	lua_setfield(L, -2, "acmr_before");
+	lua_pushnumber(L, acmr_after);
+	lua_setfield(L, -2, "acmr_after");
+	return 1;
+}
+
+// half(vb, num, offset, count [, range]) : converts count floats at offset of each vertex to half floats,
+// returns the new vertex buffer, or nil if any value is out of [-range, range]
+static int
+lhalf(lua_State* L) {
+	uint32_t numv = (uint32_t)luaL_checkinteger(L, 2);
+	size_t stride;
+	const uint8_t* data = check_stream(L, 1, numv, stride);
+	size_t offset = (size_t)luaL_checkinteger(L, 3);
+	size_t count = (size_t)luaL_checkinteger(L, 4);
+	float range = (float)luaL_optnumber(L, 5, 65504.0);
+	if (count == 0 || offset + count * sizeof(float) > stride)
+		return luaL_error(L, "Invalid attribute (offset %d, count %d) in stride %d", (int)offset, (int)count, (int)stride);
+	for (uint32_t v = 0; v < numv; ++v) {
+		const uint8_t* p = data + v * stride + offset;
+		for (size_t i = 0; i < count; ++i) {
+			float f;
+			memcpy(&f, p + i * sizeof(float), sizeof(f));
+			if (!(fabsf(f) <= range))
+				return 0;
+		}
+	}
+	size_t newstride = stride - count * (sizeof(float) - sizeof(uint16_t));
+	size_t tail = stride - offset - count * sizeof(float);
+	luaL_Buffer b;
+	uint8_t* out = (uint8_t*)luaL_buffinitsize(L, &b, numv * newstride);
+	for (uint32_t v = 0; v < numv; ++v) {
+		const uint8_t* src = data + v * stride;
+		uint8_t* dst = out + v * newstride;
+		memcpy(dst, src, offset);
+		for (size_t i = 0; i < count; ++i) {
+			float f;
+			memcpy(&f, src + offset + i * sizeof(float), sizeof(f));
+			uint16_t h = meshopt::float_to_half(f);
+			memcpy(dst + offset + i * sizeof(uint16_t), &h, sizeof(h));
+		}
+		memcpy(dst + offset + count * sizeof(uint16_t), src + offset + count * sizeof(float), tail);
+	}
+	luaL_pushresultsize(&b, numv * newstride);
+	return 1;
+}
+
+extern "C" int
+luaopen_meshopt(lua_State* L) {
+	luaL_Reg l[] = {
+		{ "optimize", loptimize },
+		{ "half", lhalf },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, l);
+	return 1;
+}
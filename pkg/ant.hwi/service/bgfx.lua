@@ -148,7 +148,11 @@ local function profile_print()
         add_text(format_text("draw|blit|compute|gpuLatency", (" | %d %d %d %dms"):format(bgfx_stat.numDraw, bgfx_stat.numBlit, bgfx_stat.numCompute, bgfx_stat.maxGpuLatency)))
         local rc = require "render.cache"
         local ss = rc.submit_stat()
-        if next(ss) then
+        add_text(format_text("simple|hitch|efk max", (" | %d %d %d"):format(ss.simple_max, ss.hitch_max, ss.efk_hitch_max)))
+        add_text(format_text("transform upload|reuse", (" | %d %d"):format(ss.transform_upload, ss.transform_reuse)))
+        add_text(format_text("attrib issue|skip", (" | %d %d"):format(ss.attrib_issued, ss.attrib_skipped)))
+        add_text(format_text("instance draw|object", (" | %d %d"):format(ss.instance_draw, ss.instance_object)))
+        if ss.simple_submit then
             add_text(format_text("simple|hitch|efk", (" | %d %d %d"):format(ss.simple_submit, ss.hitch_submit, ss.efk_hitch_submit)))
             add_text(format_text("hitch_count", (" | %d"):format(ss.hitch_count)))
         end
@@ -26,6 +26,8 @@ end
 
 add_view "csm_fb"
 add_view "skinning"
+--after the draw_indirect producers (csm_fb/skinning), before every view which draws the culled commands
+add_view "indirect_cull"
 add_view "csm1"
 add_view "csm2"
 add_view "csm3"
@@ -33,6 +35,8 @@ add_view "csm4"
 add_view "evsm"
 add_view "ibl"
 add_view "pre_depth"
+add_view "depth_resolve"
+add_view "depth_mipmap"
 add_view "scene_depth"
 add_view "ssao"
 add_view "main_view"
@@ -13,7 +13,8 @@ local mc            = import_package "ant.math".constant
 local hwi           = import_package "ant.hwi"
 local bgfx          = require "bgfx"
 
-local main_viewid<const> = hwi.viewid_get "main_view"
+--the draw commands are written before "indirect_cull" reads them, same view as hitch
+local produce_viewid<const> = hwi.viewid_get "csm_fb"
 
 local lnoise = require "noise"
 
@@ -96,7 +97,8 @@ local function create_sm_entity(gid, indices, mountain_material, cs_material, me
         policy = {
             "ant.render|simplerender",
             "ant.landform|stonemountain",
-            "ant.render|draw_indirect"
+            "ant.render|draw_indirect",
+            "ant.render|draw_indirect_cull",
          },
         data = {
             scene         = {},
@@ -116,6 +118,7 @@ local function create_sm_entity(gid, indices, mountain_material, cs_material, me
                     size    = DEFAULT_SIZE
                 },
             },
+            draw_indirect_cull = {},
             render_layer  = "foreground",
         }
     }
@@ -151,7 +154,7 @@ local function create_sm_entity(gid, indices, mountain_material, cs_material, me
                 m.u_mesh_params = MESH_PARAMS
                 m.u_buffer_param = math3d.vector(drawnum, 0, 0, 0)
                 --just do it once
-                icompute.dispatch(main_viewid, e.dispatch)
+                icompute.dispatch(produce_viewid, e.dispatch)
                 assetmgr.material_mark(e.dispatch.fx.prog)
             end
         }
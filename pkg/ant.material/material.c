@@ -11,6 +11,7 @@
 
 #include <bgfx/c99/bgfx.h>
 #include <luabgfx.h>
+#include <bgfx_interface.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -29,6 +30,9 @@ struct material {
 	uint64_t				global[MATERIAL_SYSTEM_ATTRIB_CHUNK];
 	attrib_id				attrib;
 	int 					prog;
+	int						attrib_n;	// material attribs in cmd, the system attribs follow them
+	int						cmd_n;
+	struct attrib_arena_cmd	cmd[];
 };
 
 struct material_instance {
@@ -364,7 +368,7 @@ fetch_system_attrib_set(lua_State *L, int index, uint64_t *set) {
 		--id;
 		int idx = id / 64;
 		int shift = id % 64;
-		set[idx] |= (uint64_t)(1 << shift);
+		set[idx] |= (uint64_t)1 << shift;
 	}
 }
 
@@ -375,6 +379,33 @@ compar_int(const void *a, const void *b) {
 	return *aa - *bb;
 }
 
+static inline int
+count_bits(uint64_t v) {
+	int n = 0;
+	for (; v; v &= v - 1)
+		++n;
+	return n;
+}
+
+// uniform size and sampler type are checked here once, so applying the baked attribs needs no check
+static void
+check_baked_attribs(lua_State *L, const struct material *m) {
+	int i;
+	for (i=0;i<m->cmd_n;i++) {
+		const struct attrib_arena_cmd *c = &m->cmd[i];
+		if (c->type != ATTRIB_UNIFORM && c->type != ATTRIB_SAMPLER)
+			continue;
+		bgfx_uniform_info_t info;
+		BGFX(get_uniform_info)(c->handle, &info);
+		if (c->type == ATTRIB_SAMPLER) {
+			if (info.type != BGFX_UNIFORM_TYPE_SAMPLER)
+				luaL_error(L, "Uniform %s is not a sampler", info.name);
+		} else if (c->n > info.num) {
+			luaL_error(L, "Uniform %s size %d > %d", info.name, c->n, info.num);
+		}
+	}
+}
+
 // 1: arena
 // 2: render state (string)
 // 3: stencil (int64)
@@ -386,15 +417,10 @@ static int
 lmaterial_new(lua_State *L) {
 	struct attrib_arena *A = (struct attrib_arena *)lua_touserdata(L, 1);
 	lua_settop(L, 6);
-	struct material *m = (struct material *)lua_newuserdatauv(L, sizeof(*m), 0);
-	m->A = A;
-
-	fetch_material_state(L, 2, &m->state);
-	fetch_material_stencil(L, 3, &m->state);
-	m->prog = (int)luaL_checkinteger(L, 4);
 
 	// base 1 array [1, MATERIAL_SYSTEM_ATTRIB_CHUNK * 64]
-	fetch_system_attrib_set(L, 5, m->global);
+	uint64_t global[MATERIAL_SYSTEM_ATTRIB_CHUNK];
+	fetch_system_attrib_set(L, 5, global);
 
 	luaL_checktype(L, 6, LUA_TTABLE);
 	int key[MAX_ATTRIB];
@@ -410,29 +436,47 @@ lmaterial_new(lua_State *L) {
 		++key_n;
 	}
 
-	if (key_n == 0) {
-		m->attrib = INVALID_ATTRIB;
-		return 1;
+	int cmd_n = key_n;
+	int i;
+	for (i=0;i<MATERIAL_SYSTEM_ATTRIB_CHUNK;i++) {
+		cmd_n += count_bits(global[i]);
 	}
 
-	qsort(key, key_n, sizeof(int), compar_int);
-
-	int top = lua_gettop(L) + 1;
+	struct material *m = (struct material *)lua_newuserdatauv(L, sizeof(*m) + cmd_n * sizeof(struct attrib_arena_cmd), 0);
+	m->A = A;
+	memcpy(m->global, global, sizeof(global));
+	m->attrib = INVALID_ATTRIB;
+	m->attrib_n = key_n;
+	m->cmd_n = 0;
 
-	int prev = -1;
+	fetch_material_state(L, 2, &m->state);
+	fetch_material_stencil(L, 3, &m->state);
+	m->prog = (int)luaL_checkinteger(L, 4);
 
-	int i;
-	for (i=0;i<key_n;i++) {
-		int current = attrib_arena_new(A, prev, key[i]);
-		if (current < 0)
-			return luaL_error(L, "Too many attribs");
-		if (i == 0)
-			m->attrib = (attrib_id)current;
-		lua_geti(L, 6, key[i]);
-		init_attrib(L, A, current, top);
-		lua_pop(L, 1);
-		prev = current;
+	if (key_n > 0) {
+		qsort(key, key_n, sizeof(int), compar_int);
+
+		int top = lua_gettop(L) + 1;
+		int prev = -1;
+		for (i=0;i<key_n;i++) {
+			int current = attrib_arena_new(A, prev, key[i]);
+			if (current < 0)
+				return luaL_error(L, "Too many attribs");
+			if (i == 0)
+				m->attrib = (attrib_id)current;
+			lua_geti(L, 6, key[i]);
+			init_attrib(L, A, current, top);
+			lua_pop(L, 1);
+			prev = current;
+		}
 	}
+
+	int n = cmd_n;
+	const char *err = attrib_arena_bake(A, m->attrib, m->global, m->cmd, &n);
+	if (err)
+		return luaL_error(L, "Bake attribs error : %s", err);
+	m->cmd_n = n;
+	check_baked_attribs(L, m);
 	return 1;
 }
 
@@ -569,18 +613,69 @@ linstance_set_attrib(lua_State *L) {
 	return 0;
 }
 
+#undef BGFX
 #define BGFX(api) w->bgfx->api
 
-void
-apply_material_instance(lua_State *L, const struct material_instance *mi, struct ecs_world *w) {
-	BGFX(encoder_set_state)(w->holder->encoder, 
-		(mi->patch_state.state == 0 ? mi->m->state.state : mi->patch_state.state), 
-		(mi->patch_state.rgba == 0 ? mi->m->state.rgba : mi->patch_state.rgba));
+uint64_t
+material_instance_state(const struct material_instance *mi) {
+	return mi->patch_state.state == 0 ? mi->m->state.state : mi->patch_state.state;
+}
 
+static inline void
+apply_state(const struct material_instance *mi, struct ecs_world *w, struct material_apply_cache *c) {
+	const uint64_t state = material_instance_state(mi);
+	const uint32_t rgba = mi->patch_state.rgba == 0 ? mi->m->state.rgba : mi->patch_state.rgba;
 	const uint64_t stencil = mi->patch_state.stencil == 0 ? mi->m->state.stencil : mi->patch_state.stencil;
+	if (c) {
+		if (c->state_valid && c->state == state && c->rgba == rgba && c->stencil == stencil)
+			return;
+		c->state_valid = 1;
+		c->state = state;
+		c->rgba = rgba;
+		c->stencil = stencil;
+	}
+	BGFX(encoder_set_state)(w->holder->encoder, state, rgba);
 	BGFX(encoder_set_stencil)(w->holder->encoder,
 		(uint32_t)(stencil & 0xffffffff), (uint32_t)(stencil >> 32)
 	);
+}
+
+void
+apply_material_instance_state(const struct material_instance *mi, struct ecs_world *w) {
+	apply_state(mi, w, NULL);
+}
+
+int
+material_instance_equal(const struct material_instance *lhs, const struct material_instance *rhs) {
+	if (lhs == rhs)
+		return 1;
+	if (lhs == NULL || rhs == NULL)
+		return 0;
+	return lhs->m == rhs->m &&
+		lhs->patch_state.state == rhs->patch_state.state &&
+		lhs->patch_state.stencil == rhs->patch_state.stencil &&
+		lhs->patch_state.rgba == rhs->patch_state.rgba &&
+		attrib_arena_equal(lhs->m->A, lhs->patch_attrib, rhs->patch_attrib);
+}
+
+int
+material_instance_same_patch(const struct material_instance *lhs, const struct material_instance *rhs) {
+	const struct material_state *ls = &lhs->m->state;
+	const struct material_state *rs = &rhs->m->state;
+	return material_instance_state(lhs) == material_instance_state(rhs) &&
+		(lhs->patch_state.rgba == 0 ? ls->rgba : lhs->patch_state.rgba) == (rhs->patch_state.rgba == 0 ? rs->rgba : rhs->patch_state.rgba) &&
+		(lhs->patch_state.stencil == 0 ? ls->stencil : lhs->patch_state.stencil) == (rhs->patch_state.stencil == 0 ? rs->stencil : rhs->patch_state.stencil) &&
+		attrib_arena_equal(lhs->m->A, lhs->patch_attrib, rhs->patch_attrib);
+}
+
+const void*
+material_instance_source(const struct material_instance *mi) {
+	return mi->m;
+}
+
+const char *
+material_instance_apply_cached(const struct material_instance *mi, struct ecs_world *w, struct material_apply_cache *c) {
+	apply_state(mi, w, c);
 
 	struct attrib_arena_apply_context ctx = {
 		w->bgfx,
@@ -589,19 +684,43 @@ apply_material_instance(lua_State *L, const struct material_instance *mi, struct
 		math_value,
 		math_size,
 		texture_get,
+		c,
 	};
 
-	const char * err = attrib_arena_apply_list(mi->m->A, mi->m->attrib, mi->patch_attrib, &ctx);
-	if (err)
-		luaL_error(L, "Apply error : %s", err);
+	const struct material *m = mi->m;
+	return attrib_arena_apply_baked(m->A, m->cmd, m->cmd_n, m->attrib_n, m->global, mi->patch_attrib, &ctx);
+}
 
-	int ii;
-	for (ii = 0; ii < MATERIAL_SYSTEM_ATTRIB_CHUNK; ++ii) {
-		err = attrib_arena_apply_global(mi->m->A, mi->m->global[ii], ii * 64, &ctx);
-		if (err)
-			luaL_error(L, "Apply global error : %s", err);
-	}
+const char *
+material_instance_apply(const struct material_instance *mi, struct ecs_world *w) {
+	return material_instance_apply_cached(mi, w, NULL);
+}
+
+void
+material_apply_cache_init(struct material_apply_cache *c) {
+	memset(c, 0, sizeof(*c));
+	c->uniform_version = 1;
+	c->binding_version = 1;
+}
+
+void
+material_apply_cache_reset_uniforms(struct material_apply_cache *c) {
+	++c->uniform_version;
+}
+
+void
+material_apply_cache_discard(struct material_apply_cache *c, uint8_t discardflags) {
+	if (discardflags & BGFX_DISCARD_BINDINGS)
+		++c->binding_version;
+	if (discardflags & BGFX_DISCARD_STATE)
+		c->state_valid = 0;
+}
 
+void
+apply_material_instance(lua_State *L, const struct material_instance *mi, struct ecs_world *w) {
+	const char * err = material_instance_apply(mi, w);
+	if (err)
+		luaL_error(L, "Apply error : %s", err);
 }
 
 static int
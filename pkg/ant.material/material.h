@@ -7,5 +7,63 @@ struct material_instance;
 struct ecs_world;
 struct lua_State;
 void apply_material_instance(struct lua_State *L, const struct material_instance *mi, struct ecs_world *w);
+// same as apply_material_instance, but return the error instead of raising it, can be called out of lua thread
+const char * material_instance_apply(const struct material_instance *mi, struct ecs_world *w);
+void apply_material_instance_state(const struct material_instance *mi, struct ecs_world *w);
+// two instances are equal when they come from the same material with the same patch attribs and patch state,
+// every entity owns its instance, so compare the content
+int material_instance_equal(const struct material_instance *lhs, const struct material_instance *rhs);
+// the instances of different materials (e.g. the instanced variant of a material) draw the same when they have
+// the same render state and patch attribs
+int material_instance_same_patch(const struct material_instance *lhs, const struct material_instance *rhs);
+const void* material_instance_source(const struct material_instance *mi);
+// the render state (BGFX_STATE_*) of the instance, patch state first
+uint64_t material_instance_state(const struct material_instance *mi);
 bgfx_program_handle_t material_prog(struct lua_State *L, const struct material_instance *mi);
+
+#define MATERIAL_SYSTEM_ATTRIB_CHUNK 2
+#define MATERIAL_APPLY_MAX_UNIFORMS 512
+#define MATERIAL_APPLY_MAX_STAGES 16
+
+struct material_apply_cache_uniform {
+	uint32_t version;
+	uint32_t n;
+	uint32_t size;	// bytes of v can be compared, 0: compare v by address
+	const float *v;
+};
+
+struct material_apply_cache_stage {
+	uint32_t version;
+	uint64_t key;
+};
+
+// what is applied to one encoder, material_instance_apply_cached only emits the bgfx calls which differ from it.
+// state and bindings are kept in the encoder until a submit discards them, see material_apply_cache_discard.
+// uniforms are updated by the renderer in the sorted draw order, and bgfx only keeps the submit order of draws with
+// the same sort key, which has the program, the depth and the blend bits of the render state. So the uniforms must be
+// reset when the program, the depth (render_layer) or the render state of the draw changes
+struct material_apply_cache {
+	uint32_t uniform_version;
+	uint32_t binding_version;
+	int state_valid;
+	uint32_t rgba;
+	uint64_t state;
+	uint64_t stencil;
+	// system attribs keep their values in a frame, the system uniforms in this mask are set in uniform_version
+	// with the render state system_state, the same run key as the renderer (the state is in bgfx sort key)
+	uint32_t system_version;
+	uint64_t system_state;
+	uint64_t system[MATERIAL_SYSTEM_ATTRIB_CHUNK];
+	struct material_apply_cache_uniform uniform[MATERIAL_APPLY_MAX_UNIFORMS];
+	struct material_apply_cache_stage stage[MATERIAL_APPLY_MAX_STAGES];
+	// counters of uniform/sampler/image/buffer sets
+	uint32_t issued;
+	uint32_t skipped;
+};
+
+void material_apply_cache_init(struct material_apply_cache *c);
+void material_apply_cache_reset_uniforms(struct material_apply_cache *c);
+// discardflags is the flags of the submit
+void material_apply_cache_discard(struct material_apply_cache *c, uint8_t discardflags);
+const char * material_instance_apply_cached(const struct material_instance *mi, struct ecs_world *w, struct material_apply_cache *c);
 #endif //_MATERIAL_H_
\ No newline at end of file
@@ -14,10 +14,6 @@
 #define MAX_VEC (16 * 1024)
 #define MAX_GLOBAL_COUNT ( MATERIAL_SYSTEM_ATTRIB_CHUNK * 64 )
 
-#if !defined(MATERIAL_DEBUG)
-#define MATERIAL_DEBUG 1
-#endif
-
 #define ATTRIB_HEARDER \
 	attrib_id next; \
 	name_id key; \
@@ -292,6 +288,41 @@ attrib_arena_find(struct attrib_arena *A, attrib_id head, name_id key, attrib_id
 	return INVALID_ATTRIB;
 }
 
+static inline int
+attrib_equal(struct attrib_arena *A, const attrib_type *a, const attrib_type *b) {
+	if (a->h.key != b->h.key || a->h.type != b->h.type)
+		return 0;
+	switch (a->h.type) {
+	case ATTRIB_UNIFORM:
+		return a->u.handle.idx == b->u.handle.idx && a->u.u.v.n == b->u.u.v.n && a->u.u.v.elem == b->u.u.v.elem &&
+			memcmp(A->v + a->u.u.v.vec, A->v + b->u.u.v.vec, a->u.u.v.n * sizeof(struct vec)) == 0;
+	case ATTRIB_UNIFORM_INSTANCE:
+		return a->u.handle.idx == b->u.handle.idx && a->u.u.m.idx == b->u.u.m.idx;
+	case ATTRIB_SAMPLER:
+		return a->u.handle.idx == b->u.handle.idx && a->u.u.t.handle == b->u.u.t.handle && a->u.u.t.stage == b->u.u.t.stage;
+	case ATTRIB_IMAGE:
+	case ATTRIB_BUFFER:
+		return a->r.handle == b->r.handle && a->r.stage == b->r.stage && a->r.access == b->r.access && a->r.mip == b->r.mip;
+	default:
+		return 0;
+	}
+}
+
+int
+attrib_arena_equal(struct attrib_arena *A, attrib_id lhs, attrib_id rhs) {
+	while (lhs != rhs) {
+		if (lhs == INVALID_ATTRIB || rhs == INVALID_ATTRIB)
+			return 0;
+		const attrib_type *a = get_attrib(A, lhs);
+		const attrib_type *b = get_attrib(A, rhs);
+		if (!attrib_equal(A, a, b))
+			return 0;
+		lhs = a->h.next;
+		rhs = b->h.next;
+	}
+	return 1;
+}
+
 void
 attrib_arena_set_uniform(struct attrib_arena *A, int id, const float *v) {
 	attrib_type *a = get_attrib_from_id(A, id);
@@ -353,34 +384,77 @@ attrib_arena_set_resource(struct attrib_arena *A, int id, uint32_t handle, uint8
 
 static inline bgfx_texture_handle_t
 check_get_texture_handle(struct attrib_arena_apply_context *ctx, uint32_t handle) {
-	if ((0xffff0000 & handle) == 0) {
+	// texture id of textureman has no bgfx handle type in bits 16-19
+	if ((0x000f0000 & handle) == 0) {
 		return ctx->texture_get((int)handle);
 	}
 	bgfx_texture_handle_t r = {(uint16_t)handle};
 	return r;
 }
 
-const char *
-attrib_arena_apply(struct attrib_arena *A, int id, struct attrib_arena_apply_context *ctx) {
-	attrib_type *a = get_attrib_from_id(A, id);
-	if (a == NULL)
-		return "Invalid attrib";
+// return 1 if the binding of stage in encoder is the same
+static inline int
+cache_binding(struct attrib_arena_apply_context *ctx, uint8_t stage, uint64_t key) {
+	struct material_apply_cache *c = ctx->cache;
+	if (c == NULL)
+		return 0;
+	if (stage < MATERIAL_APPLY_MAX_STAGES) {
+		if (c->stage[stage].version == c->binding_version && c->stage[stage].key == key) {
+			++c->skipped;
+			return 1;
+		}
+		c->stage[stage].version = c->binding_version;
+		c->stage[stage].key = key;
+	}
+	++c->issued;
+	return 0;
+}
+
+// return 1 if the uniform is set with the same value since last reset
+static inline int
+cache_uniform(struct attrib_arena_apply_context *ctx, bgfx_uniform_handle_t h, const float *v, int n, uint32_t size) {
+	struct material_apply_cache *c = ctx->cache;
+	if (c == NULL)
+		return 0;
+	if (h.idx < MATERIAL_APPLY_MAX_UNIFORMS) {
+		struct material_apply_cache_uniform *u = &c->uniform[h.idx];
+		if (u->version == c->uniform_version && u->n == (uint32_t)n &&
+			(u->v == v || (size > 0 && u->size == size && memcmp(u->v, v, size) == 0))) {
+			++c->skipped;
+			return 1;
+		}
+		u->version = c->uniform_version;
+		u->n = n;
+		u->size = size;
+		u->v = v;
+	}
+	++c->issued;
+	return 0;
+}
+
+#define BINDING_KEY(type, a, b) (((uint64_t)(type) << 56) | ((uint64_t)(a) << 32) | (uint32_t)(b))
+
+static inline const char *
+apply_attrib(struct attrib_arena *A, attrib_type *a, struct attrib_arena_apply_context *ctx) {
 	switch(a->h.type){
 		case ATTRIB_SAMPLER: {
 			const bgfx_texture_handle_t tex = check_get_texture_handle(ctx, a->u.u.t.handle);
-			#if MATERIAL_DEBUG
-			bgfx_uniform_info_t info; BGFX(get_uniform_info)(a->u.handle, &info);
-			#endif //MATERIAL_DEBUG
+			if (cache_binding(ctx, a->u.u.t.stage, BINDING_KEY(ATTRIB_SAMPLER, a->u.handle.idx, tex.idx)))
+				break;
 			BGFX(encoder_set_texture)(ctx->encoder, a->u.u.t.stage, a->u.handle, tex, UINT32_MAX);
 		}	break;
 		case ATTRIB_IMAGE: {
 			const bgfx_texture_handle_t tex = check_get_texture_handle(ctx, a->r.handle);
+			if (cache_binding(ctx, a->r.stage, BINDING_KEY(ATTRIB_IMAGE, (a->r.mip << 8) | a->r.access, tex.idx)))
+				break;
 			BGFX(encoder_set_image)(ctx->encoder, a->r.stage, tex, a->r.mip, a->r.access, BGFX_TEXTURE_FORMAT_COUNT);
 		}	break;
 
 		case ATTRIB_BUFFER: {
 			const attrib_id id = a->r.handle & 0xffff;
 			const uint16_t btype = a->r.handle >> 16;
+			if (cache_binding(ctx, a->r.stage, BINDING_KEY(ATTRIB_BUFFER, a->r.access, a->r.handle)))
+				break;
 			switch (btype) {
 			case BGFX_HANDLE_VERTEX_BUFFER: {
 				bgfx_vertex_buffer_handle_t handle = { id };
@@ -414,21 +488,21 @@ attrib_arena_apply(struct attrib_arena *A, int id, struct attrib_arena_apply_con
 			}
 		}	break;
 		case ATTRIB_UNIFORM : {
+			// the uniform size is checked when the material is created, see check_baked_attribs
 			int n = a->u.u.v.elem;
-			#if MATERIAL_DEBUG
-			bgfx_uniform_info_t info; BGFX(get_uniform_info)(a->u.handle, &info);
-			assert(n <= info.num);
-			#endif //MATERIAL_DEBUG
-			BGFX(encoder_set_uniform)(ctx->encoder, a->u.handle, A->v + a->u.u.v.vec, n);
+			const float *v = (const float *)(A->v + a->u.u.v.vec);
+			if (cache_uniform(ctx, a->u.handle, v, n, a->u.u.v.n * sizeof(struct vec)))
+				break;
+			BGFX(encoder_set_uniform)(ctx->encoder, a->u.handle, v, n);
 			break;
 		}
 		case ATTRIB_UNIFORM_INSTANCE: {
 			const int n = ctx->math_size(ctx->math3d, a->u.u.m);
-			#if MATERIAL_DEBUG
-			bgfx_uniform_info_t info; BGFX(get_uniform_info)(a->u.handle, &info);
-			assert(n <= info.num);
-			#endif //MATERIAL_DEBUG
-			BGFX(encoder_set_uniform)(ctx->encoder, a->u.handle, ctx->math_value(ctx->math3d, a->u.u.m), n);
+			// the value of a math id never changes, compare it by address
+			const float *v = ctx->math_value(ctx->math3d, a->u.u.m);
+			if (cache_uniform(ctx, a->u.handle, v, n, 0))
+				break;
+			BGFX(encoder_set_uniform)(ctx->encoder, a->u.handle, v, n);
 		}	break;
 		default:
 			return "Invalid attrib type";
@@ -436,99 +510,142 @@ attrib_arena_apply(struct attrib_arena *A, int id, struct attrib_arena_apply_con
 	return NULL;
 }
 
-static inline attrib_id
-get_next(struct attrib_arena *A, attrib_id *id) {
-	attrib_id r = *id;
-	if (r == INVALID_ATTRIB)
-		return INVALID_ATTRIB;
-	attrib_type *a = get_attrib(A, r);
-	*id = a->h.next;
-	return r;
+const char *
+attrib_arena_apply(struct attrib_arena *A, int id, struct attrib_arena_apply_context *ctx) {
+	attrib_type *a = get_attrib_from_id(A, id);
+	if (a == NULL)
+		return "Invalid attrib";
+	return apply_attrib(A, a, ctx);
 }
 
-static inline attrib_id
-get_next_attrib(struct attrib_arena *A, attrib_id *id1, attrib_id *id2) {
-	if (*id1 == INVALID_ATTRIB) {
-		return get_next(A, id2);
-	}
-	if (*id2 == INVALID_ATTRIB) {
-		return get_next(A, id1);
-	}
-
-	attrib_type* a1 = get_attrib(A, *id1);
-	attrib_type* a2 = get_attrib(A, *id2);
-
-	if (a1->h.key == a2->h.key) {
-		get_next(A, id2);
-		return get_next(A, id1);
-	}
-	if (a1->h.key < a2->h.key) {
-		return get_next(A, id1);
+static inline const char *
+bake_attrib(struct attrib_arena *A, attrib_type *a, struct attrib_arena_cmd *c) {
+	c->key = a->h.key;
+	c->type = a->h.type;
+	c->handle.idx = UINT16_MAX;
+	c->n = 0;
+	c->vn = 0;
+	switch (a->h.type) {
+	case ATTRIB_UNIFORM:
+		c->p = A->v + a->u.u.v.vec;
+		c->handle = a->u.handle;
+		c->n = a->u.u.v.elem;
+		c->vn = a->u.u.v.n;
+		break;
+	case ATTRIB_SAMPLER:
+		c->p = a;
+		c->handle = a->u.handle;
+		break;
+	case ATTRIB_IMAGE:
+	case ATTRIB_BUFFER:
+		c->p = a;
+		break;
+	default:
+		return "Invalid attrib type";
 	}
-	return get_next(A, id2);
+	return NULL;
 }
 
 const char *
-attrib_arena_apply_list(struct attrib_arena *A, attrib_id head, attrib_id patch, struct attrib_arena_apply_context *ctx) {
-	attrib_id id;
-	while ((id = get_next_attrib(A, &patch, &head)) != INVALID_ATTRIB) {
-		const char * err = attrib_arena_apply(A, id, ctx);
+attrib_arena_bake(struct attrib_arena *A, attrib_id head, const uint64_t global[MATERIAL_SYSTEM_ATTRIB_CHUNK], struct attrib_arena_cmd *cmds, int *n) {
+	const int cap = *n;
+	int i = 0;
+	while (head != INVALID_ATTRIB) {
+		if (i >= cap)
+			return "Too many attribs";
+		attrib_type *a = get_attrib(A, head);
+		const char *err = bake_attrib(A, a, &cmds[i++]);
 		if (err)
 			return err;
+		head = a->h.next;
 	}
-	return NULL;
-}
-
-static inline const char *
-apply_global8(struct attrib_arena *A, uint8_t mask, int base, struct attrib_arena_apply_context *ctx) {
-	int i;
-	int id = -base-1;
-	for (i=0;mask != 0 && i<8;i++) {
-		if (mask & 1) {
-			const char * err = attrib_arena_apply(A, id, ctx);
+	int ii;
+	for (ii = 0; ii < MAX_GLOBAL_COUNT; ++ii) {
+		if (global[ii / 64] & ((uint64_t)1 << (ii % 64))) {
+			if (i >= cap)
+				return "Too many attribs";
+			const char *err = bake_attrib(A, &A->g[ii], &cmds[i++]);
 			if (err)
 				return err;
 		}
-		mask >>= 1;
-		--id;
 	}
+	*n = i;
 	return NULL;
 }
 
+// the value and the node of a baked attrib never move, only the uniform handle and the count are copied into cmd
 static inline const char *
-apply_global16(struct attrib_arena *A, uint16_t mask, int base, struct attrib_arena_apply_context *ctx) {
-	if (mask == 0)
+apply_cmd(struct attrib_arena *A, const struct attrib_arena_cmd *c, struct attrib_arena_apply_context *ctx) {
+	if (c->type == ATTRIB_UNIFORM) {
+		const float *v = (const float *)c->p;
+		if (!cache_uniform(ctx, c->handle, v, c->n, c->vn * sizeof(struct vec)))
+			BGFX(encoder_set_uniform)(ctx->encoder, c->handle, v, c->n);
 		return NULL;
-	uint8_t mask8[2] = { mask & 0xff, mask >> 8 };
-	const char * err = apply_global8(A, mask8[0], base, ctx);
-	if (err)
-		return err;
-	err = apply_global8(A, mask8[1], base + 8, ctx);
-	return err;
+	}
+	return apply_attrib(A, (attrib_type *)c->p, ctx);
 }
 
-static inline const char *
-apply_global32(struct attrib_arena *A, uint32_t mask, int base, struct attrib_arena_apply_context *ctx) {
-	if (mask == 0)
-		return NULL;
-	uint16_t mask16[2] = { mask & 0xffff, mask >> 16 };
-	const char * err = apply_global16(A, mask16[0], base, ctx);
-	if (err)
-		return err;
-	err = apply_global16(A, mask16[1], base + 16, ctx);
-	return err;
+// return 1 if every system uniform in global is set in this uniform version and render state, and mark them set.
+// the state is applied before the attribs, bgfx may reorder the draws of different states
+static inline int
+cache_system(struct attrib_arena_apply_context *ctx, const uint64_t global[MATERIAL_SYSTEM_ATTRIB_CHUNK]) {
+	struct material_apply_cache *c = ctx->cache;
+	if (c == NULL)
+		return 0;
+	int i;
+	if (c->system_version != c->uniform_version || !c->state_valid || c->system_state != c->state) {
+		c->system_version = c->uniform_version;
+		c->system_state = c->state;
+		for (i = 0; i < MATERIAL_SYSTEM_ATTRIB_CHUNK; i++)
+			c->system[i] = 0;
+	}
+	int applied = 1;
+	for (i = 0; i < MATERIAL_SYSTEM_ATTRIB_CHUNK; i++) {
+		if (global[i] & ~c->system[i]) {
+			applied = 0;
+			c->system[i] |= global[i];
+		}
+	}
+	return applied;
 }
 
 const char *
-attrib_arena_apply_global(struct attrib_arena *A, uint64_t mask, int base, struct attrib_arena_apply_context *ctx) {
-	if (mask == 0)
+attrib_arena_apply_baked(struct attrib_arena *A, const struct attrib_arena_cmd *cmds, int n, int attrib_n,
+	const uint64_t global[MATERIAL_SYSTEM_ATTRIB_CHUNK], attrib_id patch, struct attrib_arena_apply_context *ctx) {
+	int i;
+	for (i = 0; i < attrib_n; i++) {
+		const struct attrib_arena_cmd *c = &cmds[i];
+		const char *err;
+		// patch is a sorted sub list of the material attribs
+		if (patch != INVALID_ATTRIB && get_attrib(A, patch)->h.key == c->key) {
+			attrib_type *p = get_attrib(A, patch);
+			patch = p->h.next;
+			err = apply_attrib(A, p, ctx);
+		} else {
+			err = apply_cmd(A, c, ctx);
+		}
+		if (err)
+			return err;
+	}
+	if (cache_system(ctx, global)) {
+		// the system uniforms are set by the previous draws with the same sort key, only the bindings may be discarded
+		for (; i < n; i++) {
+			if (cmds[i].type == ATTRIB_UNIFORM) {
+				++ctx->cache->skipped;
+			} else {
+				const char *err = apply_cmd(A, &cmds[i], ctx);
+				if (err)
+					return err;
+			}
+		}
 		return NULL;
-	uint32_t mask32[2] = { mask & 0xffffffff , mask >> 32 };
-	const char * err = apply_global32(A, mask32[0], base, ctx);
-	if (err)
-		return err;
-	err = apply_global32(A, mask32[1], base + 32, ctx);
-	return err;
+	}
+	for (; i < n; i++) {
+		const char *err = apply_cmd(A, &cmds[i], ctx);
+		if (err)
+			return err;
+	}
+	return NULL;
 }
 
 math_t
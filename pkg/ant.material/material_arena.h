@@ -4,8 +4,8 @@
 #include <bgfx/c99/bgfx.h>
 #include <stdint.h>
 #include "mathid.h"
+#include "material.h"
 
-#define MATERIAL_SYSTEM_ATTRIB_CHUNK 2
 #define INVALID_ATTRIB 0xffff
 
 #define ATTRIB_UNIFORM 0
@@ -30,6 +30,8 @@ attrib_id attrib_arena_new(struct attrib_arena *A, attrib_id prev, name_id key);
 attrib_id attrib_arena_delete(struct attrib_arena *A, attrib_id prev, attrib_id current);
 attrib_id attrib_arena_clone(struct attrib_arena *A, attrib_id prev, attrib_id head, attrib_id node);
 attrib_id attrib_arena_find(struct attrib_arena *A, attrib_id head, name_id key, attrib_id *prev);
+// two sorted attrib lists have the same keys and the same values
+int attrib_arena_equal(struct attrib_arena *A, attrib_id lhs, attrib_id rhs);
 math_t attrib_arena_remove(struct attrib_arena *A, attrib_id *prev);
 void attrib_arena_set_uniform(struct attrib_arena *A, int id, const float *v);
 void attrib_arena_clear_all_uniforms(struct attrib_arena *A, struct math_context *M);
@@ -46,10 +48,25 @@ struct attrib_arena_apply_context {
 	const float * (*math_value)(struct math_context *, math_t id);
 	int (*math_size)(struct math_context *ctx, math_t id);
 	bgfx_texture_handle_t (*texture_get)(int id);
+	struct material_apply_cache *cache;	// NULL: always emit
 };
 
+// baked attribs of a material: the sorted material attribs and then the system attribs, in a flat array
+struct attrib_arena_cmd {
+	const void *p;		// uniform: the value, others: the attrib node
+	name_id key;
+	bgfx_uniform_handle_t handle;
+	uint16_t n;			// uniform: element count
+	uint16_t vn;		// uniform: vec4 count
+	uint8_t type;
+};
+
+// n: the capacity of cmds, and return the count of cmds
+const char * attrib_arena_bake(struct attrib_arena *A, attrib_id head, const uint64_t global[MATERIAL_SYSTEM_ATTRIB_CHUNK], struct attrib_arena_cmd *cmds, int *n);
+// attrib_n: count of the material attribs in cmds, patch attribs replace them with the same key
+// global: the system attribs in cmds after attrib_n
+const char * attrib_arena_apply_baked(struct attrib_arena *A, const struct attrib_arena_cmd *cmds, int n, int attrib_n,
+	const uint64_t global[MATERIAL_SYSTEM_ATTRIB_CHUNK], attrib_id patch, struct attrib_arena_apply_context *ctx);
 const char * attrib_arena_apply(struct attrib_arena *A, int id, struct attrib_arena_apply_context *ctx);
-const char * attrib_arena_apply_list(struct attrib_arena *A, attrib_id head, attrib_id patch, struct attrib_arena_apply_context *ctx);
-const char * attrib_arena_apply_global(struct attrib_arena *A, uint64_t mask, int base, struct attrib_arena_apply_context *ctx);
 
 #endif
@@ -4,6 +4,8 @@
 #include <stdint.h>
 
 #define RENDER_MATERIAL_TYPE_MAX 64
+// material type of the instanced (draw indirect) variant is queue material type + RENDER_MATERIAL_INSTANCE_OFFSET
+#define RENDER_MATERIAL_INSTANCE_OFFSET (RENDER_MATERIAL_TYPE_MAX / 2)
 
 struct render_material;
 
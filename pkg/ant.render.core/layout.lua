@@ -57,7 +57,7 @@ local SHORTNAME_MAPPER<const> = {
 }
 
 local COMPSIZE_MAPPER<const> = {
-	f=4, i=2, u=1,	-- not valid for U, for 10 bit elemenet
+	f=4, i=2, h=2, u=1,	-- not valid for U, for 10 bit elemenet
 }
 
 function L.elem_size(corrected_elem)
@@ -318,8 +318,8 @@ local function format_varying(d)
         datatype = "ivec"
     else
         datatype = "vec"
-        if o ~= 'n' and t ~= 'f' then
-            error(("Invalid attribute:%s, not nomalize data should only be 'float'"):format(d))
+        if o ~= 'n' and t ~= 'f' and t ~= 'h' then
+            error(("Invalid attribute:%s, not nomalize data should only be 'float' or 'half'"):format(d))
         end
     end
     return SEMANTICS_WITH_INDICES[w] and ("%s%s %s%s"):format(datatype, n, s, i) or ("%s%s %s"):format(datatype, n, s)
@@ -0,0 +1,299 @@
+#include "bvh.h"
+
+#include <cassert>
+#include <algorithm>
+
+// fat aabb margin, in world unit
+static constexpr float BVH_AABB_MARGIN = 0.1f;
+
+static inline bvh_aabb
+aabb_merge(const bvh_aabb &lhs, const bvh_aabb &rhs){
+	bvh_aabb r;
+	for (int ii=0; ii<3; ++ii){
+		r.minv[ii] = std::min(lhs.minv[ii], rhs.minv[ii]);
+		r.maxv[ii] = std::max(lhs.maxv[ii], rhs.maxv[ii]);
+	}
+	return r;
+}
+
+static inline bool
+aabb_contain(const bvh_aabb &outer, const bvh_aabb &inner){
+	for (int ii=0; ii<3; ++ii){
+		if (inner.minv[ii] < outer.minv[ii] || inner.maxv[ii] > outer.maxv[ii])
+			return false;
+	}
+	return true;
+}
+
+// surface area / 2, the insert cost
+static inline float
+aabb_area(const bvh_aabb &b){
+	const float dx = b.maxv[0] - b.minv[0];
+	const float dy = b.maxv[1] - b.minv[1];
+	const float dz = b.maxv[2] - b.minv[2];
+	return dx * dy + dy * dz + dz * dx;
+}
+
+static inline bvh_aabb
+aabb_fat(const bvh_aabb &b){
+	bvh_aabb r;
+	for (int ii=0; ii<3; ++ii){
+		r.minv[ii] = b.minv[ii] - BVH_AABB_MARGIN;
+		r.maxv[ii] = b.maxv[ii] + BVH_AABB_MARGIN;
+	}
+	return r;
+}
+
+int
+bvh::alloc_node(){
+	if (freelist == NULL_NODE){
+		freelist = (int)nodes.size();
+		node n;
+		n.parent = NULL_NODE;
+		n.height = -1;
+		nodes.push_back(n);
+	}
+
+	const int id = freelist;
+	node &n = nodes[id];
+	freelist = n.parent;
+	n.parent = n.child1 = n.child2 = NULL_NODE;
+	n.height = 0;
+	n.userdata = -1;
+	return id;
+}
+
+void
+bvh::free_node(int id){
+	assert(0 <= id && id < (int)nodes.size());
+	nodes[id].parent = freelist;
+	nodes[id].height = -1;
+	freelist = id;
+}
+
+int
+bvh::insert(const bvh_aabb &aabb, int userdata){
+	const int proxy = alloc_node();
+	nodes[proxy].aabb = aabb_fat(aabb);
+	nodes[proxy].userdata = userdata;
+	insert_leaf(proxy);
+	return proxy;
+}
+
+void
+bvh::remove(int proxy){
+	assert(nodes[proxy].isleaf());
+	remove_leaf(proxy);
+	free_node(proxy);
+}
+
+bool
+bvh::move(int proxy, const bvh_aabb &aabb){
+	assert(nodes[proxy].isleaf());
+	if (aabb_contain(nodes[proxy].aabb, aabb))
+		return false;
+
+	remove_leaf(proxy);
+	nodes[proxy].aabb = aabb_fat(aabb);
+	insert_leaf(proxy);
+	return true;
+}
+
+void
+bvh::insert_leaf(int leaf){
+	if (root == NULL_NODE){
+		root = leaf;
+		nodes[root].parent = NULL_NODE;
+		return;
+	}
+
+	// find the best sibling by the area heuristic
+	const bvh_aabb leafaabb = nodes[leaf].aabb;
+	int index = root;
+	while (!nodes[index].isleaf()){
+		const node &n = nodes[index];
+		const float area = aabb_area(n.aabb);
+		const float combined = aabb_area(aabb_merge(n.aabb, leafaabb));
+
+		// cost of creating a new parent for this node and the new leaf
+		const float cost = 2.f * combined;
+		// minimum cost of pushing the leaf further down the tree
+		const float inheritance = 2.f * (combined - area);
+
+		auto child_cost = [&](int c){
+			const bvh_aabb merged = aabb_merge(leafaabb, nodes[c].aabb);
+			return nodes[c].isleaf() ?
+				aabb_area(merged) + inheritance :
+				aabb_area(merged) - aabb_area(nodes[c].aabb) + inheritance;
+		};
+		const float cost1 = child_cost(n.child1);
+		const float cost2 = child_cost(n.child2);
+
+		if (cost < cost1 && cost < cost2)
+			break;
+
+		index = cost1 < cost2 ? n.child1 : n.child2;
+	}
+
+	const int sibling = index;
+	const int oldparent = nodes[sibling].parent;
+	const int newparent = alloc_node();
+	nodes[newparent].parent = oldparent;
+	nodes[newparent].aabb = aabb_merge(leafaabb, nodes[sibling].aabb);
+	nodes[newparent].height = nodes[sibling].height + 1;
+	nodes[newparent].child1 = sibling;
+	nodes[newparent].child2 = leaf;
+	nodes[sibling].parent = newparent;
+	nodes[leaf].parent = newparent;
+
+	if (oldparent != NULL_NODE){
+		if (nodes[oldparent].child1 == sibling){
+			nodes[oldparent].child1 = newparent;
+		} else {
+			nodes[oldparent].child2 = newparent;
+		}
+	} else {
+		root = newparent;
+	}
+
+	// refit the ancestors
+	for (index = nodes[leaf].parent; index != NULL_NODE; index = nodes[index].parent){
+		index = balance(index);
+		node &n = nodes[index];
+		n.height = 1 + std::max(nodes[n.child1].height, nodes[n.child2].height);
+		n.aabb = aabb_merge(nodes[n.child1].aabb, nodes[n.child2].aabb);
+	}
+}
+
+void
+bvh::remove_leaf(int leaf){
+	if (leaf == root){
+		root = NULL_NODE;
+		return;
+	}
+
+	const int parent = nodes[leaf].parent;
+	const int grandparent = nodes[parent].parent;
+	const int sibling = nodes[parent].child1 == leaf ? nodes[parent].child2 : nodes[parent].child1;
+
+	if (grandparent != NULL_NODE){
+		// destroy parent and connect sibling to grandparent
+		if (nodes[grandparent].child1 == parent){
+			nodes[grandparent].child1 = sibling;
+		} else {
+			nodes[grandparent].child2 = sibling;
+		}
+		nodes[sibling].parent = grandparent;
+		free_node(parent);
+
+		for (int index = grandparent; index != NULL_NODE; index = nodes[index].parent){
+			index = balance(index);
+			node &n = nodes[index];
+			n.aabb = aabb_merge(nodes[n.child1].aabb, nodes[n.child2].aabb);
+			n.height = 1 + std::max(nodes[n.child1].height, nodes[n.child2].height);
+		}
+	} else {
+		root = sibling;
+		nodes[sibling].parent = NULL_NODE;
+		free_node(parent);
+	}
+}
+
+// rotate the subtree when its children heights differ more than 1, return the new root of the subtree
+int
+bvh::balance(int ia){
+	assert(ia != NULL_NODE);
+	node *A = &nodes[ia];
+	if (A->isleaf() || A->height < 2)
+		return ia;
+
+	const int ib = A->child1;
+	const int ic = A->child2;
+	node *B = &nodes[ib];
+	node *C = &nodes[ic];
+	const int diff = C->height - B->height;
+
+	// rotate C up
+	if (diff > 1){
+		const int iF = C->child1;
+		const int iG = C->child2;
+		node *F = &nodes[iF];
+		node *G = &nodes[iG];
+
+		C->child1 = ia;
+		C->parent = A->parent;
+		A->parent = ic;
+
+		if (C->parent != NULL_NODE){
+			if (nodes[C->parent].child1 == ia){
+				nodes[C->parent].child1 = ic;
+			} else {
+				nodes[C->parent].child2 = ic;
+			}
+		} else {
+			root = ic;
+		}
+
+		if (F->height > G->height){
+			C->child2 = iF;
+			A->child2 = iG;
+			G->parent = ia;
+			A->aabb = aabb_merge(B->aabb, G->aabb);
+			C->aabb = aabb_merge(A->aabb, F->aabb);
+			A->height = 1 + std::max(B->height, G->height);
+			C->height = 1 + std::max(A->height, F->height);
+		} else {
+			C->child2 = iG;
+			A->child2 = iF;
+			F->parent = ia;
+			A->aabb = aabb_merge(B->aabb, F->aabb);
+			C->aabb = aabb_merge(A->aabb, G->aabb);
+			A->height = 1 + std::max(B->height, F->height);
+			C->height = 1 + std::max(A->height, G->height);
+		}
+		return ic;
+	}
+
+	// rotate B up
+	if (diff < -1){
+		const int iD = B->child1;
+		const int iE = B->child2;
+		node *D = &nodes[iD];
+		node *E = &nodes[iE];
+
+		B->child1 = ia;
+		B->parent = A->parent;
+		A->parent = ib;
+
+		if (B->parent != NULL_NODE){
+			if (nodes[B->parent].child1 == ia){
+				nodes[B->parent].child1 = ib;
+			} else {
+				nodes[B->parent].child2 = ib;
+			}
+		} else {
+			root = ib;
+		}
+
+		if (D->height > E->height){
+			B->child2 = iD;
+			A->child1 = iE;
+			E->parent = ia;
+			A->aabb = aabb_merge(C->aabb, E->aabb);
+			B->aabb = aabb_merge(A->aabb, D->aabb);
+			A->height = 1 + std::max(C->height, E->height);
+			B->height = 1 + std::max(A->height, D->height);
+		} else {
+			B->child2 = iE;
+			A->child1 = iD;
+			D->parent = ia;
+			A->aabb = aabb_merge(C->aabb, D->aabb);
+			B->aabb = aabb_merge(A->aabb, E->aabb);
+			A->height = 1 + std::max(C->height, D->height);
+			B->height = 1 + std::max(A->height, E->height);
+		}
+		return ib;
+	}
+
+	return ia;
+}
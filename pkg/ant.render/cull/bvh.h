@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+struct bvh_aabb {
+	float minv[3];
+	float maxv[3];
+};
+
+// dynamic aabb tree: leaves keep a fat aabb, so a small movement only refits the leaf data instead of the tree
+struct bvh {
+	static constexpr int NULL_NODE = -1;
+
+	struct node {
+		bvh_aabb	aabb;
+		int			parent;		// next free node when it is in free list
+		int			child1;
+		int			child2;
+		int			height;		// leaf: 0, free: -1
+		int			userdata;
+
+		bool isleaf() const {
+			return child1 == NULL_NODE;
+		}
+	};
+
+	int insert(const bvh_aabb &aabb, int userdata);
+	void remove(int proxy);
+	// return true if the leaf is reinserted
+	bool move(int proxy, const bvh_aabb &aabb);
+
+	const node& get(int proxy) const {
+		return nodes[proxy];
+	}
+
+	uint32_t capacity() const {
+		return (uint32_t)nodes.size();
+	}
+
+	int root = NULL_NODE;
+	std::vector<node> nodes;
+
+private:
+	int alloc_node();
+	void free_node(int id);
+	void insert_leaf(int leaf);
+	void remove_leaf(int leaf);
+	int balance(int id);
+
+	int freelist = NULL_NODE;
+};
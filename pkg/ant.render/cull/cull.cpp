@@ -4,10 +4,10 @@
 
 extern "C"{
 	#include "math3d.h"
-	#include "math3dfunc.h"
 }
 
 #include "../render/queue.h"
+#include "bvh.h"
 
 #include <cassert>
 #include <cstring>
@@ -15,16 +15,114 @@ extern "C"{
 #include <unordered_map>
 #include <vector>
 #include <algorithm>
+#include <bit>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CULL_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CULL_NEON
+#endif
 
 using tags = std::vector<int>;
 using cull_infos = std::unordered_map<uint64_t, tags>;
 
+static constexpr uint32_t CULL_LANES = 4;
+static constexpr uint8_t CULL_MASK_NUM = MAX_VISIBLE_QUEUE / 64;
+static constexpr uint8_t FRUSTUM_PLANE_NUM = 6;
+
 struct cullqueue_info{
 	math_t	mid;
 	int 	Qidx;
 };
 
+// scene_aabb gathered as SoA, so CULL_LANES boxes are tested against one plane at once
+struct cull_boxes {
+	std::vector<float>		minv[3];
+	std::vector<float>		maxv[3];
+	std::vector<int>		cull_idx;
+	std::vector<uint64_t>	culled;		// bit ii: culled by cullqueue_cache::cq[ii]
+	uint32_t				num = 0;
+
+	void clear(){
+		num = 0;
+	}
+
+	void add(const bvh_aabb &aabb, int cidx){
+		if (num % CULL_LANES == 0){
+			// grow a full lane group, padding lanes are tested but never written back
+			const uint32_t n = num + CULL_LANES;
+			for (int ii=0; ii<3; ++ii){
+				minv[ii].resize(n, 0.f);
+				maxv[ii].resize(n, 0.f);
+			}
+			cull_idx.resize(n);
+			culled.resize(n);
+		}
+		for (int ii=0; ii<3; ++ii){
+			minv[ii][num] = aabb.minv[ii];
+			maxv[ii][num] = aabb.maxv[ii];
+		}
+		cull_idx[num] = cidx;
+		++num;
+	}
+};
+
+// same as math3d_frustum_intersect_aabb() < 0: the box is outside when its farthest corner along the plane normal
+// (the positive vertex) is behind any plane. The positive vertex is picked per plane, so it is the same for all lanes
+static inline uint32_t
+cull_lanes(const float *planes, const cull_boxes &b, uint32_t idx){
+#if defined(CULL_SSE2)
+	const __m128 zero = _mm_setzero_ps();
+	__m128 outside = zero;
+	for (uint8_t ip=0; ip<FRUSTUM_PLANE_NUM; ++ip){
+		const float *p = planes + ip * 4;
+		const __m128 x = _mm_loadu_ps(&(p[0] > 0.f ? b.maxv[0] : b.minv[0])[idx]);
+		const __m128 y = _mm_loadu_ps(&(p[1] > 0.f ? b.maxv[1] : b.minv[1])[idx]);
+		const __m128 z = _mm_loadu_ps(&(p[2] > 0.f ? b.maxv[2] : b.minv[2])[idx]);
+		const __m128 d = _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(p[0])), _mm_mul_ps(y, _mm_set1_ps(p[1]))),
+			_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(p[2])), _mm_set1_ps(p[3])));
+		outside = _mm_or_ps(outside, _mm_cmplt_ps(d, zero));
+	}
+	return (uint32_t)_mm_movemask_ps(outside);
+#elif defined(CULL_NEON)
+	const float32x4_t zero = vdupq_n_f32(0.f);
+	uint32x4_t outside = vdupq_n_u32(0);
+	for (uint8_t ip=0; ip<FRUSTUM_PLANE_NUM; ++ip){
+		const float *p = planes + ip * 4;
+		const float32x4_t x = vld1q_f32(&(p[0] > 0.f ? b.maxv[0] : b.minv[0])[idx]);
+		const float32x4_t y = vld1q_f32(&(p[1] > 0.f ? b.maxv[1] : b.minv[1])[idx]);
+		const float32x4_t z = vld1q_f32(&(p[2] > 0.f ? b.maxv[2] : b.minv[2])[idx]);
+		float32x4_t d = vdupq_n_f32(p[3]);
+		d = vmlaq_n_f32(d, x, p[0]);
+		d = vmlaq_n_f32(d, y, p[1]);
+		d = vmlaq_n_f32(d, z, p[2]);
+		outside = vorrq_u32(outside, vcltq_f32(d, zero));
+	}
+	uint32_t lanes[CULL_LANES];
+	vst1q_u32(lanes, outside);
+	return (lanes[0] & 1) | (lanes[1] & 2) | (lanes[2] & 4) | (lanes[3] & 8);
+#else
+	uint32_t outside = 0;
+	for (uint32_t il=0; il<CULL_LANES; ++il){
+		for (uint8_t ip=0; ip<FRUSTUM_PLANE_NUM; ++ip){
+			const float *p = planes + ip * 4;
+			const float d = p[0] * (p[0] > 0.f ? b.maxv[0] : b.minv[0])[idx+il]
+						+ p[1] * (p[1] > 0.f ? b.maxv[1] : b.minv[1])[idx+il]
+						+ p[2] * (p[2] > 0.f ? b.maxv[2] : b.minv[2])[idx+il]
+						+ p[3];
+			if (d < 0.f){
+				outside |= 1u << il;
+				break;
+			}
+		}
+	}
+	return outside;
+#endif
+}
+
 struct cullqueue_cache {
 	uint16_t count = 0;
 	struct cullqueue_info cq[MAX_VISIBLE_QUEUE];
@@ -62,35 +160,236 @@ struct cullqueue_cache {
 		struct cullqueue_info& q = find_cullqueue(mid);
 		queue_set(w->Q, q.Qidx, queue_index, true);
 	}
+
+	// test all boxes against all frustums in one pass
+	void cull(cull_boxes &b) const {
+		std::fill(b.culled.begin(), b.culled.begin() + b.num, 0);
+		for (uint16_t ii=0; ii<count; ++ii){
+			// frustum planes is an array of FRUSTUM_PLANE_NUM vec4
+			const float *planes = math_value(w->math3d->M, cq[ii].mid);
+			for (uint32_t ib=0; ib<b.num; ib += CULL_LANES){
+				const uint32_t outside = cull_lanes(planes, b, ib);
+				for (uint32_t il=0; il<CULL_LANES; ++il){
+					if (outside & (1u << il)){
+						b.culled[ib+il] |= 1ull << ii;
+					}
+				}
+			}
+		}
+	}
+
+	// write cull_idx queue masks, one update per entity for all queues
+	void update(const int *cull_idx, const uint64_t *culled, uint32_t num) const {
+		uint64_t qmasks[MAX_VISIBLE_QUEUE][CULL_MASK_NUM];
+		uint64_t allmasks[CULL_MASK_NUM] = {0};
+		for (uint16_t ii=0; ii<count; ++ii){
+			queue_fetch(w->Q, cq[ii].Qidx, qmasks[ii]);
+			for (uint8_t im=0; im<CULL_MASK_NUM; ++im){
+				allmasks[im] |= qmasks[ii][im];
+			}
+		}
+
+		for (uint32_t ib=0; ib<num; ++ib){
+			uint64_t setmasks[CULL_MASK_NUM] = {0};
+			for (uint64_t c = culled[ib]; c; c &= c - 1){
+				const int ii = std::countr_zero(c);
+				for (uint8_t im=0; im<CULL_MASK_NUM; ++im){
+					setmasks[im] |= qmasks[ii][im];
+				}
+			}
+			queue_update_masks(w->Q, cull_idx[ib], allmasks, setmasks);
+		}
+	}
 };
 
-struct cull_cached {
-	cull_cached(struct ecs_context* ctx) : render_obj(ctx), hitch_obj(ctx){}
-	ecs::cached_context<component::render_object_visible, component::render_object, component::visible, component::bounding> render_obj;
-	ecs::cached_context<component::hitch_visible, component::hitch, component::visible, component::bounding> hitch_obj;
-}; 
+// <0: outside, 0: intersect, >0: inside
+static inline int
+frustum_classify(const float *planes, const bvh_aabb &b){
+	int r = 1;
+	for (uint8_t ip=0; ip<FRUSTUM_PLANE_NUM; ++ip){
+		const float *p = planes + ip * 4;
+		float pd = p[3], nd = p[3];
+		for (int ii=0; ii<3; ++ii){
+			if (p[ii] > 0.f){
+				pd += p[ii] * b.maxv[ii];
+				nd += p[ii] * b.minv[ii];
+			} else {
+				pd += p[ii] * b.minv[ii];
+				nd += p[ii] * b.maxv[ii];
+			}
+		}
+		if (pd < 0.f)
+			return -1;
+		if (nd < 0.f)
+			r = 0;
+	}
+	return r;
+}
+
+static inline bool
+to_bvh_aabb(const float *v, bvh_aabb &b){
+	for (int ii=0; ii<3; ++ii){
+		b.minv[ii] = v[ii];
+		b.maxv[ii] = v[4+ii];
+		// an empty aabb (min > max) or nan can not be in tree
+		if (!(b.minv[ii] <= b.maxv[ii]))
+			return false;
+	}
+	return true;
+}
+
+// bvh over scene_aabb, refit by scene_changed, the leaf userdata is cull_idx
+struct cull_tree {
+	struct leaf {
+		bvh_aabb	aabb;	// the tree node keeps a fat aabb
+		int			cull_idx;
+	};
+
+	void set(int cull_idx, const bvh_aabb &aabb){
+		auto it = proxies.find(cull_idx);
+		int proxy;
+		if (it == proxies.end()){
+			proxy = tree.insert(aabb, cull_idx);
+			proxies.emplace(cull_idx, proxy);
+		} else {
+			proxy = it->second;
+			tree.move(proxy, aabb);
+		}
+		if (leaves.size() < tree.capacity())
+			leaves.resize(tree.capacity());
+		leaves[proxy] = leaf{aabb, cull_idx};
+	}
+
+	void remove(int cull_idx){
+		auto it = proxies.find(cull_idx);
+		if (it != proxies.end()){
+			tree.remove(it->second);
+			proxies.erase(it);
+		}
+	}
 
-template<typename ObjType>
-struct cull_operation{
 	template<typename EntityType>
-	static void cull(struct ecs_world*w, EntityType &e, struct cullqueue_cache *cc){
-		const auto &b = e.template get<component::bounding>();
-
-		if (!math_isnull(b.scene_aabb)){
-			auto &o = e.template get<ObjType>();
-			for (uint8_t ii=0; ii<cc->count; ++ii){
-				struct cullqueue_info& q = cc->cq[ii];
-				const bool isculled = math3d_frustum_intersect_aabb(w->math3d->M, q.mid, b.scene_aabb) < 0;
-				queue_set_by_index(w->Q, o.cull_idx, q.Qidx, isculled);
+	static const int* find_cull_idx(EntityType &e){
+		if (auto ro = e.template component<component::render_object>())
+			return &ro->cull_idx;
+		if (auto h = e.template component<component::hitch>())
+			return &h->cull_idx;
+		return nullptr;
+	}
+
+	void update(struct ecs_world *w){
+		for (auto& e : ecs::select<component::scene_changed, component::bounding>(w->ecs)){
+			const int *cull_idx = find_cull_idx(e);
+			if (!cull_idx)
+				continue;
+			const auto &b = e.get<component::bounding>();
+			bvh_aabb aabb;
+			if (math_isnull(b.scene_aabb) || !to_bvh_aabb(math_value(w->math3d->M, b.scene_aabb), aabb)){
+				remove(*cull_idx);
+			} else {
+				set(*cull_idx, aabb);
+			}
+		}
+	}
+
+	void remove_entities(struct ecs_world *w){
+		for (auto& e : ecs::select<component::REMOVED, component::render_object>(w->ecs)){
+			remove(e.get<component::render_object>().cull_idx);
+		}
+		for (auto& e : ecs::select<component::REMOVED, component::hitch>(w->ecs)){
+			remove(e.get<component::hitch>().cull_idx);
+		}
+	}
+
+	void add_resolved(int inode, uint64_t culled){
+		subtree.clear();
+		subtree.push_back(inode);
+		while (!subtree.empty()){
+			const auto &n = tree.get(subtree.back());
+			subtree.pop_back();
+			if (n.isleaf()){
+				resolved_idx.push_back(n.userdata);
+				resolved_culled.push_back(culled);
+			} else {
+				subtree.push_back(n.child1);
+				subtree.push_back(n.child2);
 			}
 		}
 	}
+
+	// walk the tree with all frustums at once, a subtree is resolved when it is inside or outside of every frustum,
+	// leaves still intersecting some frustum are tested by the batch path
+	void cull(struct ecs_world *w, const cullqueue_cache &cqc){
+		resolved_idx.clear();
+		resolved_culled.clear();
+		boxes.clear();
+		if (tree.root == bvh::NULL_NODE)
+			return;
+
+		const float *planes[MAX_VISIBLE_QUEUE];
+		for (uint16_t ii=0; ii<cqc.count; ++ii){
+			planes[ii] = math_value(w->math3d->M, cqc.cq[ii].mid);
+		}
+
+		const uint64_t all = cqc.count == 64 ? ~0ull : ((1ull << cqc.count) - 1);
+		stack.clear();
+		stack.push_back(item{tree.root, all, 0});
+		while (!stack.empty()){
+			item it = stack.back();
+			stack.pop_back();
+			const auto &n = tree.get(it.node);
+			for (uint64_t p = it.pending; p; p &= p - 1){
+				const int ii = std::countr_zero(p);
+				const int r = frustum_classify(planes[ii], n.aabb);
+				if (r != 0){
+					it.pending &= ~(1ull << ii);
+					if (r < 0)
+						it.culled |= 1ull << ii;
+				}
+			}
+
+			if (it.pending == 0){
+				add_resolved(it.node, it.culled);
+			} else if (n.isleaf()){
+				const auto &l = leaves[it.node];
+				boxes.add(l.aabb, l.cull_idx);
+			} else {
+				stack.push_back(item{n.child1, it.pending, it.culled});
+				stack.push_back(item{n.child2, it.pending, it.culled});
+			}
+		}
+
+		cqc.cull(boxes);
+		cqc.update(resolved_idx.data(), resolved_culled.data(), (uint32_t)resolved_idx.size());
+		cqc.update(boxes.cull_idx.data(), boxes.culled.data(), boxes.num);
+	}
+
+	struct item {
+		int			node;
+		uint64_t	pending;	// bit ii: cq[ii] intersects the node
+		uint64_t	culled;
+	};
+
+	bvh								tree;
+	std::unordered_map<int, int>	proxies;	// cull_idx : proxy
+	std::vector<leaf>				leaves;		// indexed by proxy
+
+	// temporary, keep the storage between frames
+	std::vector<item>				stack;
+	std::vector<int>				subtree;
+	std::vector<int>				resolved_idx;
+	std::vector<uint64_t>			resolved_culled;
+	cull_boxes						boxes;
+};
+
+struct cull_cached {
+	cull_tree tree;
 };
 
 static int
 linit(lua_State *L) {
 	auto w = getworld(L);
-	w->cull_cached = new struct cull_cached(w->ecs);
+	w->cull_cached = new struct cull_cached;
 	return 0;
 }
 
@@ -112,17 +411,25 @@ lcull(lua_State *L) {
 	}
 
 	if (!cqc.empty()){
-		for (auto e : ecs::cached_select(w->cull_cached->render_obj)) {
-			cull_operation<component::render_object>::cull(w, e, &cqc);
-		}
-
-		for (auto& e : ecs::cached_select(w->cull_cached->hitch_obj)) {
-			cull_operation<component::hitch>::cull(w, e, &cqc);
-		}
+		w->cull_cached->tree.cull(w, cqc);
 	}
 	return 0;
 }
 
+static int
+lupdate(lua_State *L) {
+	auto w = getworld(L);
+	w->cull_cached->tree.update(w);
+	return 0;
+}
+
+static int
+lentity_remove(lua_State *L) {
+	auto w = getworld(L);
+	w->cull_cached->tree.remove_entities(w);
+	return 0;
+}
+
 extern "C" int
 luaopen_system_cull(lua_State *L) {
 	luaL_checkversion(L);
@@ -130,6 +437,8 @@ luaopen_system_cull(lua_State *L) {
 		{ "init", linit },
 		{ "exit", lexit },
 		{ "cull", lcull },
+		{ "update", lupdate },
+		{ "entity_remove", lentity_remove },
 		{ NULL, NULL },
 	};
 	luaL_newlibtable(L,l);
@@ -23,6 +23,7 @@ local cull_sys = ecs.system "cull_system"
 
 cull_sys.init = cullcore.init
 cull_sys.exit = cullcore.exit
+cull_sys.entity_remove = cullcore.entity_remove
 
 local function build_cull_args()
 	w:clear "cull_args"
@@ -39,6 +40,9 @@ function cull_sys:cull()
 		return
 	end
 
+	-- refit the bounding tree with this frame's scene_changed entities
+	cullcore.update()
+
 	if w:check "camera_changed" then
 		build_cull_args()
 		cullcore.cull()
@@ -0,0 +1,149 @@
+local ecs	= ...
+local world	= ecs.world
+local w		= world.w
+
+local mc		= import_package "ant.math".constant
+local setting	= import_package "ant.settings"
+
+-- objects in clean tiles are culled from main_queue, it only works when main view keeps last frame content,
+-- so it's skipped in the frames which main_queue clears color
+local ENABLE_TILE_CULLING<const>	= setting:get "graphic/tile_culling/enable"
+
+local queuemgr	= ecs.require "queue_mgr"
+local irq		= ecs.require "renderqueue"
+
+local TC		= world:clibs "render.tileculling"
+local Q			= world:clibs "render.queue"
+
+local tc_sys = ecs.system "tile_culling_system"
+
+local screen
+local main_queue_index
+
+-- eid -> screen rect {x, y, w, h} of last frame, moved or removed objects dirty their old place
+local LAST_RECTS = {}
+-- cull_idx -> true, the objects whose main_queue cull bit is set by tile culling (not by cull_system) in last frame
+local TILE_CULLED = {}
+local CHANGELESS = {}
+
+local vr_mb
+
+function tc_sys:init()
+	if not ENABLE_TILE_CULLING then
+		return
+	end
+	screen = TC.new()
+	main_queue_index = queuemgr.queue_index "main_queue"
+	vr_mb = world:sub{"view_rect_changed", "main_queue"}
+end
+
+function tc_sys:exit()
+	if screen then
+		screen:delete()
+		screen = nil
+	end
+end
+
+local function change_rect(r)
+	if r then
+		screen:change(r[1], r[2], r[3], r[4])
+	end
+end
+
+function tc_sys:entity_remove()
+	if not screen then
+		return
+	end
+	for e in w:select "REMOVED render_object:in eid:in" do
+		change_rect(LAST_RECTS[e.eid])
+		LAST_RECTS[e.eid] = nil
+		local cidx = e.render_object.cull_idx
+		if TILE_CULLED[cidx] then
+			Q.set(cidx, main_queue_index, false)
+			TILE_CULLED[cidx] = nil
+		end
+	end
+end
+
+-- before cull_system: the bits set by tile culling were clear before, clear them again and let cull_system update them.
+-- restoring after cull_system would clear the bits which cull_system sets in this frame
+function tc_sys:refine_filter()
+	if not screen then
+		return
+	end
+	for cidx in pairs(TILE_CULLED) do
+		Q.set(cidx, main_queue_index, false)
+		TILE_CULLED[cidx] = nil
+	end
+end
+
+local function keep_content()
+	local cs = irq.clear_state "main_queue"
+	return not (cs and cs.clear and cs.clear:find "C")
+end
+
+local function visible_in_main_queue(ro)
+	return Q.check(ro.visible_idx, main_queue_index) and not Q.check(ro.cull_idx, main_queue_index)
+end
+
+-- after cull_system, the frustum culled bits of this frame are ready
+function tc_sys:cull()
+	if not screen then
+		return
+	end
+
+	local ce = irq.main_camera_entity "camera:in"
+	local viewprojmat = ce.camera.viewprojmat
+	local resized
+	for _ in vr_mb:each() do
+		resized = true
+	end
+	if resized or irq.main_camera_changed() then
+		-- everything in screen moved, or the content is lost
+		screen:change(0, 0, 1, 1)
+	end
+
+	local n = 0
+	for e in w:select "render_object:in bounding:in scene_changed?in eid:in" do
+		local ro = e.render_object
+		local aabb = e.bounding.scene_aabb
+		local last = LAST_RECTS[e.eid]
+		local x, y, ww, hh
+		if visible_in_main_queue(ro) and aabb ~= mc.NULL then
+			x, y, ww, hh = TC.rect(viewprojmat, aabb)
+		end
+		if e.scene_changed or last == nil or x == nil then
+			change_rect(last)
+			if x then
+				screen:change(x, y, ww, hh)
+			end
+		else
+			local id = screen:changeless(x, y, ww, hh)
+			if id then
+				CHANGELESS[n+1] = ro.cull_idx
+				CHANGELESS[n+2] = id
+				n = n + 2
+			end
+		end
+		if x then
+			last = last or {}
+			last[1], last[2], last[3], last[4] = x, y, ww, hh
+			LAST_RECTS[e.eid] = last
+		else
+			LAST_RECTS[e.eid] = nil
+		end
+	end
+
+	screen:submit()
+
+	if keep_content() then
+		for i=1, n, 2 do
+			if not screen:query(CHANGELESS[i+1]) then
+				local cidx = CHANGELESS[i]
+				Q.set(cidx, main_queue_index, true)
+				TILE_CULLED[cidx] = true
+			end
+		end
+	end
+	screen:reset()
+end
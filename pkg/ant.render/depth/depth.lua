@@ -14,6 +14,7 @@ local queuemgr      = ecs.require "queue_mgr"
 
 local R             = world:clibs "render.render_material"
 local RM            = ecs.require "ant.material|material"
+local imaterial     = ecs.require "ant.render|material"
 
 local irq           = ecs.require "ant.render|renderqueue"
 local irl		    = ecs.require "ant.render|render_layer.render_layer"
@@ -33,6 +34,13 @@ local function which_material(e, matres)
     return assert(FEATURE_MATERIALS[flag], "Invalid featureset")
 end
 
+--only the default depth material has an instanced variant
+local function which_instance_material(m)
+    if m == FEATURE_MATERIALS[featureset.flag ""] then
+        return FEATURE_MATERIALS[featureset.flag "DRAW_INDIRECT"]
+    end
+end
+
 function s:init()
     FEATURE_MATERIALS[featureset.flag ""]               = assetmgr.resource "/pkg/ant.resources/materials/predepth.material"
     FEATURE_MATERIALS[featureset.flag "GPU_SKINNING"]   = assetmgr.resource "/pkg/ant.resources/materials/predepth_skin.material"
@@ -70,6 +78,15 @@ function s:entity_ready()
                     local midx = queuemgr.material_index "pre_depth_queue"
                     fm[midx] = mi
                     R.set(e.render_object.rm_idx, midx, mi:ptr())
+
+                    local im = which_instance_material(m)
+                    if im then
+                        local imi = RM.create_instance(im.depth.object)
+                        local imidx = queuemgr.instance_material_index "pre_depth_queue"
+                        fm[imidx] = imi
+                        R.set(e.render_object.rm_idx, imidx, imi:ptr())
+                        imaterial.sync_instance_state(fm, midx)
+                    end
                 end
             end
         end
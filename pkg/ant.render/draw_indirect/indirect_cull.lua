@@ -0,0 +1,169 @@
+local ecs   = ...
+local world = ecs.world
+local w     = world.w
+
+local bgfx      = require "bgfx"
+local math3d    = require "math3d"
+local hwi       = import_package "ant.hwi"
+local setting   = import_package "ant.settings"
+local assetmgr  = import_package "ant.asset"
+
+local icompute  = ecs.require "ant.render|compute.compute"
+local irq       = ecs.require "ant.render|renderqueue"
+local iviewport = ecs.require "ant.render|viewport.state"
+
+--hiz mip chain is min depth, it only works with inverse z
+local ENABLE_HIZ<const>     = setting:get "graphic/inv_z" and setting:get "graphic/indirect_cull/hiz"
+--hiz is sampled in the mip which is not larger than this size
+local HIZ_SIZE<const>       = 64
+local INVALID_HANDLE_VALUE<const> = 0xffffffff
+
+local cull_material<const>  = "/pkg/ant.resources/materials/indirect/indirect_cull.material"
+local reset_material<const> = "/pkg/ant.resources/materials/indirect/indirect_count_reset.material"
+
+local viewid<const> = hwi.viewid_get "indirect_cull"
+
+-- draw_indirect_cull: the draw commands which draw_indirect producer writes are culled on gpu by main camera before the csm views,
+-- visible commands are compacted into another indirect buffer, and the draw count is kept in gpu.
+-- the producers must dispatch in the views before "indirect_cull" (csm_fb/skinning), or the pass reads the commands of last frame.
+-- NOTE: shadow is not handled, the csm queues draw the same culled commands, the casters out of main camera lose their shadow
+local dic_sys = ecs.system "draw_indirect_cull_system"
+
+local COMPACT
+local CULL_EID, RESET_EID
+local READY = 0
+local LAST_VIEWPROJ = math3d.ref(math3d.matrix())
+local LAST_HIZ_HANDLE
+
+local function on_ready(e)
+    w:extend(e, "dispatch:in")
+    assetmgr.material_mark(e.dispatch.fx.prog)
+    READY = READY + 1
+end
+
+function dic_sys:init()
+    COMPACT = bgfx.get_caps().supported.DRAW_INDIRECT_COUNT
+    CULL_EID = world:create_entity {
+        policy = { "ant.render|compute" },
+        data = {
+            material    = cull_material,
+            dispatch    = { size = {1, 1, 1} },
+            on_ready    = on_ready,
+        }
+    }
+    if COMPACT then
+        RESET_EID = world:create_entity {
+            policy = { "ant.render|compute" },
+            data = {
+                material    = reset_material,
+                dispatch    = { size = {1, 1, 1} },
+                on_ready    = on_ready,
+            }
+        }
+    else
+        READY = READY + 1
+    end
+end
+
+local function destroy_handle(h)
+    if h then
+        bgfx.destroy(h)
+    end
+end
+
+local function check_buffers(dic, size)
+    if dic.size ~= size then
+        destroy_handle(dic.handle)
+        dic.handle = bgfx.create_indirect_buffer(size)
+        dic.size = size
+    end
+    if dic.count_handle == nil then
+        dic.count_handle = bgfx.create_index_buffer(bgfx.memory_buffer(('\0'):rep(16)), "drw")
+    end
+end
+
+local function buffer_property(handle, stage, access)
+    return {
+        type    = "b",
+        value   = handle,
+        stage   = stage,
+        access  = access,
+    }
+end
+
+local function hiz_image()
+    if not ENABLE_HIZ or not w:first "depth_mipmap" then
+        return
+    end
+    local rde = w:first "depth_resolve dispatch:in"
+    local handle = rde and rde.dispatch.resolve_depth_handle
+    --hiz is last frame depth, a new created depth buffer is not valid yet
+    local last = LAST_HIZ_HANDLE
+    LAST_HIZ_HANDLE = handle
+    if handle == nil or handle ~= last then
+        return
+    end
+
+    local vr = iviewport.viewrect
+    local s = math.max(vr.w, vr.h)
+    local nummip = math.floor(math.log(s, 2))+1
+    local mip = math.max(0, math.ceil(math.log(s / HIZ_SIZE, 2)))
+    return icompute.create_image_property(handle, 4, math.min(mip, nummip-1), "r")
+end
+
+function dic_sys:cull()
+    if READY < 2 then
+        return
+    end
+
+    local ce = irq.main_camera_entity "camera:in"
+    local viewprojmat = ce.camera.viewprojmat
+
+    local cull = world:entity(CULL_EID, "dispatch:in").dispatch
+    local m = cull.material
+    m.u_cull_planes = math3d.frustum_planes(viewprojmat)
+
+    local hiz = hiz_image()
+    if hiz then
+        --hiz is rendered with last frame camera
+        m.s_hiz = hiz
+        m.u_cull_viewproj = math3d.array_vector{math3d.index(LAST_VIEWPROJ, 1, 2, 3, 4)}
+    end
+    LAST_VIEWPROJ.m = viewprojmat
+
+    local reset = RESET_EID and world:entity(RESET_EID, "dispatch:in").dispatch
+    for e in w:select "draw_indirect_cull:in draw_indirect:in indirect_object:update bounding:in scene:in" do
+        local dic, di, io = e.draw_indirect_cull, e.draw_indirect, e.indirect_object
+        local ib = di.instance_buffer
+        if di.handle and ib.handle and ib.num > 0 then
+            check_buffers(dic, ib.size)
+            if reset then
+                reset.material.b_draw_count = buffer_property(dic.count_handle, 0, "w")
+                icompute.dispatch(viewid, reset)
+            end
+
+            m.u_cull_param          = math3d.vector(ib.num, hiz and 1 or 0, COMPACT and 1 or 0, 0)
+            m.u_cull_aabb           = dic.aabb or e.bounding.aabb
+            --the instances are drawn with the entity worldmat, rows of it
+            m.u_cull_worldmat       = math3d.array_vector{math3d.index(math3d.transpose(e.scene.worldmat), 1, 2, 3)}
+            m.b_indirect_src        = buffer_property(di.handle, 0, "r")
+            m.b_indirect_dst        = buffer_property(dic.handle, 1, "w")
+            m.b_draw_count          = buffer_property(dic.count_handle, 2, "rw")
+            m.b_instance_buffer     = buffer_property(ib.handle, 3, "r")
+            cull.size[1] = (ib.num+63) // 64
+            icompute.dispatch(viewid, cull)
+
+            io.idb_handle   = dic.handle
+            io.count_handle = COMPACT and dic.count_handle or INVALID_HANDLE_VALUE
+        end
+    end
+end
+
+function dic_sys:entity_remove()
+    for e in w:select "REMOVED draw_indirect_cull:in" do
+        local dic = e.draw_indirect_cull
+        destroy_handle(dic.handle)
+        destroy_handle(dic.count_handle)
+        dic.handle, dic.count_handle = nil, nil
+    end
+end
@@ -7,5 +7,6 @@ function ido.init()
         idb_handle  = 0xffffffff,
         itb_handle  = 0xffffffff,
         draw_num    = 0,
+        count_handle= 0xffffffff,
     }
 end
@@ -23,6 +23,7 @@ lm:lua_src "render_core" {
         "render/hash.cpp",
         "render/queue.cpp",
         "render/mesh.cpp",
+        "render/tileculling.c",
     },
 }
 
@@ -36,6 +37,7 @@ lm:lua_src "render" {
     },
     sources = {
         "cull/cull.cpp",
+        "cull/bvh.cpp",
     },
     objdeps = "compile_ecs",
     deps = {
@@ -15,9 +15,29 @@ local function tomi(e, midx)
 	return fm[midx]
 end
 
+--the instanced variant of fm[midx] draws the objects merged with it, so it keeps the same patches and state.
+--render.cpp doesn't merge the objects when they differ
+local function instance_mi(e, midx)
+	local fm = e.filter_material
+	return fm[queuemgr.instance_of_material_index(midx or DEFAULT_MATERIAL_IDX)]
+end
+
 function imaterial.set_property(e, who, what, midx)
 	local mi = tomi(e, midx)
 	mi[who] = what
+	local imi = instance_mi(e, midx)
+	if imi then
+		imi[who] = what
+	end
+end
+
+function imaterial.sync_instance_state(fm, midx)
+	local imi = fm[queuemgr.instance_of_material_index(midx)]
+	if imi then
+		local mi = fm[midx]
+		imi:set_state(mi:get_state())
+		imi:set_stencil(mi:get_stencil())
+	end
 end
 
 assert(RM.system_attrib_update == nil, "'system_attrib_update' should not ready")
@@ -7,6 +7,8 @@ local m = {}
 local QUEUE_MATERIALS = {}
 
 local DEFAULT_MATERIAL_IDX<const> = 0
+--same as RENDER_MATERIAL_INSTANCE_OFFSET in render_material.h
+local INSTANCE_MATERIAL_OFFSET<const> = 32
 
 function m.default_material_index()
 	return DEFAULT_MATERIAL_IDX
@@ -16,6 +18,15 @@ function m.material_index(queue_name)
 	return QUEUE_MATERIALS[queue_name]
 end
 
+--material index of the instanced(draw indirect) variant, used by render.cpp to merge objects sharing mesh and material
+function m.instance_material_index(queue_name)
+	return QUEUE_MATERIALS[queue_name] + INSTANCE_MATERIAL_OFFSET
+end
+
+function m.instance_of_material_index(midx)
+	return midx + INSTANCE_MATERIAL_OFFSET
+end
+
 local QUEUE_INDICES, QUEUE_MASKS = {}, {}
 do
 	local NEXT_QUEUE_IDX = 0
@@ -44,8 +55,8 @@ do
 		local _ = QUEUE_MATERIALS[qn] == nil or error (qn .. " material index already register")
 
 		midx = midx or DEFAULT_MATERIAL_IDX
-		if midx >= 64 then
-			error(("Max material index is 64, %d is provided"):format(midx))
+		if midx >= INSTANCE_MATERIAL_OFFSET then
+			error(("Max material index is %d, %d is provided"):format(INSTANCE_MATERIAL_OFFSET, midx))
 		end
 		QUEUE_MATERIALS[qn] = midx
 		return qidx
@@ -14,6 +14,10 @@ struct buffer_node {
     bool isvalid() const {
         return handle != 0xffffffff;
     }
+
+    bool operator==(const buffer_node &rhs) const {
+        return handle == rhs.handle && start == rhs.start && num == rhs.num;
+    }
 };
 
 enum BufferType : uint8_t {
@@ -30,6 +34,29 @@ struct mesh_node {
             b.clear();
         }
     }
+
+    // every entity allocates its own mesh node, the entities of the same mesh resource have the same buffers
+    bool same_buffers(const mesh_node &rhs) const {
+        for (int i=0; i<BT_count; ++i){
+            if (!(buffers[i] == rhs.buffers[i]))
+                return false;
+        }
+        return true;
+    }
+
+    // a strict order of the buffers, the nodes with the same buffers are adjacent after sorting
+    bool buffers_less(const mesh_node &rhs) const {
+        for (int i=0; i<BT_count; ++i){
+            const auto &l = buffers[i], &r = rhs.buffers[i];
+            if (l.handle != r.handle)
+                return l.handle < r.handle;
+            if (l.start != r.start)
+                return l.start < r.start;
+            if (l.num != r.num)
+                return l.num < r.num;
+        }
+        return false;
+    }
 };
 
 struct mesh_container;
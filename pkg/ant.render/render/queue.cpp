@@ -42,6 +42,12 @@ struct queue_node {
         }
     }
 
+    void update(const uint64_t *clearmasks, const uint64_t *setmasks){
+        for(uint8_t ii=0; ii<NUM_MASK; ++ii){
+            masks[ii] = (masks[ii] & ~clearmasks[ii]) | setmasks[ii];
+        }
+    }
+
     void set(queue_node &n, bool value) {
         if (value){
             for(uint8_t ii=0; ii<NUM_MASK; ++ii){
@@ -74,6 +80,10 @@ struct queue_container : public node_container<queue_node>{
     inline void set(int Qidx, int nextQidx, bool value) {
         nodes[Qidx].set(nodes[nextQidx], value);
     }
+
+    inline void update(int Qidx, const uint64_t *clearmasks, const uint64_t *setmasks) {
+        nodes[Qidx].update(clearmasks, setmasks);
+    }
 };
 
 struct queue_container* queue_create(){
@@ -100,6 +110,10 @@ void queue_fetch(struct queue_container* Q, int Qidx, uint64_t *outmasks){
     return Q->fetch(Qidx, outmasks);
 }
 
+void queue_update_masks(struct queue_container* Q, int Qidx, const uint64_t *clearmasks, const uint64_t *setmasks){
+    return Q->update(Qidx, clearmasks, setmasks);
+}
+
 int
 queue_dealloc(struct queue_container* Q, int Qidx){
     if (Q->isvalid(Qidx)){
@@ -12,4 +12,6 @@ int queue_dealloc(struct queue_container* Q, int Qidx);
 bool queue_check(struct queue_container* Q, int Qidx, uint8_t queue);
 void queue_set(struct queue_container* Q, int Qidx, uint8_t queue, bool value);
 void queue_set_by_index(struct queue_container *Q, int Qidx, int nextQidx, bool value);
-void queue_fetch(struct queue_container* Q, int Qidx, uint64_t *outmasks);
\ No newline at end of file
+void queue_fetch(struct queue_container* Q, int Qidx, uint64_t *outmasks);
+// masks = (masks & ~clearmasks) | setmasks
+void queue_update_masks(struct queue_container* Q, int Qidx, const uint64_t *clearmasks, const uint64_t *setmasks);
\ No newline at end of file
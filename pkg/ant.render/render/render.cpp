@@ -11,8 +11,8 @@ extern "C"{
 }
 
 #include "queue.h"
-#include "hash.h"
 #include "mesh.h"
+#include "worker.h"
 
 #include "lua.hpp"
 #include "luabgfx.h"
@@ -26,69 +26,56 @@ extern "C"{
 #include <memory.h>
 #include <string.h>
 #include <algorithm>
+#include <atomic>
 struct transform {
 	uint32_t tid;
 	uint32_t stride;
 };
 
-//using obj_transforms = std::unordered_map<uint64_t, transform>;
-struct obj_transforms {
-	static constexpr uint16_t MAX_CACHE = (16384-1);
-	struct key {
-		static uint16_t hash_idx(const component::render_object *ro, math_t m) {
-			return (uint16_t)((hash64((uint64_t)ro^m.idx)) % obj_transforms::MAX_CACHE);
-		}
-
-		const component::render_object * ro;
-		math_t m;
-		uint16_t hidx;
-	};
-
-	key			keys[MAX_CACHE] = {{0}};
-	transform	values[MAX_CACHE] = {{0}};
-
-	bool check(const key& k, transform &v) const {
-		const key& r = keys[k.hidx];
-		if (r.ro == k.ro && r.m.idx == k.m.idx){
-			v = values[k.hidx];
-			return true;
-		}
-		return false;
-	}
+// transforms of this frame indexed by a dense slot, slots are assigned in collect. A slot is uploaded once by the main thread
+// encoder, and the transform cache index is reused by every queue and every encoder of the frame
+struct frame_transforms {
+	static constexpr uint32_t INVALID_TID = UINT32_MAX;
 
-	void add(const key& k, const transform &v){
-		values[k.hidx] = v;
-		keys[k.hidx] = k;
+	uint32_t alloc(uint32_t n){
+		const uint32_t base = (uint32_t)slots.size();
+		slots.resize(base + n, transform{INVALID_TID, 0});
+		return base;
 	}
 
 	void clear(){
-		memset(keys, 0, sizeof(keys));
+		slots.clear();
+		uploads = reuses = 0;
 	}
+
+	std::vector<transform> slots;
+	uint32_t uploads = 0;
+	uint32_t reuses = 0;
 };
 
 static inline transform
-update_transform(struct ecs_world* w, const component::render_object *ro, const math_t& hwm, obj_transforms &trans){
-	auto key = obj_transforms::key{ro, hwm, obj_transforms::key::hash_idx(ro, hwm)};
-	transform t;
-	if (!trans.check(key, t)){
-		const math_t wm = ro->worldmat;
-		assert(math_valid(w->math3d->M, wm) && !math_isnull(wm) && "Invalid world mat");
-		const int num = math_size(w->math3d->M, wm);
-
-		bgfx_transform_t bt;
-		t.tid = w->bgfx->encoder_alloc_transform(w->holder->encoder, &bt, (uint16_t)num);
-		t.stride = num;
-		if(math_isnull(hwm)){
-			const float * v = math_value(w->math3d->M, wm);
-			memcpy(bt.data, v, sizeof(float)*16*num);
-		} else{
-			math_t r = math_ref(w->math3d->M, bt.data, MATH_TYPE_MAT, t.stride);
-			math3d_mul_matrix_array(w->math3d->M, hwm, wm, r);
-		}
-
-		trans.add(key, t);
+update_transform(struct ecs_world* w, const component::render_object *ro, const math_t& hwm, frame_transforms &trans, uint32_t slot){
+	transform &t = trans.slots[slot];
+	if (t.tid != frame_transforms::INVALID_TID){
+		++trans.reuses;
+		return t;
 	}
 
+	const math_t wm = ro->worldmat;
+	assert(math_valid(w->math3d->M, wm) && !math_isnull(wm) && "Invalid world mat");
+	const int num = math_size(w->math3d->M, wm);
+
+	bgfx_transform_t bt;
+	t.tid = w->bgfx->encoder_alloc_transform(w->holder->encoder, &bt, (uint16_t)num);
+	t.stride = num;
+	if(math_isnull(hwm)){
+		const float * v = math_value(w->math3d->M, wm);
+		memcpy(bt.data, v, sizeof(float)*16*num);
+	} else{
+		math_t r = math_ref(w->math3d->M, bt.data, MATH_TYPE_MAT, t.stride);
+		math3d_mul_matrix_array(w->math3d->M, hwm, wm, r);
+	}
+	++trans.uploads;
 	return t;
 }
 
@@ -163,8 +150,8 @@ submit_efk_obj(lua_State* L, struct ecs_world* w, const component::efk_object *e
 }
 
 static inline struct material_instance*
-find_submit_material(lua_State *L, struct ecs_world *w, const component::render_args *ra, uint32_t rmidx) {
-	auto mi = get_material(w->R, rmidx, ra->material_index);
+find_submit_material(lua_State *L, struct ecs_world *w, uint32_t material_index, uint32_t rmidx) {
+	auto mi = get_material(w->R, rmidx, material_index);
 	
 	if (nullptr == mi)
 		return nullptr;
@@ -187,49 +174,222 @@ find_submit_mesh(struct ecs_world*w, const component::render_object *ro, const c
 	return ib.isvalid() ? (ib.num > 0) : true;
 }
 
+// draw_item: one entry of a per-queue draw list, sorted by state to skip redundant binds
+struct draw_item {
+	const struct material_instance *mi;
+	const void*				source;		// material which mi created from
+	bgfx_program_handle_t	prog;
+	uint64_t				state;		// render state of mi, it's a part of bgfx sort key
+	uint32_t				oidx;
+	uint16_t				instance_num;	// > 1: the first item of an instanced batch, next (instance_num-1) items are merged into it
+	uint32_t				layer;
+	const struct mesh_node*	mesh;
+	bool					indirect;
+
+	// filled by obj_submitter::prepare()
+	const struct material_instance *imi;	// instance material of a batch
+	transform				t;
+	uint32_t				idb;			// instance data buffer index of a batch
+
+	// bgfx keeps the submit order for draws with the same view/program/depth, so grouping by render_layer and program
+	// first keeps every run of the same material contiguous after bgfx sorts the view
+	bool operator<(const draw_item &rhs) const {
+		if (layer != rhs.layer)
+			return layer < rhs.layer;
+		if (prog.idx != rhs.prog.idx)
+			return prog.idx < rhs.prog.idx;
+		if (state != rhs.state)
+			return state < rhs.state;
+		if (source != rhs.source)
+			return source < rhs.source;
+		// compare the buffers, not the node: the entities of the same mesh have their own nodes
+		return mesh != rhs.mesh && mesh->buffers_less(*rhs.mesh);
+	}
+
+	bool isolated() const {
+		return indirect || instance_num > 1;
+	}
+};
+
+static inline draw_item
+make_draw_item(lua_State *L, struct ecs_world *w, const struct material_instance *mi, uint32_t oidx, const component::render_object *ro, bool indirect){
+	draw_item d;
+	d.mi			= mi;
+	d.source		= material_instance_source(mi);
+	d.prog			= material_prog(L, mi);
+	d.state			= material_instance_state(mi);
+	d.oidx			= oidx;
+	d.instance_num	= 1;
+	d.layer			= ro->render_layer;
+	d.mesh			= mesh_fetch(w->MESH, ro->mesh_idx);
+	d.indirect		= indirect;
+	d.imi			= nullptr;
+	d.t				= transform{0, 0};
+	d.idb			= 0;
+	return d;
+}
+
+using draw_list = std::vector<draw_item>;
+
+// what is still bound in the encoder from the previous draw
+struct draw_state {
+	const struct material_instance *mi = nullptr;
+	const struct mesh_node *mesh = nullptr;
+	// the sort key of the previous draw, the uniforms in cache are valid in the same sort key only
+	bgfx_program_handle_t prog = BGFX_INVALID_HANDLE;
+	uint32_t layer = 0;
+	uint64_t state = 0;
+	struct material_apply_cache *cache = nullptr;
+};
+
+static inline bool
+same_mesh(const struct mesh_node *lhs, const struct mesh_node *rhs){
+	return lhs == rhs || (lhs && rhs && lhs->same_buffers(*rhs));
+}
+
+static inline uint8_t
+draw_discard_flags(const draw_item &d, const draw_item *next){
+	if (nullptr == next || d.isolated() || next->isolated())
+		return BGFX_DISCARD_ALL;
+
+	uint8_t flags = BGFX_DISCARD_TRANSFORM | BGFX_DISCARD_INSTANCE_DATA;
+	// instances of the same material share most of their bindings, keep them and only apply the difference
+	if (!material_instance_equal(next->mi, d.mi) && next->source != d.source)
+		flags |= BGFX_DISCARD_STATE | BGFX_DISCARD_BINDINGS;
+	if (!same_mesh(next->mesh, d.mesh))
+		flags |= BGFX_DISCARD_VERTEX_STREAMS | BGFX_DISCARD_INDEX_BUFFER;
+	return flags;
+}
+
+// call it before the draw d is applied
+static inline void
+begin_draw_state(draw_state &ds, const draw_item &d){
+	if (ds.prog.idx != d.prog.idx || ds.layer != d.layer || ds.state != d.state){
+		ds.prog = d.prog;
+		ds.layer = d.layer;
+		ds.state = d.state;
+		// bgfx may reorder the draws of different sort keys, apply the material again with the uniforms
+		ds.mi = nullptr;
+		if (ds.cache)
+			material_apply_cache_reset_uniforms(ds.cache);
+	}
+}
+
 static inline void
-draw_indirect_obj(lua_State *L, struct ecs_world *w, bgfx_view_id_t viewid,
+update_draw_state(draw_state &ds, const draw_item &d, uint8_t discardflags){
+	if (discardflags & (BGFX_DISCARD_STATE | BGFX_DISCARD_BINDINGS))
+		ds.mi = nullptr;
+	else
+		ds.mi = d.mi;
+
+	if (discardflags & (BGFX_DISCARD_VERTEX_STREAMS | BGFX_DISCARD_INDEX_BUFFER))
+		ds.mesh = nullptr;
+	else
+		ds.mesh = d.mesh;
+
+	if (ds.cache)
+		material_apply_cache_discard(ds.cache, discardflags);
+}
+
+static inline const char*
+apply_material(struct ecs_world *w, const struct material_instance *mi, const draw_state *ds){
+	return material_instance_apply_cached(mi, w, ds ? ds->cache : nullptr);
+}
+
+static inline const char*
+bind_obj(struct ecs_world *w, bgfx_view_id_t viewid,
+	const component::render_object *ro, const struct material_instance *mi, const draw_state *ds){
+	if (nullptr == ds || !material_instance_equal(ds->mi, mi)){
+		const char* err = apply_material(w, mi, ds);
+		if (err)
+			return err;
+	}
+	if (nullptr == ds || !same_mesh(ds->mesh, mesh_fetch(w->MESH, ro->mesh_idx)))
+		mesh_submit(w, ro, viewid);
+	return nullptr;
+}
+
+// submit_*_obj: the transform and instance data are prepared in main thread, these functions only touch the encoder of w,
+// so they can run in worker threads
+static inline const char*
+submit_indirect_obj(struct ecs_world *w, bgfx_view_id_t viewid,
 	const component::render_object *ro, const component::indirect_object* io,
-	const struct material_instance *mi, uint32_t material_idx, bgfx_program_handle_t prog,
-	uint8_t discardflags, obj_transforms &trans){
+	const draw_item &d, uint8_t discardflags, const draw_state &ds){
 	if (io->draw_num == 0){
-		return ;
+		return nullptr;
 	}
-	apply_material_instance(L, mi, w);
+	const char* err = apply_material(w, d.mi, &ds);
+	if (err)
+		return err;
 	mesh_submit(w, ro, viewid);
 
 	const auto itb = bgfx_dynamic_vertex_buffer_handle_t{(uint16_t)io->itb_handle};
 	assert(BGFX_HANDLE_IS_VALID(itb));
 	w->bgfx->encoder_set_instance_data_from_dynamic_vertex_buffer(w->holder->encoder, itb, 0, io->draw_num);
 
-	transform t = update_transform(w, ro, MATH_NULL, trans);
-	w->bgfx->encoder_set_transform_cached(w->holder->encoder, t.tid, t.stride);
+	w->bgfx->encoder_set_transform_cached(w->holder->encoder, d.t.tid, d.t.stride);
 
 	const auto idb = bgfx_indirect_buffer_handle_t{(uint16_t)io->idb_handle};
 	assert(BGFX_HANDLE_IS_VALID(idb));
-	w->bgfx->encoder_submit_indirect(w->holder->encoder, viewid, prog, idb, 0, io->draw_num, ro->render_layer, discardflags);
+	const auto cb = bgfx_index_buffer_handle_t{(uint16_t)io->count_handle};
+	if (BGFX_HANDLE_IS_VALID(cb)){
+		// draw count is written by gpu culling
+		w->bgfx->encoder_submit_indirect_count(w->holder->encoder, viewid, d.prog, idb, 0, cb, 0, (uint16_t)io->draw_num, ro->render_layer, discardflags);
+	} else {
+		w->bgfx->encoder_submit_indirect(w->holder->encoder, viewid, d.prog, idb, 0, io->draw_num, ro->render_layer, discardflags);
+	}
+	return nullptr;
+}
+
+static inline const char*
+submit_instanced_obj(struct ecs_world *w, bgfx_view_id_t viewid,
+	const component::render_object *ro, const draw_item &d, const bgfx_instance_data_buffer_t &idb, uint8_t discardflags, const draw_state &ds){
+	const char* err = apply_material(w, d.imi, &ds);
+	if (err)
+		return err;
+	// instance material is shared by the batch, keep the state of queue material
+	apply_material_instance_state(d.mi, w);
+	mesh_submit(w, ro, viewid);
+	w->bgfx->encoder_set_instance_data_buffer(w->holder->encoder, &idb, 0, d.instance_num);
+	// no transform set: u_model is the identity matrix in bgfx matrix cache slot 0
+	w->bgfx->encoder_submit(w->holder->encoder, viewid, d.prog, ro->render_layer, discardflags);
+	return nullptr;
+}
+
+static inline const char*
+submit_simple_obj(struct ecs_world *w, bgfx_view_id_t viewid,
+	const component::render_object *ro, const draw_item &d, uint8_t discardflags, const draw_state &ds){
+	const char* err = bind_obj(w, viewid, ro, d.mi, &ds);
+	if (err)
+		return err;
+	w->bgfx->encoder_set_transform_cached(w->holder->encoder, d.t.tid, d.t.stride);
+	w->bgfx->encoder_submit(w->holder->encoder, viewid, d.prog, ro->render_layer, discardflags);
+	return nullptr;
 }
 
 static inline void
 draw_obj(lua_State *L, struct ecs_world *w, bgfx_view_id_t viewid,
 	const component::render_object *ro, 
 	const struct material_instance *mi, uint32_t material_idx, bgfx_program_handle_t prog,
-	const matrix_array *mats, uint8_t discardflags,
-	obj_transforms &trans){
+	const matrix_array *mats, uint32_t tslot, uint8_t discardflags,
+	frame_transforms &trans, const draw_state *ds = nullptr){
 
-	apply_material_instance(L, mi, w);
-	mesh_submit(w, ro, viewid);
+	const char* err = bind_obj(w, viewid, ro, mi, ds);
+	if (err)
+		luaL_error(L, "Apply error : %s", err);
 	
+	// slots [tslot, tslot+mats->size()) are the transforms of ro with every group matrix
 	transform t;
 	if (mats){
-		for (int i=0; i<(int)mats->size()-1; ++i) {
-			t = update_transform(w, ro, (*mats)[i], trans);
+		const uint32_t last = (uint32_t)mats->size()-1;
+		for (uint32_t i=0; i<last; ++i) {
+			t = update_transform(w, ro, (*mats)[i], trans, tslot+i);
 			w->bgfx->encoder_set_transform_cached(w->holder->encoder, t.tid, t.stride);
 			w->bgfx->encoder_submit(w->holder->encoder, viewid, prog, ro->render_layer, BGFX_DISCARD_TRANSFORM);
 		}
-		t = update_transform(w, ro, mats->back(), trans);
+		t = update_transform(w, ro, mats->back(), trans, tslot+last);
 	} else {
-		t = update_transform(w, ro, MATH_NULL, trans);
+		t = update_transform(w, ro, MATH_NULL, trans, tslot);
 	}
 
 	w->bgfx->encoder_set_transform_cached(w->holder->encoder, t.tid, t.stride);
@@ -239,7 +399,12 @@ draw_obj(lua_State *L, struct ecs_world *w, bgfx_view_id_t viewid,
 //using group_queues = std::array<matrix_array, MAX_VISIBLE_QUEUE>;
 using group_collection = std::unordered_map<int, matrix_array>;
 
-static constexpr uint16_t MAX_SUBMIT_NUM = 4096;
+// at least MIN_INSTANCE_NUM objects sharing mesh and material are merged into one instanced draw
+static constexpr uint16_t MIN_INSTANCE_NUM = 2;
+static constexpr uint16_t MAX_INSTANCE_NUM = 1024;
+static constexpr uint16_t INSTANCE_STRIDE = sizeof(float) * 4 * 3;
+// bgfx default BGFX_CONFIG_MAX_ENCODERS is 8, keep some for lua side encoder and other threads
+static constexpr uint32_t MAX_SUBMIT_WORKERS = 6;
 enum queue_type : uint8_t{
 	main_queue = 0,
 	pre_depth_queue,
@@ -262,6 +427,10 @@ struct submit_context {
 	int Qidx = -1;
 	uint64_t queuemasks[MAX_VISIBLE_QUEUE/64];
 
+	// uniform/sampler/image/buffer sets of this frame, queues are submitted in worker threads
+	std::atomic<uint32_t> attrib_issued{0};
+	std::atomic<uint32_t> attrib_skipped{0};
+
 	void init_render_args(){
 		ra_count = 0;
 		if (Qidx == -1){
@@ -279,63 +448,233 @@ struct submit_context {
 	void init(lua_State *L_, struct ecs_world *w_){
 		L = L_;
 		w = w_;
+		attrib_issued.store(0, std::memory_order_relaxed);
+		attrib_skipped.store(0, std::memory_order_relaxed);
 		init_render_args();
 	}
+
+	void add_apply_stat(const struct material_apply_cache &c){
+		attrib_issued.fetch_add(c.issued, std::memory_order_relaxed);
+		attrib_skipped.fetch_add(c.skipped, std::memory_order_relaxed);
+	}
+};
+
+// per-frame object list, clear() keeps the storage, so it stops allocating once it reaches the largest frame
+template<typename T>
+struct frame_list {
+	void push(const T &v){
+		items.push_back(v);
+	}
+
+	T& back() {
+		assert(!items.empty());
+		return items.back();
+	}
+
+	const T& operator[](uint32_t idx) const {
+		return items[idx];
+	}
+
+	uint32_t size() const {
+		return (uint32_t)items.size();
+	}
+
+	void clear(){
+		if (size() > high_water)
+			high_water = size();
+		items.clear();
+	}
+
+	uint32_t high_water = 0;
+private:
+	std::vector<T> items;
 };
 
 struct obj_submitter {
 	struct obj {
 		const component::render_object *ro;
 		const component::indirect_object *io;
+		uint32_t tslot;
 	#ifdef RENDER_DEBUG
 		component::eid eid;
 	#endif //RENDER_DEBUG
 	};
 
-	void add(const component::render_object *ro, const component::indirect_object *io){
-		assert(num < MAX_SUBMIT_NUM);
-		objects[num++] = obj_submitter::obj{ro, io};
+	void add(const component::render_object *ro, const component::indirect_object *io, frame_transforms &trans){
+		objects.push(obj_submitter::obj{ro, io, trans.alloc(1)});
 	}
 
 	#ifdef RENDER_DEBUG
 	void append_eid(component::eid eid){
-		assert(num > 0);
-		objects[num-1].eid = eid;
+		objects.back().eid = eid;
 	}
 	#endif //RENDER_DEBUG
 
-	//TODO
-	void sort(){}
-
-	void submit(obj_transforms &trans){
-		
+	void sort(){
 		for (uint8_t ii=0; ii<ctx->ra_count; ++ii){
 			auto ra = ctx->ra[ii];
-			for (uint16_t is=0; is<num; ++is){
+			auto &q = submit_queues[ii];
+			q.clear();
+			for (uint32_t is=0; is<objects.size(); ++is){
 				const obj& so = objects[is];
 				if (!obj_visible(ctx->w->Q, *so.ro, ra->queue_index))
 					continue;
 
-				auto mi = find_submit_material(ctx->L, ctx->w, ra, so.ro->rm_idx);
+				auto mi = find_submit_material(ctx->L, ctx->w, ra->material_index, so.ro->rm_idx);
 				if (!mi)
 					continue;
 
-				const auto prog = material_prog(ctx->L, mi);
-				if (!BGFX_HANDLE_IS_VALID(prog))
-					continue;
+				q.push_back(make_draw_item(ctx->L, ctx->w, mi, is, so.ro, so.io != nullptr));
+			}
+			std::stable_sort(q.begin(), q.end());
+			batch(ra, q);
+		}
+	}
+
+	// can objects[d.oidx] be drawn by the instance material of this queue with objects[first.oidx]
+	bool can_instance(const draw_item &first, const draw_item &d) const {
+		return !d.indirect &&
+			d.layer == first.layer &&
+			same_mesh(d.mesh, first.mesh) &&
+			material_instance_equal(d.mi, first.mi) &&
+			math_size(ctx->w->math3d->M, objects[d.oidx].ro->worldmat) == 1;
+	}
+
+	// merge runs of objects sharing mesh and material into one instanced draw
+	void batch(const component::render_args *ra, draw_list &q){
+		const uint32_t imidx = ra->material_index + RENDER_MATERIAL_INSTANCE_OFFSET;
+		for (size_t id=0; id<q.size(); ){
+			draw_item &first = q[id];
+			size_t n = 1;
+			if (can_instance(first, first)){
+				while (id+n < q.size() && n < MAX_INSTANCE_NUM && can_instance(first, q[id+n]))
+					++n;
+			}
+
+			if (n >= MIN_INSTANCE_NUM){
+				auto imi = find_submit_material(ctx->L, ctx->w, imidx, objects[first.oidx].ro->rm_idx);
+				// imi draws every object of the batch, it must carry the patches and state of first.mi
+				if (imi && material_instance_same_patch(first.mi, imi)){
+					first.instance_num = (uint16_t)n;
+					first.imi = imi;
+					// queue is sorted, prog is only used for submit from now on
+					first.prog = material_prog(ctx->L, imi);
+				} else {
+					n = 1;
+				}
+			}
+			id += n;
+		}
+	}
+
+	// world matrices go to a transient instance data buffer as 3 rows of the matrix, same layout with hitch instance buffer
+	bool alloc_instance_buffer(draw_item &d, const draw_item *members){
+		auto w = ctx->w;
+		const uint32_t num = d.instance_num;
+		if (w->bgfx->get_avail_instance_data_buffer(num, INSTANCE_STRIDE) < num)
+			return false;
+
+		d.idb = (uint32_t)instance_buffers.size();
+		bgfx_instance_data_buffer_t &idb = instance_buffers.emplace_back();
+		w->bgfx->alloc_instance_data_buffer(&idb, num, INSTANCE_STRIDE);
+		float *data = (float*)idb.data;
+		for (uint32_t ii=0; ii<num; ++ii){
+			const float *m = math_value(w->math3d->M, objects[members[ii].oidx].ro->worldmat);
+			for (int r=0; r<3; ++r){
+				*data++ = m[r]; *data++ = m[4+r]; *data++ = m[8+r]; *data++ = m[12+r];
+			}
+		}
+		return true;
+	}
 
-				if (so.io){
-					draw_indirect_obj(ctx->L, ctx->w, ra->viewid, so.ro, so.io, mi, ra->material_index, prog, BGFX_DISCARD_ALL, trans);
+	// upload transforms and instance data in main thread: frame_transforms and math3d are not thread safe,
+	// the transform cache index is valid for every encoder in the frame
+	void prepare(frame_transforms &trans){
+		instance_buffers.clear();
+		instance_draws = instance_objects = 0;
+		for (uint8_t ii=0; ii<ctx->ra_count; ++ii){
+			auto &q = submit_queues[ii];
+			for (size_t id=0; id<q.size(); id += q[id].instance_num){
+				draw_item &d = q[id];
+				if (d.instance_num > 1 && !alloc_instance_buffer(d, &q[id])){
+					// transient buffer is full, draw the batch one by one
+					d.instance_num = 1;
+					d.prog = material_prog(ctx->L, d.mi);
+					d.imi = nullptr;
+				}
+				if (d.instance_num > 1){
+					++instance_draws;
+					instance_objects += d.instance_num;
 				} else {
-					draw_obj(ctx->L, ctx->w, ra->viewid, so.ro, mi, ra->material_index, prog, nullptr, BGFX_DISCARD_ALL, trans);
+					const obj& so = objects[d.oidx];
+					d.t = update_transform(ctx->w, so.ro, MATH_NULL, trans, so.tslot);
 				}
 			}
-			//ctx->w->bgfx->encoder_discard(w->holder->encoder, BGFX_DISCARD_ALL);
 		}
+	}
+
+	// submit one queue with the encoder in w->holder
+	const char* submit_queue(uint8_t ii, struct ecs_world *w) const {
+		auto ra = ctx->ra[ii];
+		const auto &q = submit_queues[ii];
+		struct material_apply_cache cache;
+		material_apply_cache_init(&cache);
+		draw_state ds;
+		ds.cache = &cache;
+		const char* err = nullptr;
+		for (size_t id=0; id<q.size() && nullptr == err; id += q[id].instance_num){
+			const draw_item &d = q[id];
+			const obj& so = objects[d.oidx];
+			const size_t nextid = id + d.instance_num;
+			const uint8_t discardflags = draw_discard_flags(d, nextid < q.size() ? &q[nextid] : nullptr);
+			begin_draw_state(ds, d);
+			if (d.instance_num > 1){
+				err = submit_instanced_obj(w, ra->viewid, so.ro, d, instance_buffers[d.idb], discardflags, ds);
+			} else if (d.indirect){
+				err = submit_indirect_obj(w, ra->viewid, so.ro, so.io, d, discardflags, ds);
+			} else {
+				err = submit_simple_obj(w, ra->viewid, so.ro, d, discardflags, ds);
+			}
+			update_draw_state(ds, d, discardflags);
+		}
+		ctx->add_apply_stat(cache);
+		return err;
+	}
 
+	// queues are independent, each worker thread submits its queues with its own bgfx encoder
+	void submit(worker_pool &workers){
+		auto w = ctx->w;
+		const char* errs[MAX_VISIBLE_QUEUE] = {nullptr};
+		bool submitted[MAX_VISIBLE_QUEUE] = {false};
+
+		workers.run(ctx->ra_count, [&](uint32_t ii, uint32_t worker){
+			if (worker == 0){
+				errs[ii] = submit_queue((uint8_t)ii, w);
+				submitted[ii] = true;
+				return;
+			}
+			auto encoder = w->bgfx->encoder_begin(true);
+			if (nullptr == encoder)
+				return;	// no free encoder, submit it in main thread later
+
+			// material and mesh code reach the encoder by w->holder
+			struct bgfx_encoder_holder holder = {encoder};
+			struct ecs_world jw = *w;
+			jw.holder = &holder;
+			errs[ii] = submit_queue((uint8_t)ii, &jw);
+			submitted[ii] = true;
+			w->bgfx->encoder_end(encoder);
+		});
+
+		for (uint8_t ii=0; ii<ctx->ra_count; ++ii){
+			if (!submitted[ii])
+				errs[ii] = submit_queue(ii, w);
+			if (errs[ii])
+				luaL_error(ctx->L, "Apply error : %s", errs[ii]);
+		}
 	}
 
-	void collect(){
+	void collect(frame_transforms &trans){
 		// draw simple objects
 		for (auto& e : ecs::select<component::render_object_visible, component::visible, component::render_object>(ctx->w->ecs)) {
 			const component::indirect_object* io = e.component<component::indirect_object>();
@@ -344,7 +683,7 @@ struct obj_submitter {
 			if (!find_submit_mesh(ctx->w, ro, io))
 				continue;
 
-			add(ro, io);
+			add(ro, io, trans);
 		#ifdef RENDER_DEBUG
 			append_eid(e.component<component::eid>());
 		#endif //RENDER_DEBUG
@@ -353,15 +692,18 @@ struct obj_submitter {
 
 	void clear(){
 		ctx = nullptr;
-		num = 0;
+		objects.clear();
 	}
 
 	submit_context *ctx = nullptr;
-	obj objects[MAX_SUBMIT_NUM];
-	uint16_t num = 0;
-
-	//TODO
-	//uint16_t submit_queues[MAX_VISIBLE_QUEUE][MAX_SUBMIT_NUM];
+	frame_list<obj> objects;
+
+	// indexed by render_args order in submit_context, keep capacity between frames
+	draw_list submit_queues[MAX_VISIBLE_QUEUE];
+	std::vector<bgfx_instance_data_buffer_t> instance_buffers;
+	// instanced draws of this frame and the objects merged into them
+	uint32_t instance_draws = 0;
+	uint32_t instance_objects = 0;
 };
 
 struct hitch_submitter {
@@ -369,6 +711,7 @@ struct hitch_submitter {
 		struct obj {
 			const component::render_object *ro;
 			const matrix_array* g;
+			uint32_t tslot;
 
 		#ifdef RENDER_DEBUG
 			component::eid eid;
@@ -377,38 +720,50 @@ struct hitch_submitter {
 
 		#ifdef RENDER_DEBUG
 		void append_eid(component::eid eid){
-			assert(num > 0);
-			objects[num-1].eid = eid;
+			objects.back().eid = eid;
 		}
 		#endif //RENDER_DEBUG
 
-		void submit(submit_context *ctx, const component::render_args* ra, obj_transforms &trans) {
-			for (uint16_t ih=0; ih<num; ++ih){
+		void sort(submit_context *ctx, const component::render_args* ra, draw_list &q) const {
+			q.clear();
+			for (uint32_t ih=0; ih<objects.size(); ++ih){
 				const obj& h = objects[ih];
 				if (h.g->empty() || !queue_check(ctx->w->Q, h.ro->visible_idx, ra->queue_index))
 					continue;
 
-				auto mi = find_submit_material(ctx->L, ctx->w, ra, h.ro->rm_idx);
+				auto mi = find_submit_material(ctx->L, ctx->w, ra->material_index, h.ro->rm_idx);
 				if (mi){
-					const auto prog = material_prog(ctx->L, mi);
-					if (BGFX_HANDLE_IS_VALID(prog)){
-						draw_obj(ctx->L, ctx->w, ra->viewid, h.ro, mi, ra->material_index, prog, h.g, BGFX_DISCARD_ALL, trans);
-					}
+					q.push_back(make_draw_item(ctx->L, ctx->w, mi, ih, h.ro, false));
 				}
 			}
+			std::stable_sort(q.begin(), q.end());
 		}
 
-		void add(const component::render_object *ro, const matrix_array* g){
-			assert(num < MAX_SUBMIT_NUM);
-			objects[num++] = obj{ro, g};
+		void submit(submit_context *ctx, const component::render_args* ra, const draw_list &q, frame_transforms &trans) {
+			struct material_apply_cache cache;
+			material_apply_cache_init(&cache);
+			draw_state ds;
+			ds.cache = &cache;
+			for (size_t id=0; id<q.size(); ++id){
+				const draw_item &d = q[id];
+				const obj& h = objects[d.oidx];
+				const uint8_t discardflags = draw_discard_flags(d, id+1 < q.size() ? &q[id+1] : nullptr);
+				begin_draw_state(ds, d);
+				draw_obj(ctx->L, ctx->w, ra->viewid, h.ro, d.mi, ra->material_index, d.prog, h.g, h.tslot, discardflags, trans, &ds);
+				update_draw_state(ds, d, discardflags);
+			}
+			ctx->add_apply_stat(cache);
+		}
+
+		void add(const component::render_object *ro, const matrix_array* g, frame_transforms &trans){
+			objects.push(obj{ro, g, trans.alloc((uint32_t)g->size())});
 		}
 
 		void clear() {
-			num = 0;
+			objects.clear();
 		}
 
-		obj objects[MAX_SUBMIT_NUM];
-		uint16_t num = 0;
+		frame_list<obj> objects;
 	};
 
 	struct hitch_efks {
@@ -422,19 +777,17 @@ struct hitch_submitter {
 
 		#ifdef RENDER_DEBUG
 		void append_eid(component::eid eid){
-			assert(num > 0);
-			objects[num-1].eid = eid;
+			objects.back().eid = eid;
 		}
 		#endif //RENDER_DEBUG
 
 		void add(const component::efk_object *eo, const matrix_array* g){
-			assert(num < MAX_SUBMIT_NUM);
-			objects[num++] = obj{eo, g};
+			objects.push(obj{eo, g});
 		}
 
 		void submit(const submit_context *ctx) {
 			ecs::clear_type<component::efk_hitch>(ctx->w->ecs);
-			for (uint16_t ie=0; ie<num; ++ie){
+			for (uint32_t ie=0; ie<objects.size(); ++ie){
 				const obj& o = objects[ie];
 				if (!o.g->empty()){
 					submit_efk_obj(ctx->L, ctx->w, o.eo, *(o.g));
@@ -443,19 +796,21 @@ struct hitch_submitter {
 		}
 
 		void clear() {
-			num = 0;
+			objects.clear();
 		}
 
-		obj objects[MAX_SUBMIT_NUM];
-		uint16_t num = 0;
+		frame_list<obj> objects;
 	};
 
-	//TODO:
-	void sort(){}
+	void sort(){
+		for (uint8_t ii=0; ii<ctx->ra_count; ++ii){
+			objs.sort(ctx, ctx->ra[ii], submit_queues[ii]);
+		}
+	}
 
-	void submit(obj_transforms &trans) {
+	void submit(frame_transforms &trans) {
 		for (uint8_t ii=0; ii<ctx->ra_count; ++ii){
-			objs.submit(ctx, ctx->ra[ii], trans);
+			objs.submit(ctx, ctx->ra[ii], submit_queues[ii], trans);
 		}
 	}
 
@@ -495,7 +850,7 @@ struct hitch_submitter {
 		return false;
 	}
 
-	void collect(){
+	void collect(frame_transforms &trans){
 		collect_groups();
 		// draw object which hanging on hitch node
 		uint8_t efk_qidx = 0;
@@ -514,7 +869,7 @@ struct hitch_submitter {
 					auto eid = e.component<component::eid>();
 				#endif //RENDER_DEBUG
 					if (ro && find_submit_mesh(ctx->w, ro, nullptr)){
-						objs.add(ro, &g);
+						objs.add(ro, &g, trans);
 						#ifdef RENDER_DEBUG
 						objs.append_eid(eid);
 						#endif //RENDER_DEBUG
@@ -552,11 +907,26 @@ struct hitch_submitter {
 	hitch_objs objs;
 	hitch_efks efks;
 
-	//uint16_t submit_queues[MAX_VISIBLE_QUEUE][MAX_SUBMIT_NUM];
+	draw_list submit_queues[MAX_VISIBLE_QUEUE];
 };
 
+// the max object count, the transform uploads/reuses and the material attrib sets of last frame,
+// submit_stat is called by other service without world, so keep it global
+static struct {
+	std::atomic<uint32_t> simple{0};
+	std::atomic<uint32_t> hitch{0};
+	std::atomic<uint32_t> efk_hitch{0};
+	std::atomic<uint32_t> transform_upload{0};
+	std::atomic<uint32_t> transform_reuse{0};
+	std::atomic<uint32_t> attrib_issued{0};
+	std::atomic<uint32_t> attrib_skipped{0};
+	std::atomic<uint32_t> instance_draw{0};
+	std::atomic<uint32_t> instance_object{0};
+} g_submit_stat;
+
 struct submit_cache{
-	obj_transforms	transforms;
+	frame_transforms	transforms;
+	worker_pool		workers;
 
 	submit_context		ctx;
 	obj_submitter		obj;
@@ -579,10 +949,21 @@ struct submit_cache{
 	}
 
 	void clear(){
+		g_submit_stat.transform_upload.store(transforms.uploads, std::memory_order_relaxed);
+		g_submit_stat.transform_reuse.store(transforms.reuses, std::memory_order_relaxed);
+		g_submit_stat.attrib_issued.store(ctx.attrib_issued.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		g_submit_stat.attrib_skipped.store(ctx.attrib_skipped.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		g_submit_stat.instance_draw.store(obj.instance_draws, std::memory_order_relaxed);
+		g_submit_stat.instance_object.store(obj.instance_objects, std::memory_order_relaxed);
+
 		transforms.clear();
 		obj.clear();
 		hitch.clear();
 
+		g_submit_stat.simple.store(obj.objects.high_water, std::memory_order_relaxed);
+		g_submit_stat.hitch.store(hitch.objs.objects.high_water, std::memory_order_relaxed);
+		g_submit_stat.efk_hitch.store(hitch.efks.objects.high_water, std::memory_order_relaxed);
+
 #ifdef RENDER_DEBUG
 		memset(&stat, 0, sizeof(stat));
 #endif //RENDER_DEBUG
@@ -596,7 +977,12 @@ struct submit_cache{
 static int
 lrender_submit(lua_State *L) {
 	auto w = getworld(L);
-	w->submit_cache->obj.submit(w->submit_cache->transforms);
+	// material instances are fetched here, render_preprocess may change them after render_collect
+	w->submit_cache->obj.sort();
+	w->submit_cache->hitch.sort();
+
+	w->submit_cache->obj.prepare(w->submit_cache->transforms);
+	w->submit_cache->obj.submit(w->submit_cache->workers);
 	w->submit_cache->hitch.submit(w->submit_cache->transforms);
 
 	w->submit_cache->clear();
@@ -608,8 +994,8 @@ lrender_correct(lua_State *L){
 	auto w = getworld(L);
 	w->submit_cache->init(L, w);
 
-	w->submit_cache->obj.collect();
-	w->submit_cache->hitch.collect();
+	w->submit_cache->obj.collect(w->submit_cache->transforms);
+	w->submit_cache->hitch.collect(w->submit_cache->transforms);
 	// submit efk here, to make efk thread can submit parallel with world render submit
 	w->submit_cache->hitch.collect_submit_efks();
 	return 0;
@@ -715,7 +1101,33 @@ lexit(lua_State *L){
 
 static int
 lsubmit_stat(lua_State *L){
-	lua_createtable(L, 0, 4);
+	lua_createtable(L, 0, 11);
+	lua_pushinteger(L, g_submit_stat.simple.load(std::memory_order_relaxed));
+	lua_setfield(L, -2, "simple_max");
+
+	lua_pushinteger(L, g_submit_stat.hitch.load(std::memory_order_relaxed));
+	lua_setfield(L, -2, "hitch_max");
+
+	lua_pushinteger(L, g_submit_stat.efk_hitch.load(std::memory_order_relaxed));
+	lua_setfield(L, -2, "efk_hitch_max");
+
+	lua_pushinteger(L, g_submit_stat.transform_upload.load(std::memory_order_relaxed));
+	lua_setfield(L, -2, "transform_upload");
+
+	lua_pushinteger(L, g_submit_stat.transform_reuse.load(std::memory_order_relaxed));
+	lua_setfield(L, -2, "transform_reuse");
+
+	lua_pushinteger(L, g_submit_stat.attrib_issued.load(std::memory_order_relaxed));
+	lua_setfield(L, -2, "attrib_issued");
+
+	lua_pushinteger(L, g_submit_stat.attrib_skipped.load(std::memory_order_relaxed));
+	lua_setfield(L, -2, "attrib_skipped");
+
+	lua_pushinteger(L, g_submit_stat.instance_draw.load(std::memory_order_relaxed));
+	lua_setfield(L, -2, "instance_draw");
+
+	lua_pushinteger(L, g_submit_stat.instance_object.load(std::memory_order_relaxed));
+	lua_setfield(L, -2, "instance_object");
 //TODO
 //#ifdef RENDER_DEBUG
 //	lua_pushinteger(L, cc.stat.hitch_submit);
@@ -733,6 +1145,17 @@ lsubmit_stat(lua_State *L){
 	return 1;
 }
 
+static int
+lset_submit_workers(lua_State *L){
+	auto w = getworld(L);
+	const lua_Integer n = luaL_checkinteger(L, 1);
+	if (n < 0 || n > MAX_SUBMIT_WORKERS){
+		return luaL_error(L, "Invalid submit workers: %d, should be : 0 <= n <= %d", (int)n, MAX_SUBMIT_WORKERS);
+	}
+	w->submit_cache->workers.resize((uint32_t)n);
+	return 0;
+}
+
 static int
 lset_queue_type(lua_State *L){
 	auto w = getworld(L);
@@ -765,6 +1188,7 @@ luaopen_render_cache(lua_State *L){
 	luaL_Reg l[] = {
 		{ "submit_stat",	lsubmit_stat},
 		{ "set_queue_type", lset_queue_type},
+		{ "set_submit_workers", lset_submit_workers},
 		{ nullptr, 			nullptr},
 	};
 	luaL_newlibtable(L,l);
@@ -813,7 +1237,7 @@ lentity_draw(lua_State *L){
 	if (!ro){
 		luaL_error(L, "entity_draw need entity has 'render_object' component");
 	}
-	auto mi = find_submit_material(L, w, ra, ro->rm_idx);
+	auto mi = find_submit_material(L, w, ra->material_index, ro->rm_idx);
 	if (mi){
 		const auto prog = material_prog(L, mi);
 		if (BGFX_HANDLE_IS_VALID(prog) && find_submit_mesh(w, ro, nullptr)){
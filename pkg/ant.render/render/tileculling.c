@@ -24,7 +24,7 @@ struct screen {
 	int id_max;
 	int list_n;
 	struct id_list list[MAX_ID];
-	uint64_t id_mask[MAX_ID/8];
+	uint64_t id_mask[MAX_ID/64];
 	struct tile t[TILE_LENGTH][TILE_LENGTH];
 	unsigned char mask[TILE_LENGTH * TILE_LENGTH];
 };
@@ -67,8 +67,7 @@ add_list(struct screen *S, struct tile *t, int id) {
 
 static inline void
 mark_change(struct screen *S, int id) {
-	int index = id / 8;
-	S->id_mask[index] |= 1 << (id % 8);
+	S->id_mask[id / 64] |= (uint64_t)1 << (id % 64);
 }
 
 static inline void
@@ -87,7 +86,8 @@ touch(struct screen *S, int id, int x, int y) {
 	struct tile *t = &S->t[y][x];
 	if (t->slot == CHANGE_TILE_ID)
 		return 1;
-	++t->dirty_count;
+	if (t->dirty_count < 255)
+		++t->dirty_count;
 	if (t->dirty_count <= t->last_count && t->dirty_count < 255) {
 		add_list(S, t, id);
 		return 0;
@@ -118,12 +118,12 @@ intcoord(struct screen *S, const float rect[4], struct grid_rect *r) {
 	} else {
 		r->y1 = floorf(rect[1] * TILE_LENGTH);
 	}
-	if (x2 < 0 || y2 < 0)
+	if (x2 < 0 || y2 < 0 || r->x1 >= TILE_LENGTH || r->y1 >= TILE_LENGTH)
 		return 1;
 	r->x2 = ceilf(x2 * TILE_LENGTH);
 	if (r->x2 >= TILE_LENGTH)
 		r->x2 = TILE_LENGTH - 1;
-	r->y2 = ceilf(x2 * TILE_LENGTH);
+	r->y2 = ceilf(y2 * TILE_LENGTH);
 	if (r->y2 >= TILE_LENGTH)
 		r->y2 = TILE_LENGTH - 1;
 	return 0;
@@ -209,8 +209,7 @@ screen_reset(struct screen *S) {
 int
 screen_query(struct screen *S, int id) {
 	assert(id >= 0 && id <= S->id_max);
-	int index = id / 8;
-	return S->id_mask[index] & ( 1 << ( id % 8 ) );
+	return (S->id_mask[id / 64] >> (id % 64)) & 1;
 }
 
 int
@@ -224,6 +223,186 @@ screen_mask(struct screen *S) {
 	return S->mask;
 }
 
+#ifndef TESTMAIN
+
+#include <lua.h>
+#include <lauxlib.h>
+#include "ecs/world.h"
+#include "math3d.h"
+
+#define SCREEN_METATABLE "ANT_TILE_SCREEN"
+
+struct screen_ud {
+	struct screen *S;
+};
+
+static struct screen *
+getscreen(lua_State *L, int index) {
+	struct screen_ud *ud = (struct screen_ud *)luaL_checkudata(L, index, SCREEN_METATABLE);
+	if (ud->S == NULL)
+		luaL_error(L, "screen is deleted");
+	return ud->S;
+}
+
+static void
+getrect(lua_State *L, int index, float rect[4]) {
+	int i;
+	for (i=0;i<4;i++) {
+		rect[i] = (float)luaL_checknumber(L, index+i);
+	}
+}
+
+static int
+lscreen_change(lua_State *L) {
+	struct screen *S = getscreen(L, 1);
+	float rect[4];
+	getrect(L, 2, rect);
+	screen_change(S, rect);
+	return 0;
+}
+
+// return id for screen:query() after submit, nil means it should be drawn anyway
+static int
+lscreen_changeless(lua_State *L) {
+	struct screen *S = getscreen(L, 1);
+	float rect[4];
+	getrect(L, 2, rect);
+	int id = screen_changeless(S, rect);
+	if (id < 0)
+		return 0;
+	lua_pushinteger(L, id);
+	return 1;
+}
+
+static int
+lscreen_submit(lua_State *L) {
+	screen_submit(getscreen(L, 1));
+	return 0;
+}
+
+static int
+lscreen_reset(lua_State *L) {
+	screen_reset(getscreen(L, 1));
+	return 0;
+}
+
+static int
+lscreen_query(lua_State *L) {
+	struct screen *S = getscreen(L, 1);
+	int id = (int)luaL_checkinteger(L, 2);
+	if (id < 0 || id >= S->id_max)
+		return luaL_error(L, "Invalid id %d", id);
+	lua_pushboolean(L, screen_query(S, id));
+	return 1;
+}
+
+// return ptr, size, masksize. The mask is masksize * masksize bytes, 255 for dirty tile, and it is rewritten by next submit
+static int
+lscreen_mask(lua_State *L) {
+	struct screen *S = getscreen(L, 1);
+	int n = screen_masksize(S);
+	lua_pushlightuserdata(L, (void *)screen_mask(S));
+	lua_pushinteger(L, n * n);
+	lua_pushinteger(L, n);
+	return 3;
+}
+
+static int
+lscreen_delete(lua_State *L) {
+	struct screen_ud *ud = (struct screen_ud *)luaL_checkudata(L, 1, SCREEN_METATABLE);
+	if (ud->S) {
+		screen_delete(ud->S);
+		ud->S = NULL;
+	}
+	return 0;
+}
+
+static int
+lscreen_new(lua_State *L) {
+	struct screen_ud *ud = (struct screen_ud *)lua_newuserdatauv(L, sizeof(*ud), 0);
+	ud->S = NULL;
+	if (luaL_newmetatable(L, SCREEN_METATABLE)) {
+		luaL_Reg l[] = {
+			{ "change", lscreen_change },
+			{ "changeless", lscreen_changeless },
+			{ "submit", lscreen_submit },
+			{ "reset", lscreen_reset },
+			{ "query", lscreen_query },
+			{ "mask", lscreen_mask },
+			{ "delete", lscreen_delete },
+			{ NULL, NULL },
+		};
+		luaL_newlib(L, l);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, lscreen_delete);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	ud->S = screen_new();
+	if (ud->S == NULL)
+		return luaL_error(L, "Out of memory");
+	return 1;
+}
+
+// screen rect (x, y, w, h) of an aabb in [0, 1], origin at top left. return nothing when it is out of screen
+static int
+lscreen_rect(lua_State *L) {
+	struct ecs_world *w = getworld(L);
+	struct math_context *M = w->math3d->M;
+	const float *vp = math_value(M, math3d_from_lua_id(L, w->math3d, 1));
+	const float *aabb = math_value(M, math3d_from_lua_id(L, w->math3d, 2));
+	const float *minv = aabb;
+	const float *maxv = aabb + 4;
+
+	float x1 = 1, y1 = 1, x2 = 0, y2 = 0;
+	int i;
+	for (i=0;i<8;i++) {
+		const float p[3] = {
+			(i & 1) ? maxv[0] : minv[0],
+			(i & 2) ? maxv[1] : minv[1],
+			(i & 4) ? maxv[2] : minv[2],
+		};
+		float c[4];
+		int j;
+		for (j=0;j<4;j++) {
+			c[j] = vp[j] * p[0] + vp[4+j] * p[1] + vp[8+j] * p[2] + vp[12+j];
+		}
+		if (c[3] <= 0) {
+			// behind the camera, take the whole screen
+			x1 = y1 = 0;
+			x2 = y2 = 1;
+			break;
+		}
+		const float sx = (c[0] / c[3] + 1) * 0.5f;
+		const float sy = (1 - c[1] / c[3]) * 0.5f;
+		x1 = fminf(x1, sx); x2 = fmaxf(x2, sx);
+		y1 = fminf(y1, sy); y2 = fmaxf(y2, sy);
+	}
+	if (x2 < 0 || y2 < 0 || x1 > 1 || y1 > 1 || x2 < x1 || y2 < y1)
+		return 0;
+	lua_pushnumber(L, x1);
+	lua_pushnumber(L, y1);
+	lua_pushnumber(L, x2 - x1);
+	lua_pushnumber(L, y2 - y1);
+	return 4;
+}
+
+LUAMOD_API int
+luaopen_render_tileculling(lua_State *L) {
+	luaL_checkversion(L);
+	luaL_Reg l[] = {
+		{ "new", lscreen_new },
+		{ "rect", lscreen_rect },
+		{ NULL, NULL },
+	};
+	luaL_newlibtable(L,l);
+	lua_pushnil(L);
+	luaL_setfuncs(L,l,1);
+	return 1;
+}
+
+#endif
+
 #ifdef TESTMAIN
 
 #include <stdio.h>
@@ -6,7 +6,7 @@ struct screen;
 struct screen * screen_new();
 void screen_delete(struct screen *S);
 void screen_change(struct screen *S, const float rect[4]);	// x,y,w,h
-int screen_changeless(struct screen *S, const float rect[4]);	// w,y,w,h
+int screen_changeless(struct screen *S, const float rect[4]);	// x,y,w,h
 void screen_submit(struct screen *S);
 int screen_query(struct screen *S, int id);
 int screen_masksize(struct screen *S);
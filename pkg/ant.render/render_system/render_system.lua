@@ -61,6 +61,7 @@ end
 function render_sys:post_init()
 	RC.set_queue_type("main_queue", queuemgr.queue_index "main_queue")
 	RC.set_queue_type("pre_depth_queue", queuemgr.queue_index "pre_depth_queue")
+	RC.set_submit_workers(setting:get "graphic/render/submit_workers" or 0)
 end
 
 local function update_ro(ro, m)
@@ -94,6 +95,21 @@ local function create_material_instance(e)
 	return RM.create_instance(mo.object)
 end
 
+local function update_instance_material(e)
+	local fs = e.feature_set
+	if fs.DRAW_INDIRECT or fs.GPU_SKINNING then
+		return
+	end
+	local mr = assetmgr.resource(e.material)
+	if mr.di then
+		local mi = RM.create_instance(mr.di.object)
+		local imidx = queuemgr.instance_material_index "main_queue"
+		R.set(e.render_object.rm_idx, imidx, mi:ptr())
+		e.filter_material[imidx] = mi
+		imaterial.sync_instance_state(e.filter_material, queuemgr.material_index "main_queue")
+	end
+end
+
 local function update_default_material_index(e)
 	w:extend(e, "material:in feature_set:in filter_material:in")
 	local ro = e.render_object
@@ -102,6 +118,8 @@ local function update_default_material_index(e)
 	R.set(ro.rm_idx, midx, mi:ptr())
 	e.filter_material.DEFAULT_MATERIAL = mi
 	e.filter_material[midx] = mi	-- just make it same with rm_idx data
+
+	update_instance_material(e)
 end
 
 local function check_set_depth_state_as_equal(state)
@@ -133,6 +151,7 @@ local function check_update_main_queue_material(e)
 		local midx = queuemgr.material_index "main_queue"
 		R.set(e.render_object.rm_idx, midx, mi:ptr())
 		fm[midx] = mi
+		imaterial.sync_instance_state(fm, midx)
 	end
 end
 
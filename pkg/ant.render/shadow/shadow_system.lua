@@ -421,6 +421,15 @@ function shadow_sys:entity_ready()
 				mi:set_state(create_shadow_state(Dmi:get_state(), dstres.state))
 				fm[midx] = mi
 				R.set(ro.rm_idx, midx, mi:ptr())
+
+				--only the default shadow material has an instanced variant
+				if dstres == shadow_material then
+					local imi = RM.create_instance(di_shadow_material.depth.object)
+					local imidx = queuemgr.instance_material_index "csm1_queue"
+					fm[imidx] = imi
+					R.set(ro.rm_idx, imidx, imi:ptr())
+					imaterial.sync_instance_state(fm, midx)
+				end
 				castshadow = hasaabb
 			end
 		end
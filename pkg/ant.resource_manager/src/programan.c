@@ -7,32 +7,78 @@
 #include "luabgfx.h"
 #include "programan.h"
 
-#define PROGRAM_MAX 0x8000
+// program id is generation << 16 | (index + 1), the stale id of a deleted program gets an invalid handle
+#define PROGRAM_INDEX_MAX 0xffff
+#define PROGRAM_GENERATION_MASK 0x7fff
+#define PROGRAM_CHUNK_SHIFT 8
+#define PROGRAM_CHUNK_SIZE (1 << PROGRAM_CHUNK_SHIFT)
+#define PROGRAM_CHUNK_MAX ((PROGRAM_INDEX_MAX + PROGRAM_CHUNK_SIZE) / PROGRAM_CHUNK_SIZE)
 #define REMOVE_MAX 1024
 #define INVALID_HANDLE 0xffff
 
+struct program_slot {
+	uint32_t timestamp;
+	uint16_t handle;
+	uint16_t generation;
+	uint8_t live;
+	uint8_t removing;	// in removed list, waiting for program_remove
+	uint16_t next_free;	// index + 1
+};
+
+struct timehandle {
+	uint32_t life;
+	int id;
+};
+
+// slots are allocated in chunks which never move, program_get is called by render threads
 struct program_manager {
 	int max;
 	int n;
 	int threshold_removed;
 	int threshold_reserved;
-	int id;
+	int id;				// slots allocated
+	int live_n;
+	int free_list;		// index + 1
 	int removed_n;
 	int request;
 	uint32_t frame;
-	uint16_t map[PROGRAM_MAX];
-	uint16_t removed[REMOVE_MAX];
-	uint32_t timestamp[PROGRAM_MAX];
+	uint16_t removed[REMOVE_MAX];	// index
+	struct program_slot *chunk[PROGRAM_CHUNK_MAX];
+	struct timehandle *scratch;
+	int scratch_cap;
 };
 
 static struct program_manager g_man;
 
+static inline struct program_slot *
+get_slot(int index) {
+	return &g_man.chunk[index >> PROGRAM_CHUNK_SHIFT][index & (PROGRAM_CHUNK_SIZE - 1)];
+}
+
+static inline int
+make_id(int index) {
+	return (get_slot(index)->generation << 16) | (index + 1);
+}
+
+// ret: index, or -1 when the id is invalid or stale
+static inline int
+find_index(int id) {
+	int index = (id & 0xffff) - 1;
+	if (id <= 0 || index < 0 || index >= g_man.id)
+		return -1;
+	struct program_slot *s = get_slot(index);
+	if (!s->live || s->generation != (id >> 16))
+		return -1;
+	return index;
+}
+
 static inline int
 checkid(lua_State *L, int index) {
 	int id = (int)luaL_checkinteger(L, index);
-	if (id <= 0 || id > g_man.id)
+	int idx = find_index(id);
+	if (idx < 0)
 		return luaL_error(L, "Invalid program id %d", id);
-	return id;
+	return idx;
 }
 
 /*
@@ -77,6 +123,8 @@ lprogram_init(lua_State *L) {
 	g_man.threshold_removed = threshold_removed;
 	g_man.threshold_reserved = threshold_reserved;
 	g_man.id = 0;
+	g_man.live_n = 0;
+	g_man.free_list = 0;
 	g_man.frame = 0;
 	g_man.removed_n = 0;
 	g_man.request = 0;
@@ -84,20 +132,55 @@ lprogram_init(lua_State *L) {
 }
 
 static int
-lprogram_new(lua_State *L) {
-	if (g_man.id >= PROGRAM_MAX)
+alloc_slot(lua_State *L) {
+	struct program_manager *M = &g_man;
+	if (M->free_list) {
+		int index = M->free_list - 1;
+		M->free_list = get_slot(index)->next_free;
+		return index;
+	}
+	if (M->id >= PROGRAM_INDEX_MAX)
 		return luaL_error(L, "Too many program id");
-	int id = g_man.id++;
-	g_man.map[id] = INVALID_HANDLE;
-	g_man.timestamp[id] = g_man.frame;
-	lua_pushinteger(L, id+1);
+	int index = M->id;
+	int c = index >> PROGRAM_CHUNK_SHIFT;
+	if (M->chunk[c] == NULL) {
+		struct program_slot *chunk = (struct program_slot *)calloc(PROGRAM_CHUNK_SIZE, sizeof(struct program_slot));
+		if (chunk == NULL)
+			return luaL_error(L, "Out of memory");
+		M->chunk[c] = chunk;
+	}
+	++M->id;
+	return index;
+}
+
+static int
+lprogram_new(lua_State *L) {
+	int index = alloc_slot(L);
+	struct program_slot *s = get_slot(index);
+	s->handle = INVALID_HANDLE;
+	s->timestamp = g_man.frame;
+	s->removing = 0;
+	s->next_free = 0;
+	s->live = 1;
+	++g_man.live_n;
+	lua_pushinteger(L, make_id(index));
 	return 1;
 }
 
-struct timehandle {
-	uint32_t life;
-	int id;
-};
+// the program must be reset before delete, the id is recycled with a new generation
+static int
+lprogram_delete(lua_State *L) {
+	int index = checkid(L, 1);
+	struct program_slot *s = get_slot(index);
+	if (s->handle != INVALID_HANDLE)
+		return luaL_error(L, "Program id %d is still set", (int)lua_tointeger(L, 1));
+	s->live = 0;
+	s->generation = (s->generation + 1) & PROGRAM_GENERATION_MASK;
+	s->next_free = (uint16_t)g_man.free_list;
+	g_man.free_list = index + 1;
+	--g_man.live_n;
+	return 0;
+}
 
 static int
 compar_timehandle(const void *a, const void *b) {
@@ -107,15 +190,25 @@ compar_timehandle(const void *a, const void *b) {
 }
 
 static void
-remove_old(struct program_manager *M) {
+remove_old(lua_State *L, struct program_manager *M) {
+	if (M->scratch_cap < M->id) {
+		struct timehandle *scratch = (struct timehandle *)realloc(M->scratch, M->id * 2 * sizeof(struct timehandle));
+		if (scratch == NULL) {
+			luaL_error(L, "Out of memory");
+			return;
+		}
+		M->scratch = scratch;
+		M->scratch_cap = M->id * 2;
+	}
+	struct timehandle *array = M->scratch;
 	int n = 0;
-	struct timehandle array[PROGRAM_MAX];
 	int i;
 	uint32_t current = M->frame;
 	for (i=0;i<M->id;i++) {
-		if (M->map[i] != INVALID_HANDLE) {
+		struct program_slot *s = get_slot(i);
+		if (s->handle != INVALID_HANDLE && !s->removing) {
 			struct timehandle *h = &array[n++];
-			h->life = current - M->timestamp[i];
+			h->life = current - s->timestamp;
 			h->id = i;
 		}
 	}
@@ -125,44 +218,62 @@ remove_old(struct program_manager *M) {
 			return;
 		if (M->removed_n >= REMOVE_MAX)
 			return;
-		int id = array[i].id;
-		uint16_t h = M->map[id];
-		M->map[id] = INVALID_HANDLE;
-		M->removed[M->removed_n++] = h;
+		// keep the handle, the owner destroys it with program_reset after program_remove
+		int index = array[i].id;
+		get_slot(index)->removing = 1;
+		M->removed[M->removed_n++] = (uint16_t)index;
 		--M->n;
 	}
 }
 
 static int
 lprogram_set(lua_State *L) {
-	int id = checkid(L, 1);
+	int index = checkid(L, 1);
 	uint16_t handle = (uint16_t)luaL_checkinteger(L, 2);
-	--id;
+	struct program_slot *s = get_slot(index);
 	if (handle == INVALID_HANDLE)
 		return luaL_error(L, "Use reset to set invalid handle");
-	if (g_man.map[id] != INVALID_HANDLE)
-		return luaL_error(L, "Program id %d is already set", id + 1);
-	g_man.map[id] = handle;
+	if (s->handle != INVALID_HANDLE)
+		return luaL_error(L, "Program id %d is already set", (int)lua_tointeger(L, 1));
+	s->handle = handle;
 	++g_man.n;
 	if (g_man.n > g_man.threshold_reserved)
-		remove_old(&g_man);
+		remove_old(L, &g_man);
 	if (g_man.n + g_man.removed_n > g_man.max)
 		return luaL_error(L, "Too many programs in memory");
 	return 0;
 }
 
+static void
+unlink_removed(int index) {
+	int i;
+	for (i=0;i<g_man.removed_n;i++) {
+		if (g_man.removed[i] == index) {
+			g_man.removed[i] = g_man.removed[--g_man.removed_n];
+			return;
+		}
+	}
+}
+
 static int
 lprogram_reset(lua_State *L) {
-	int id = checkid(L, 1);
-	--id;
-	if (g_man.map[id] == INVALID_HANDLE)
+	int index = checkid(L, 1);
+	struct program_slot *s = get_slot(index);
+	if (s->handle == INVALID_HANDLE)
 		return 0;
-	--g_man.n;
-	lua_pushinteger(L, g_man.map[id]);
-	g_man.map[id] = INVALID_HANDLE;
+	if (s->removing) {
+		// it's not counted in n, drop it from removed list
+		s->removing = 0;
+		unlink_removed(index);
+	} else {
+		--g_man.n;
+	}
+	lua_pushinteger(L, s->handle);
+	s->handle = INVALID_HANDLE;
 	return 1;
 }
 
+// ret: the program ids which should be destroyed by program_reset
 static int
 lprogram_remove(lua_State *L) {
 	if (g_man.removed_n == 0)
@@ -177,7 +288,11 @@ lprogram_remove(lua_State *L) {
 	int n = (int)lua_rawlen(L, 1);
 	int i;
 	for (i=0;i<g_man.removed_n;i++) {
-		lua_pushinteger(L, g_man.removed[i]);
+		int index = g_man.removed[i];
+		// count it as in memory again, until program_reset
+		get_slot(index)->removing = 0;
+		++g_man.n;
+		lua_pushinteger(L, make_id(index));
 		lua_seti(L, 1, n + i + 1);
 	}
 	g_man.removed_n = 0;
@@ -202,8 +317,9 @@ lprogram_request(lua_State *L) {
 	uint32_t frame = g_man.frame++;
 	int idx = 0;
 	for (i=0;i<g_man.id;i++) {
-		if (g_man.timestamp[i] == frame && g_man.map[i] == INVALID_HANDLE) {
-			lua_pushinteger(L, i+1);
+		struct program_slot *s = get_slot(i);
+		if (s->live && s->timestamp == frame && s->handle == INVALID_HANDLE) {
+			lua_pushinteger(L, make_id(i));
 			lua_seti(L, 1, ++idx);
 		}
 	}
@@ -212,10 +328,10 @@ lprogram_request(lua_State *L) {
 
 static int
 lprogram_get(lua_State *L) {
-	int id = checkid(L, 1);
-	--id;
-	uint16_t h = g_man.map[id];
-	g_man.timestamp[id] = g_man.frame;
+	int index = checkid(L, 1);
+	struct program_slot *s = get_slot(index);
+	uint16_t h = s->handle;
+	s->timestamp = g_man.frame;
 	int luahandle = (BGFX_HANDLE_PROGRAM << 16) | h;
 	lua_pushinteger(L, luahandle);
 	if (h != INVALID_HANDLE)
@@ -226,17 +342,32 @@ lprogram_get(lua_State *L) {
 bgfx_program_handle_t
 program_get(int id) {
 	bgfx_program_handle_t handle = BGFX_INVALID_HANDLE;
-	if (id <= 0 || id > g_man.id)
+	int index = find_index(id);
+	if (index < 0)
 		return handle;
-	--id;
-	uint16_t h = g_man.map[id];
-	g_man.timestamp[id] = g_man.frame;
+	struct program_slot *s = get_slot(index);
+	uint16_t h = s->handle;
+	s->timestamp = g_man.frame;
 	handle.idx = h;
 	if (h != INVALID_HANDLE)
 		g_man.request = 1;
 	return handle;
 }
 
+static int
+lprogram_stat(lua_State *L) {
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, g_man.n);
+	lua_setfield(L, -2, "n");
+	lua_pushinteger(L, g_man.live_n);
+	lua_setfield(L, -2, "live");
+	lua_pushinteger(L, g_man.id);
+	lua_setfield(L, -2, "slots");
+	lua_pushinteger(L, g_man.removed_n);
+	lua_setfield(L, -2, "removed");
+	return 1;
+}
+
 LUAMOD_API int
 luaopen_programan_client(lua_State *L) {
 	luaL_checkversion(L);
@@ -255,10 +386,12 @@ luaopen_programan_server(lua_State *L) {
 	luaL_Reg l[] = {
 		{ "program_init", lprogram_init },
 		{ "program_new", lprogram_new },
+		{ "program_delete", lprogram_delete },
 		{ "program_set", lprogram_set },
 		{ "program_reset", lprogram_reset },
 		{ "program_remove", lprogram_remove },
 		{ "program_request", lprogram_request },
+		{ "program_stat", lprogram_stat },
 		{ NULL, NULL },
 	};
 	luaL_newlib(L, l);	
@@ -3,58 +3,227 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "luabgfx.h"
 #include "textureman.h"
 
-#define TEXTURE_MAX_ID 0x7fff
+// texture id is generation << 20 | (index + 1), bits 16-19 are 0 : material attrib tells it from a bgfx handle by the type bits
+#define TEXTURE_MAX_ID 0xffff
+#define TEXTURE_GENERATION_SHIFT 20
+#define TEXTURE_GENERATION_MASK 0x7ff
+#define TEXTURE_CHUNK_SHIFT 8
+#define TEXTURE_CHUNK_SIZE (1 << TEXTURE_CHUNK_SHIFT)
+#define TEXTURE_CHUNK_MAX ((TEXTURE_MAX_ID + TEXTURE_CHUNK_SIZE) / TEXTURE_CHUNK_SIZE)
+// a destroyed id is reused after these frames, so the render thread doesn't get another texture with an old id in flight
+#define TEXTURE_RECYCLE_FRAMES 8
+#define INVALID_HANDLE 0xffff
 
-static uint32_t g_texture[TEXTURE_MAX_ID];
-static uint16_t g_texture_id = 0;
-static uint32_t g_frame = 0;
-static uint32_t g_texture_timestamp[TEXTURE_MAX_ID];
+// mip residency of streamed textures, skip is the count of top mips which are not loaded
+struct texture_residency {
+	uint32_t size;		// bytes of all mips, 0: not streamed
+	uint8_t base;		// skip of the lowest resolution
+	uint8_t skip;
+};
+
+struct texture_slot {
+	uint32_t texture;	// type << 16 | handle
+	uint32_t timestamp;	// last used frame, or the frame it's destroyed in free queue
+	struct texture_residency residency;
+	uint16_t generation;
+	uint16_t live;		// index + 1 in live list, 0: destroyed
+};
+
+// slots are allocated in chunks which never move, texture_get is called by render threads while the resource thread creates textures
+struct texture_manager {
+	struct texture_slot *chunk[TEXTURE_CHUNK_MAX];
+	int id;				// slots allocated
+	uint32_t frame;
+	// live ids (base 0), frame_get and stream_update only walk them
+	uint16_t *live;
+	uint16_t *order;
+	int live_n;
+	int live_cap;
+	// destroyed ids in destroy order
+	uint16_t *freeq;
+	int free_head;
+	int free_n;
+	int free_cap;
+};
+
+static struct texture_manager g_man;
+
+static inline struct texture_slot *
+get_slot(int id) {
+	return &g_man.chunk[id >> TEXTURE_CHUNK_SHIFT][id & (TEXTURE_CHUNK_SIZE - 1)];
+}
+
+static inline int
+make_id(int index) {
+	return (get_slot(index)->generation << TEXTURE_GENERATION_SHIFT) | (index + 1);
+}
+
+// ret: index, or -1 when the id is invalid or stale
+static inline int
+find_index(int id) {
+	int index = (id & 0xffff) - 1;
+	if (id <= 0 || index < 0 || index >= g_man.id || (id & 0xf0000))
+		return -1;
+	struct texture_slot *s = get_slot(index);
+	if (s->live == 0 || s->generation != (id >> TEXTURE_GENERATION_SHIFT))
+		return -1;
+	return index;
+}
+
+static inline void *
+grow_array(lua_State *L, void *p, int *cap, int n, size_t elem) {
+	if (n < *cap)
+		return p;
+	int newcap = *cap == 0 ? 256 : *cap * 2;
+	void *np = realloc(p, newcap * elem);
+	if (np == NULL) {
+		luaL_error(L, "Out of memory");
+		return NULL;
+	}
+	*cap = newcap;
+	return np;
+}
 
+static int
+alloc_slot(lua_State *L) {
+	struct texture_manager *M = &g_man;
+	if (M->free_n > 0) {
+		int id = M->freeq[M->free_head];
+		if (M->frame - get_slot(id)->timestamp >= TEXTURE_RECYCLE_FRAMES) {
+			M->free_head = (M->free_head + 1) % M->free_cap;
+			--M->free_n;
+			return id;
+		}
+	}
+	if (M->id >= TEXTURE_MAX_ID)
+		return luaL_error(L, "Too many textures");
+	int id = M->id;
+	int c = id >> TEXTURE_CHUNK_SHIFT;
+	if (M->chunk[c] == NULL) {
+		struct texture_slot *chunk = (struct texture_slot *)calloc(TEXTURE_CHUNK_SIZE, sizeof(struct texture_slot));
+		if (chunk == NULL)
+			return luaL_error(L, "Out of memory");
+		M->chunk[c] = chunk;
+	}
+	++M->id;
+	return id;
+}
+
+static void
+free_slot(lua_State *L, int id) {
+	struct texture_manager *M = &g_man;
+	if (M->free_n >= M->free_cap) {
+		// unroll the ring before growing
+		uint16_t *q = (uint16_t *)malloc((M->free_cap == 0 ? 256 : M->free_cap * 2) * sizeof(uint16_t));
+		if (q == NULL) {
+			luaL_error(L, "Out of memory");
+			return;
+		}
+		int i;
+		for (i=0;i<M->free_n;i++) {
+			q[i] = M->freeq[(M->free_head + i) % M->free_cap];
+		}
+		free(M->freeq);
+		M->freeq = q;
+		M->free_head = 0;
+		M->free_cap = M->free_cap == 0 ? 256 : M->free_cap * 2;
+	}
+	M->freeq[(M->free_head + M->free_n) % M->free_cap] = (uint16_t)id;
+	++M->free_n;
+}
+
+static inline void
+live_add(lua_State *L, int id) {
+	struct texture_manager *M = &g_man;
+	int cap = M->live_cap;
+	M->live = (uint16_t *)grow_array(L, M->live, &cap, M->live_n, sizeof(uint16_t));
+	if (cap != M->live_cap) {
+		int ocap = M->live_cap;
+		M->order = (uint16_t *)grow_array(L, M->order, &ocap, M->live_n, sizeof(uint16_t));
+		M->live_cap = cap;
+	}
+	M->live[M->live_n++] = (uint16_t)id;
+	get_slot(id)->live = (uint16_t)M->live_n;
+}
+
+static inline void
+live_remove(int id) {
+	struct texture_manager *M = &g_man;
+	struct texture_slot *s = get_slot(id);
+	int index = s->live - 1;
+	int last = M->live[--M->live_n];
+	M->live[index] = (uint16_t)last;
+	get_slot(last)->live = (uint16_t)(index + 1);
+	s->live = 0;
+}
+
+// ret: id
 static int
 ltexture_create(lua_State *L) {
 	uint16_t handle = BGFX_LUAHANDLE_ID(TEXTURE, (int)luaL_checkinteger(L, 1));
 	uint16_t type = (uint16_t)luaL_optinteger(L, 2, 0);
-	if (g_texture_id >= TEXTURE_MAX_ID) {
-		return luaL_error(L, "Too many textures");
-	}
-	int id = g_texture_id++;
-	g_texture[id] = (uint32_t)(type<<16|handle);
-	g_texture_timestamp[id] = g_frame;
-	lua_pushinteger(L, id+1);
+	int id = alloc_slot(L);
+	struct texture_slot *s = get_slot(id);
+	s->texture = (uint32_t)(type<<16|handle);
+	s->timestamp = g_man.frame;
+	memset(&s->residency, 0, sizeof(s->residency));
+	live_add(L, id);
+	lua_pushinteger(L, make_id(id));
 	return 1;
 }
 
+// ret: index
 static inline int
 checktextureid(lua_State *L, int index) {
 	int id = (int)luaL_checkinteger(L, index);
-	if (id <= 0 || id > g_texture_id)
+	int idx = find_index(id);
+	if (idx < 0)
 		return luaL_error(L, "Invalid texture handle %d", id);
-	return id;
+	return idx;
+}
+
+static int
+ltexture_destroy(lua_State *L) {
+	int index = checktextureid(L, 1);
+	struct texture_slot *s = get_slot(index);
+	live_remove(index);
+	s->texture = INVALID_HANDLE;
+	s->timestamp = g_man.frame;
+	memset(&s->residency, 0, sizeof(s->residency));
+	s->generation = (s->generation + 1) & TEXTURE_GENERATION_MASK;
+	free_slot(L, index);
+	return 0;
 }
 
 static int
 ltexture_get(lua_State *L) {
-	int id = checktextureid(L, 1);
-	uint32_t texture = g_texture[id - 1];
+	int index = checktextureid(L, 1);
+	struct texture_slot *s = get_slot(index);
+	uint32_t texture = s->texture;
 	uint16_t type = texture >> 16;
 	uint16_t handle = texture & 0xffff;
-	g_texture_timestamp[id - 1] = g_frame;
+	s->timestamp = g_man.frame;
 	int luahandle = (BGFX_HANDLE_TEXTURE << 16) | handle;
 	lua_pushinteger(L, luahandle);
 	lua_pushinteger(L, type);
 	return 2;
 }
 
+// the stale id of a destroyed texture gets an invalid handle, even if its slot is reused
 static int
 texture_transform(int id) {
 	bgfx_texture_handle_t handle = BGFX_INVALID_HANDLE;
-	if (id <= 0 || id > g_texture_id)
+	int index = find_index(id);
+	if (index < 0)
 		return handle.idx;
-	uint16_t h = g_texture[id - 1] & 0xffff;
-	g_texture_timestamp[id - 1] = g_frame;
+	struct texture_slot *s = get_slot(index);
+	uint16_t h = s->texture & 0xffff;
+	s->timestamp = g_man.frame;
 	return h;
 }
 
@@ -66,31 +235,34 @@ texture_get(int id) {
 
 uint16_t
 texture_type(int id) {
-	uint32_t texture = g_texture[id - 1];
+	int index = find_index(id);
+	if (index < 0)
+		return 0;
+	uint32_t texture = get_slot(index)->texture;
 	uint16_t type = texture >> 16;
 	return type;
 }
 
 static int
 ltexture_set(lua_State *L) {
-	int id = checktextureid(L, 1);
+	int index = checktextureid(L, 1);
 	uint16_t handle = BGFX_LUAHANDLE_ID(TEXTURE, (int)luaL_checkinteger(L, 2));
 	uint16_t type = (uint16_t)luaL_optinteger(L, 3, 0);
-	g_texture[id - 1] = (uint32_t)(type<<16|handle);
+	get_slot(index)->texture = (uint32_t)(type<<16|handle);
 	return 0;
 }
 
 static int
 lframe_tick(lua_State *L) {
-	int f = g_frame++;
+	int f = g_man.frame++;
 	lua_pushinteger(L, f);
 	return 1;
 }
 
 static inline uint32_t
 read_timestamp(int index) {
-	uint32_t t = g_texture_timestamp[index];
-	return (uint32_t)(g_frame - t);
+	uint32_t t = get_slot(index)->timestamp;
+	return (uint32_t)(g_man.frame - t);
 }
 
 static int
@@ -101,15 +273,15 @@ ltexture_timestamp(lua_State *L) {
 		int i;
 		for (i=1;i<=n;i++) {
 			lua_geti(L, 1, i);
-			int id = checktextureid(L, -1);
+			int index = checktextureid(L, -1);
 			lua_pop(L, 1);
-			int t = read_timestamp(id - 1);
+			int t = read_timestamp(index);
 			lua_pushinteger(L, t);
 			lua_seti(L, 1, i);
 		}
 	} else {
-		int id = checktextureid(L, 1);
-		int t = read_timestamp(id - 1);
+		int index = checktextureid(L, 1);
+		int t = read_timestamp(index);
 		lua_pushinteger(L, t);
 	}
 	return 1;
@@ -117,8 +289,9 @@ ltexture_timestamp(lua_State *L) {
 
 static inline int
 is_invalid(int id, uint16_t* filter, size_t filter_n) {
+	uint16_t h = get_slot(id)->texture & 0xffff;
 	for (size_t i = 0; i < filter_n; ++i) {
-		if ((g_texture[id] & 0xffff) == filter[i]) {
+		if (h == filter[i]) {
 			return 1;
 		}
 	}
@@ -131,18 +304,20 @@ frame_get(lua_State *L,int index, int range, uint16_t* filter, size_t filter_n)
 	int n = 0;
 	if (range >= 0) {
 		// filter new
-		for (i=0;i<g_texture_id;i++) {
-			if (is_invalid(i, filter, filter_n) && (int)read_timestamp(i) <= range) {
-				lua_pushinteger(L, i+1);
+		for (i=0;i<g_man.live_n;i++) {
+			int id = g_man.live[i];
+			if (is_invalid(id, filter, filter_n) && (int)read_timestamp(id) <= range) {
+				lua_pushinteger(L, make_id(id));
 				lua_rawseti(L, index, ++n);
 			}
 		}
 	} else {
 		// filter old
 		int old = - range;
-		for (i=0;i<g_texture_id;i++) {
-			if (!is_invalid(i, filter, filter_n) && (int)read_timestamp(i) >= old) {
-				lua_pushinteger(L, i+1);
+		for (i=0;i<g_man.live_n;i++) {
+			int id = g_man.live[i];
+			if (!is_invalid(id, filter, filter_n) && (int)read_timestamp(id) >= old) {
+				lua_pushinteger(L, make_id(id));
 				lua_rawseti(L, index, ++n);
 			}
 		}
@@ -189,6 +364,118 @@ lframe_old(lua_State *L) {
 	return 1;
 }
 
+// every mip is a quarter of the upper one
+static inline uint32_t
+resident_size(const struct texture_residency *r, int skip) {
+	uint32_t sz = r->size >> (2 * skip);
+	return sz > 0 ? sz : 1;
+}
+
+static int
+ltexture_residency(lua_State *L) {
+	int index = checktextureid(L, 1);
+	struct texture_residency *r = &get_slot(index)->residency;
+	r->size = (uint32_t)luaL_checkinteger(L, 2);
+	if (r->size == 0) {
+		r->base = r->skip = 0;
+		return 0;
+	}
+	int skip = (int)luaL_checkinteger(L, 3);
+	int base = (int)luaL_optinteger(L, 4, skip);
+	if (skip < 0 || skip > base || base > 15)
+		return luaL_error(L, "Invalid mip skip %d (base %d)", skip, base);
+	r->skip = (uint8_t)skip;
+	r->base = (uint8_t)base;
+	return 0;
+}
+
+static int
+compar_recent(const void *a, const void *b) {
+	uint32_t ta = read_timestamp(*(const uint16_t *)a);
+	uint32_t tb = read_timestamp(*(const uint16_t *)b);
+	return ta < tb ? -1 : (ta > tb);
+}
+
+static inline void
+push_stream(lua_State *L, int index, int *n, int id, int skip) {
+	lua_pushinteger(L, make_id(id));
+	lua_rawseti(L, index, ++*n);
+	lua_pushinteger(L, skip);
+	lua_rawseti(L, index, ++*n);
+}
+
+// 1: active range, the texture used in these frames is in active use
+// 2: budget in bytes
+// 3: result table { id, skip, ... }, the textures need reload with new skip
+// ret: result, resident bytes after the changes
+static int
+lstream_update(lua_State *L) {
+	uint32_t active = (uint32_t)luaL_checkinteger(L, 1);
+	uint64_t budget = (uint64_t)luaL_checkinteger(L, 2);
+	check_result(L, 3);
+
+	uint16_t *order = g_man.order;
+	uint64_t resident = 0;
+	int count = 0;
+	int i;
+	for (i=0;i<g_man.live_n;i++) {
+		int id = g_man.live[i];
+		const struct texture_residency *r = &get_slot(id)->residency;
+		if (r->size > 0) {
+			resident += resident_size(r, r->skip);
+			order[count++] = (uint16_t)id;
+		}
+	}
+	qsort(order, count, sizeof(order[0]), compar_recent);
+
+	int n = 0;
+	// upgrade the most recently used first, while the budget allows
+	for (i=0;i<count;i++) {
+		int id = order[i];
+		const struct texture_residency *r = &get_slot(id)->residency;
+		if (read_timestamp(id) > active)
+			break;
+		if (r->skip == 0)
+			continue;
+		uint64_t delta = r->size - resident_size(r, r->skip);
+		if (resident + delta <= budget) {
+			resident += delta;
+			push_stream(L, 3, &n, id, 0);
+		}
+	}
+	// over budget: drop the top mips of the least recently used
+	for (i=count-1;i>=0 && resident > budget;i--) {
+		int id = order[i];
+		const struct texture_residency *r = &get_slot(id)->residency;
+		if (read_timestamp(id) <= active)
+			break;
+		if (r->skip >= r->base)
+			continue;
+		resident -= resident_size(r, r->skip) - resident_size(r, r->base);
+		push_stream(L, 3, &n, id, r->base);
+	}
+
+	int on = (int)lua_rawlen(L, 3);
+	for (i=n+1;i<=on;i++) {
+		lua_pushnil(L);
+		lua_rawseti(L, 3, i);
+	}
+	lua_pushinteger(L, (lua_Integer)resident);
+	return 2;
+}
+
+static int
+lstat(lua_State *L) {
+	lua_createtable(L, 0, 3);
+	lua_pushinteger(L, g_man.live_n);
+	lua_setfield(L, -2, "live");
+	lua_pushinteger(L, g_man.id);
+	lua_setfield(L, -2, "slots");
+	lua_pushinteger(L, g_man.free_n);
+	lua_setfield(L, -2, "free");
+	return 1;
+}
+
 LUAMOD_API int
 luaopen_textureman_client(lua_State *L) {
 	luaL_checkversion(L);
@@ -207,14 +494,18 @@ luaopen_textureman_server(lua_State *L) {
 	luaL_checkversion(L);
 	luaL_Reg l[] = {
 		{ "texture_create", ltexture_create },
+		{ "texture_destroy", ltexture_destroy },
 		{ "texture_set", ltexture_set },
 		{ "texture_timestamp", ltexture_timestamp },
 		{ "frame_tick", lframe_tick },
 		{ "frame_new", lframe_new },
 		{ "frame_old", lframe_old },
+		{ "texture_residency", ltexture_residency },
+		{ "stream_update", lstream_update },
+		{ "stat", lstat },
 		{ NULL, NULL },
 	};
-	luaL_newlib(L, l);	
+	luaL_newlib(L, l);
 
 	return 1;
 }
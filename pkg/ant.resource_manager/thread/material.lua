@@ -326,6 +326,15 @@ function S.material_destroy(material)
         MATERIALS[diid] = nil
         material_destroy(material.fx.di)
     end
+
+    --program ids are recycled, the stale ids get invalid handle
+    PM.program_delete(pid)
+    if material.fx.depth then
+        PM.program_delete(material.fx.depth.prog)
+    end
+    if material.fx.di then
+        PM.program_delete(material.fx.di.prog)
+    end
 end
 
 -- local REMOVED_PROGIDS = {}
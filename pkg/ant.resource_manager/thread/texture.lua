@@ -4,6 +4,17 @@ local textureman = require "textureman.server"
 local image      = require "image"
 local aio        = import_package "ant.io"
 local serialize  = import_package "ant.serialize"
+local setting    = import_package "ant.settings"
+local btime      = require "bee.time"
+
+-- mip streaming: a texture is loaded from the mip not larger than StreamBaseSize first, it's upgraded to full resolution when
+-- it's in active use, and the top mips of the least recently used are dropped when the resident size is over budget
+local EnableStream <const>   = setting:get "graphic/texture_stream/enable"
+local StreamBaseSize <const> = setting:get "graphic/texture_stream/base_size" or 128
+local StreamBudget <const>   = (setting:get "graphic/texture_stream/budget" or 256) * 1024 * 1024
+
+-- main.bin is read in the load coroutines, the reads are in flight in io service, and the create loop only receives ready memory
+local MaxLoading <const> = setting:get "graphic/texture_load/max_loading" or 16
 
 local ext_service = {}
 
@@ -42,8 +53,13 @@ local function createTexture(c)
     elseif c.dynamic then
         local ti = c.info
         h = bgfx.create_texture2d(ti.width, ti.height, ti.numMips ~= 0, ti.numLayers, ti.format, c.flag)
+    elseif c.memory then
+        -- the memory_file is referenced by bgfx memory, and it's freed after bgfx consumes it
+        local memory = c.memory
+        c.memory = nil
+        h = bgfx.create_texture(bgfx.memory_buffer(memory()), c.flag, c.skip or 0)
     else
-        h = bgfx.create_texture(bgfx.memory_buffer(aio.readall((c.info.atlas and c.info.atlas.path or c.name) .."/main.bin")), c.flag)
+        h = bgfx.create_texture(bgfx.memory_buffer(aio.readall((c.info.atlas and c.info.atlas.path or c.name) .."/main.bin")), c.flag, c.skip or 0)
     end
     bgfx.set_name(h, c.name)
     return h
@@ -214,6 +230,53 @@ local function which_texture_type(info)
     return info.numLayers > 1 and "SAMPLER2DARRAY" or "SAMPLER2D"
 end
 
+local Loading = 0
+local LoadingToken = {}
+
+-- read main.bin before the texture is queued, the number of reads in flight is bounded by MaxLoading
+local function readTexture(textureData)
+    if textureData.value or textureData.dynamic or textureData.handle then
+        return
+    end
+    local ti = textureData.info
+    if ti.atlas and atlas[textureData.image] then
+        return
+    end
+    while Loading >= MaxLoading do
+        ltask.multi_wait(LoadingToken)
+    end
+    Loading = Loading + 1
+    local ok, memory = pcall(aio.readall, (ti.atlas and ti.atlas.path or textureData.name) .. "/main.bin")
+    -- give the slot back before rethrow, or the failed read holds it forever
+    Loading = Loading - 1
+    ltask.multi_wakeup(LoadingToken)
+    if not ok then
+        error(memory)
+    end
+    textureData.memory = memory
+end
+
+-- load latency histogram, bucket i counts the textures loaded in [2^(i-2), 2^(i-1)) ms, the first one is < 1ms
+local LatencyBuckets <const> = 14
+local LoadLatency = { count = 0, max = 0 }
+for i = 1, LatencyBuckets do
+    LoadLatency[i] = 0
+end
+
+local function recordLatency(ms)
+    local i = 1
+    local b = 1
+    while ms >= b and i < LatencyBuckets do
+        i = i + 1
+        b = b * 2
+    end
+    LoadLatency[i] = LoadLatency[i] + 1
+    LoadLatency.count = LoadLatency.count + 1
+    if ms > LoadLatency.max then
+        LoadLatency.max = ms
+    end
+end
+
 local function asyncCreateTexture(name, textureData)
     if createQueue[name] then
         return
@@ -225,41 +288,107 @@ local function asyncCreateTexture(name, textureData)
     end
 end
 
+-- the mip skip of the lowest resolution which is loaded first, nil if the texture can't be streamed
+local function streamBaseSkip(c, textureData)
+    local ti = textureData.info
+    if not EnableStream or textureData.value or textureData.dynamic or textureData.handle or ti.atlas or c.lifespan then
+        return
+    end
+    if ti.cubeMap or ti.depth > 1 or ti.numMips <= 1 then
+        return
+    end
+    local skip = 0
+    local s = math.max(ti.width, ti.height)
+    while skip < ti.numMips - 1 and (s >> skip) > StreamBaseSize do
+        skip = skip + 1
+    end
+    if skip > 0 then
+        return skip
+    end
+end
+
 local function asyncLoadTexture(c)
     local Token = loadQueue[c.id]
     if Token then
         return Token
     end
+    if c.reading then
+        return
+    end
     Token = {}
     loadQueue[c.id] = Token
+    c.load_start = btime.monotonic()
     ltask.fork(function ()
         local textureData = loadTexture(c.name)
         assert(c.type == which_texture_type(textureData.info))
         c.texinfo = textureData.info
         c.sampler = textureData.sampler
         c.lifespan = textureData.lifespan
-        asyncCreateTexture(c.name, textureData)
+        c.stream_base = streamBaseSkip(c, textureData)
+        textureData.skip = c.stream_base
+        -- texinfo is ready, the caller doesn't wait for the file
         loadQueue[c.id] = nil
+        c.reading = true
         ltask.multi_wakeup(Token)
+        local ok, err = pcall(readTexture, textureData)
+        c.reading = nil
+        if not ok then
+            -- the texture keeps the default handle, it can be loaded again by frame_new
+            error(err)
+        end
+        asyncCreateTexture(c.name, textureData)
     end)
     return Token
 end
 
-local function asyncDestroyTexture(c)
-    if createQueue[c.name] then
-        return
-    end
+local function releaseHandle(c, handle)
 	if c.lifespan then
 		local n = #unloadQueue
 		unloadQueue[n+1] = c.lifespan
-		unloadQueue[n+2] = c.handle
+		unloadQueue[n+2] = handle
 	else
-	    destroyQueue[#destroyQueue+1] = c.handle
+	    destroyQueue[#destroyQueue+1] = handle
 	end
+end
+
+local function asyncDestroyTexture(c)
+    if createQueue[c.name] then
+        return
+    end
+    releaseHandle(c, c.handle)
     textureman.texture_set(c.id, DefaultTexture[c.type], getTextureType(c.texinfo))
+    textureman.texture_residency(c.id, 0)
     c.handle = nil
 end
 
+-- reload the texture with new mip skip, the old handle is destroyed after the new one is set
+local function asyncStreamTexture(c, skip)
+    if c.streaming or c.reading or createQueue[c.name] or loadQueue[c.id] then
+        return
+    end
+    c.streaming = true
+    local handle = c.handle
+    ltask.fork(function ()
+        local textureData = loadTexture(c.name)
+        textureData.skip = skip
+        local ok, err = pcall(readTexture, textureData)
+        if not ok then
+            c.streaming = nil
+            error(err)
+        end
+        if c.handle ~= handle then
+            -- evicted by frame_old while reading, don't bring it back
+            c.streaming = nil
+            if textureData.memory then
+                textureData.memory()
+                textureData.memory = nil
+            end
+            return
+        end
+        asyncCreateTexture(c.name, textureData)
+    end)
+end
+
 local S = require "thread.main"
 
 
@@ -282,16 +411,33 @@ ltask.fork(function ()
             local textureData = createQueue[name]
             if textureData.info.atlas and atlas[textureData.image] then
                 textureData.handle = atlas[textureData.image]
+                if textureData.memory then
+                    -- the image is created by another texture of the atlas, drop the memory to gc
+                    textureData.memory()
+                    textureData.memory = nil
+                end
             end
             createQueue[name] = nil
             local c = textureByName[name]
             local handle = textureData.handle or createTexture(textureData)
+            if c.handle and c.handle ~= handle then
+                -- the texture is streamed with another mip, or reloaded
+                releaseHandle(c, c.handle)
+            end
             c.handle = handle
+            c.streaming = nil
+            if c.stream_base then
+                textureman.texture_residency(c.id, textureData.info.storageSize, textureData.skip or 0, c.stream_base)
+            end
             if textureData.info.atlas and not (atlas[textureData.image]) then
                 atlas[textureData.image] = c.handle
             end
             c.flag   = textureData.flag
             textureman.texture_set(c.id, handle, getTextureType(textureData.info))
+            if c.load_start then
+                recordLatency(btime.monotonic() - c.load_start)
+                c.load_start = nil
+            end
             local block_token = blockQueue[name]
             if block_token then
                 blockQueue[name] = nil
@@ -318,6 +464,8 @@ local update; do
     local results = {}
     local UpdateNewInterval <const> = 30 *  1 --  1s
     local UpdateOldInterval <const> = 30 * 60 -- 60s
+    local UpdateStreamInterval <const> = 30 * 1 -- 1s
+    local StreamActiveRange <const> = 30 * 2 -- used in 2s
     local InvalidTexture <const> = ("HHH"):pack(DefaultTexture.SAMPLER2D & 0xffff, DefaultTexture.SAMPLERCUBE & 0xffff, DefaultTexture.SAMPLER2DARRAY & 0xffff)
     function update()
         for i = 1, #destroyQueue do
@@ -346,6 +494,15 @@ local update; do
                 FrameNew = FrameCur - 1
             end
         end
+        if EnableStream and FrameCur % UpdateStreamInterval == 0 and #createQueue == 0 then
+            textureman.stream_update(StreamActiveRange, StreamBudget, results)
+            for i = 1, #results, 2 do
+                local c = textureById[results[i]]
+                if c and c.handle then
+                    asyncStreamTexture(c, results[i+1])
+                end
+            end
+        end
         if FrameCur % UpdateOldInterval == 0 then
             textureman.frame_old(UpdateOldInterval, InvalidTexture, results)
             for i = 1, #results do
@@ -367,6 +524,32 @@ function S.texture_default()
     return DefaultTexture
 end
 
+local function waitTexture(c, block)
+    if block then
+        local block_token = blockWaitTexture(c.name)
+        local load_token = asyncLoadTexture(c)
+        local tasks = { { ltask.multi_wait, block_token } }
+        if load_token then
+            tasks[2] = { ltask.multi_wait, load_token }
+        end
+        for _, resp in ltask.parallel(tasks) do
+            if resp.error then
+                resp:rethrow()
+            end
+        end
+    else
+        local load_token = asyncLoadTexture(c)
+        if load_token then
+            ltask.multi_wait(load_token)
+        end
+    end
+    return {
+        id = c.id,
+        texinfo = c.texinfo,
+        sampler = c.sampler,
+    }
+end
+
 function S.texture_create(name, type, block)
     local c = textureByName[name]
     if c then
@@ -388,25 +571,7 @@ function S.texture_create(name, type, block)
         textureByName[name] = c
         textureById[id] = c
     end
-    if block then
-        local block_token = blockWaitTexture(name)
-        local load_token = asyncLoadTexture(c)
-        for _, resp in ltask.parallel {
-            { ltask.multi_wait, block_token },
-            { ltask.multi_wait, load_token },
-        } do
-            if resp.error then
-                resp:rethrow()
-            end
-        end
-    else
-        ltask.multi_wait(asyncLoadTexture(c))
-    end
-    return {
-        id = c.id,
-        texinfo = c.texinfo,
-        sampler = c.sampler,
-    }
+    return waitTexture(c, block)
 end
 
 function S.texture_create_fast(name, type)
@@ -426,9 +591,13 @@ function S.texture_create_fast(name, type)
     return c.id
 end
 
+-- keep the id, the materials refer to it, the old handle is released when the new one is created
 function S.texture_reload(name, type, block)
-    textureByName[name] = nil
-    return S.texture_create(name, type, block)
+    local c = textureByName[name]
+    if not c then
+        return S.texture_create(name, type, block)
+    end
+    return waitTexture(c, block)
 end
 
 
@@ -445,12 +614,20 @@ function S.texture_timestamp(rtid_table)
     return result_table -- rt_id:timestamp
 end
 
+-- the owner of a render target id must call texture_unregister_id when it's done, or the slot is never recycled
 function S.texture_register_id()
     local rt_id = textureman.texture_create(DefaultTexture["SAMPLER2D"])
     rt_table[rt_id] = true
     return rt_id
 end
 
+--the id is recycled after some frames, don't use it after unregister
+function S.texture_unregister_id(rt_id)
+    assert(rt_table[rt_id], "Invalid render target texture id")
+    rt_table[rt_id] = nil
+    textureman.texture_destroy(rt_id)
+end
+
 function S.texture_set_handle(rt_id, rt_handle)
     textureman.texture_set(rt_id, rt_handle)
 end
@@ -474,6 +651,10 @@ end
 
 -- for web console
 
+function S.texture_load_stat()
+    return LoadLatency
+end
+
 function S.texture_list()
 	local r = {}
 	local n = 1
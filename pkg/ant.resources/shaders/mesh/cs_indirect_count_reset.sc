@@ -0,0 +1,9 @@
+#include <bgfx_compute.sh>
+
+BUFFER_WR(b_draw_count, uint, 0);
+
+NUM_THREADS(1, 1, 1)
+void main()
+{
+	b_draw_count[0] = 0u;
+}
@@ -1,45 +1,137 @@
 #include <bgfx_compute.sh>
 #include <bgfx_shader.sh>
 
-BUFFER_WR(b_visiblity_buffer, vec4, 0);
-BUFFER_RO(b_obj_buffer, vec4, 1);
-BUFFER_RO(b_plane_buffer, vec4, 2);
+//each draw command in b_indirect_src draws one instance at its startInstance, the instance is a matrix3x4(3 rows of worldmat)
+//compact mode: visible commands are compacted into b_indirect_dst, and b_draw_count[0] is the number of them, it should be 0 before dispatch
+//otherwise: commands are copied into b_indirect_dst in place, and the culled ones draw 0 instance
+BUFFER_RO(b_indirect_src,		uvec4,	0);
+BUFFER_WR(b_indirect_dst,		uvec4,	1);
+BUFFER_RW(b_draw_count,			uint,	2);
+BUFFER_RO(b_instance_buffer,	vec4,	3);
+IMAGE2D_RO(s_hiz, r16f, 4);
 
-vec3 negativeVertex(vec3 bmin, vec3 bmax, vec3 n)
+uniform vec4 u_cull_param;			//x: draw num, y: hiz enable, z: compact
+uniform vec4 u_cull_planes[6];		//frustum planes, positive side is inside
+uniform vec4 u_cull_aabb[2];		//mesh aabb min/max in local space
+uniform vec4 u_cull_worldmat[3];	//3 rows of the entity worldmat, the instance is drawn with worldmat * instance matrix
+uniform vec4 u_cull_viewproj[4];	//columns of viewproj matrix, which hiz is rendered with
+
+#define draw_num	uint(u_cull_param.x)
+#define hiz_enable	(u_cull_param.y > 0.0)
+#define compact		(u_cull_param.z > 0.0)
+
+//hiz is sampled in a fixed mip, footprint larger than this is treated as visible
+#define HIZ_MAX_TEXEL	4
+
+bool frustum_visible(vec3 center, vec3 extent)
 {
-	bvec3 b = greaterThan(n, vec3(0.0, 0.0, 0.0));
-	return mix(bmin, bmax, b);
+	for (int ii = 0; ii < 6; ++ii)
+	{
+		const vec4 p = u_cull_planes[ii];
+		const float r = dot(extent, abs(p.xyz));
+		if (dot(p.xyz, center) + p.w + r < 0.0)
+			return false;
+	}
+	return true;
 }
 
-uint cull(vec3 aabb_min, vec3 aabb_max)
+//hiz is the min depth of the footprint(farthest with inverse z), so it's only valid with inverse z
+bool hiz_visible(vec3 center, vec3 extent)
 {
-	uint queue_visible = 0;
-	for(uint i = 0; i < 2; ++i)
+	const mat4 vp = mtxFromCols(u_cull_viewproj[0], u_cull_viewproj[1], u_cull_viewproj[2], u_cull_viewproj[3]);
+	vec2 minuv = vec2(1.0, 1.0);
+	vec2 maxuv = vec2(0.0, 0.0);
+	float nearz = 0.0;
+	for (int ii = 0; ii < 8; ++ii)
 	{
-		int r = 1;
- 		for (int ii = 0; ii < 6 && r >= 0; ++ii)
-		{
-			vec3 n = negativeVertex(aabb_min, aabb_max, b_plane_buffer[i*6+ii].xyz);
-			r = dot(vec4(n, 1.0f), b_plane_buffer[i*6+ii]);
-		}	 
-		if(r < 0)
+		const vec3 s = vec3(
+			(ii & 1) != 0 ? 1.0 : -1.0,
+			(ii & 2) != 0 ? 1.0 : -1.0,
+			(ii & 4) != 0 ? 1.0 : -1.0);
+		const vec4 c = mul(vp, vec4(center + extent * s, 1.0));
+		if (c.w <= 0.0)
+			return true;
+		const vec3 ndc = c.xyz / c.w;
+		vec2 uv = ndc.xy * 0.5 + 0.5;
+#if !ORIGIN_BOTTOM_LEFT
+		uv.y = 1.0 - uv.y;
+#endif //!ORIGIN_BOTTOM_LEFT
+		minuv = min(minuv, uv);
+		maxuv = max(maxuv, uv);
+#if HOMOGENEOUS_DEPTH
+		nearz = max(nearz, ndc.z * 0.5 + 0.5);
+#else //!HOMOGENEOUS_DEPTH
+		nearz = max(nearz, ndc.z);
+#endif //HOMOGENEOUS_DEPTH
+	}
+
+	const ivec2 size = imageSize(s_hiz);
+	const ivec2 t0 = ivec2(saturate(minuv) * vec2(size));
+	const ivec2 t1 = min(ivec2(saturate(maxuv) * vec2(size)), size - ivec2(1, 1));
+	if (t1.x - t0.x >= HIZ_MAX_TEXEL || t1.y - t0.y >= HIZ_MAX_TEXEL)
+		return true;
+
+	float farz = 1.0;
+	for (int y = t0.y; y <= t1.y; ++y)
+	{
+		for (int x = t0.x; x <= t1.x; ++x)
 		{
-			queue_visible &=  ~(1 << i); // is_culled
-		}
-		else{
-			queue_visible |= (1 << i);
+			farz = min(farz, imageLoad(s_hiz, ivec2(x, y)).r);
 		}
 	}
-	return queue_visible;
+	return nearz >= farz;
+}
+
+bool instance_visible(uint instanceidx)
+{
+	const vec4 i0 = b_instance_buffer[instanceidx*3+0];
+	const vec4 i1 = b_instance_buffer[instanceidx*3+1];
+	const vec4 i2 = b_instance_buffer[instanceidx*3+2];
+
+	//rows of worldmat * instance matrix
+	const vec4 w0 = u_cull_worldmat[0];
+	const vec4 w1 = u_cull_worldmat[1];
+	const vec4 w2 = u_cull_worldmat[2];
+	const vec4 r0 = w0.x * i0 + w0.y * i1 + w0.z * i2 + vec4(0.0, 0.0, 0.0, w0.w);
+	const vec4 r1 = w1.x * i0 + w1.y * i1 + w1.z * i2 + vec4(0.0, 0.0, 0.0, w1.w);
+	const vec4 r2 = w2.x * i0 + w2.y * i1 + w2.z * i2 + vec4(0.0, 0.0, 0.0, w2.w);
+
+	const vec4 lc = vec4((u_cull_aabb[0].xyz + u_cull_aabb[1].xyz) * 0.5, 1.0);
+	const vec3 le = (u_cull_aabb[1].xyz - u_cull_aabb[0].xyz) * 0.5;
+	const vec3 center = vec3(dot(r0, lc), dot(r1, lc), dot(r2, lc));
+	const vec3 extent = vec3(dot(abs(r0.xyz), le), dot(abs(r1.xyz), le), dot(abs(r2.xyz), le));
+
+	if (!frustum_visible(center, extent))
+		return false;
+
+	return !hiz_enable || hiz_visible(center, extent);
 }
 
 NUM_THREADS(64, 1, 1)
 void main()
 {
-	int tid = int(gl_GlobalInvocationID.x);
-	vec4 aabb_min = b_obj_buffer[2*tid];
-	vec4 aabb_max = b_obj_buffer[2*tid+1];
-	uint queue_visible = cull(aabb_min.xyz, aabb_max.xyz);
-	b_visiblity_buffer[tid] = vec4((float)queue_visible, 0, 0, 0);
+	const uint tid = uint(gl_GlobalInvocationID.x);
+	if (tid >= draw_num)
+		return ;
+
+	uvec4 cmd0 = b_indirect_src[tid*2+0];
+	const uvec4 cmd1 = b_indirect_src[tid*2+1];
+	if (cmd0.y != 0u && !instance_visible(cmd1.x))
+		cmd0.y = 0u;
+
+	if (compact)
+	{
+		if (cmd0.y == 0u)
+			return ;
+
+		uint slot;
+		atomicFetchAndAdd(b_draw_count[0], 1u, slot);
+		b_indirect_dst[slot*2+0] = cmd0;
+		b_indirect_dst[slot*2+1] = cmd1;
+	}
+	else
+	{
+		b_indirect_dst[tid*2+0] = cmd0;
+		b_indirect_dst[tid*2+1] = cmd1;
+	}
 }
- 
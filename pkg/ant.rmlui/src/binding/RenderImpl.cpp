@@ -434,7 +434,7 @@ Material* RenderImpl::CreateTextureMaterial(TextureId texture, SamplerFlag flags
 }
 
 Material* RenderImpl::CreateRenderTextureMaterial(TextureId texture, SamplerFlag flags) {
-    auto material = std::make_unique<TextureMaterial>(context.shader, bgfx_texture_handle_t{texture}, flags);
+    auto material = std::make_unique<TextureMaterial>(context.shader, bgfx_texture_handle_t{(uint16_t)texture}, flags);
     return reinterpret_cast<Material*>(material.release());
 } 
 
@@ -15,7 +15,7 @@ class Element;
 class Document;
 
 using FontFaceHandle = uint64_t;
-using TextureId = uint16_t;
+using TextureId = uint32_t;
 
 struct layout {
     Color color;
@@ -55,12 +55,12 @@ struct TextureData {
 		float fx, fy, fw, fh;
 	};
 
-	TextureId handle = UINT16_MAX;
+	TextureId handle = UINT32_MAX;
 	Size      dimensions = {0, 0};
 	std::variant<std::monostate, Lattice, Atlas> extra;
 
 	explicit operator bool () const {
-		return handle != UINT16_MAX;
+		return handle != UINT32_MAX;
 	}
 };
 
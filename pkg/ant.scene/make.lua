@@ -4,6 +4,7 @@ lm:lua_src "scene" {
     confs = { "glm" },
     includes = {
         lm.AntDir .. "/clibs/ecs",
+        lm.AntDir .. "/clibs/foundation",
         lm.AntDir .. "/3rd/math3d",
         lm.AntDir .. "/3rd/bee.lua",
         lm.AntDir .. "/3rd/luaecs",
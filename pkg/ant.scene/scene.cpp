@@ -5,6 +5,10 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
 #include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "worker.h"
 
 extern "C" {
 	#include "math3d.h"
@@ -31,16 +35,55 @@ math3d_update(struct math_context* math3d, math_t& id, math_t const& m) {
 	id = math_mark(math3d, m);
 }
 
-static bool
-worldmat_update(bee::flatmap<component::eid, math_t>& worldmats, struct math_context* math3d, component::scene& s, component::eid& id, struct ecs_world *w) {
-	math_t mat = math3d_make_srt(math3d, s.s, s.r, s.t);
-	if (!math_isnull(s.mat)) {
-		mat = math3d_mul_matrix(math3d, mat, s.mat);
+// world matrices of changed entities are computed by hierarchy level: every entity only depends on the level above,
+// so a level can be split across worker threads. Inputs are copied out of math3d before computing, math3d is not thread safe
+struct scene_cache {
+	struct entry {
+		component::scene*	s;
+		int					parent;		// entry index of the parent, -1: parent is not changed in this frame
+		uint32_t			depth;
+		bool				hasmat;
+		bool				hasparentmat;
+		glm::vec3			scale;
+		glm::quat			rotation;
+		glm::vec3			translation;
+		glm::mat4			mat;
+		glm::mat4			parentmat;	// world matrix of the unchanged parent
+	};
+
+	// levels smaller than this are computed in the calling thread
+	static constexpr uint32_t PARALLEL_LEVEL_SIZE = 512;
+	static constexpr uint32_t JOB_SIZE = 256;
+
+	void clear() {
+		entries.clear();
 	}
-	if (s.parent != 0) {
-		auto parentmat = worldmats.find(s.parent);
-		if (!parentmat) {
-			if (w) {
+
+	bool add(bee::flatmap<component::eid, int>& index, struct math_context* math3d, component::scene& s, component::eid id, struct ecs_world *w) {
+		entry en;
+		en.s = &s;
+		en.parent = -1;
+		en.depth = 0;
+		en.hasparentmat = false;
+
+		const float *v = math_isnull(s.s) ? nullptr : math_value(math3d, s.s);
+		en.scale = v ? glm::vec3(v[0], v[1], v[2]) : glm::vec3(1.f);
+		// math3d and glm(GLM_FORCE_QUAT_DATA_XYZW) share the same quaternion layout
+		static const float identity[4] = {0.f, 0.f, 0.f, 1.f};
+		v = math_isnull(s.r) ? identity : math_value(math3d, s.r);
+		memcpy(&en.rotation, v, sizeof(en.rotation));
+		v = math_isnull(s.t) ? nullptr : math_value(math3d, s.t);
+		en.translation = v ? glm::vec3(v[0], v[1], v[2]) : glm::vec3(0.f);
+		en.hasmat = !math_isnull(s.mat);
+		if (en.hasmat) {
+			memcpy(&en.mat, math_value(math3d, s.mat), sizeof(en.mat));
+		}
+
+		if (s.parent != 0) {
+			if (auto p = index.find(s.parent)) {
+				en.parent = *p;
+				en.depth = entries[*p].depth + 1;
+			} else {
 				if ((component::eid)s.parent >= id)
 					return false;
 				auto e = ecs::find_entity(w->ecs, (component::eid)s.parent);
@@ -51,21 +94,113 @@ worldmat_update(bee::flatmap<component::eid, math_t>& worldmats, struct math_con
 				if (ps == nullptr) {
 					return false;
 				}
-				parentmat = &ps->worldmat;
-				worldmats.insert_or_assign(s.parent, ps->worldmat);
+				en.hasparentmat = true;
+				memcpy(&en.parentmat, math_value(math3d, ps->worldmat), sizeof(en.parentmat));
+			}
+		}
+		index.insert_or_assign(id, (int)entries.size());
+		entries.push_back(en);
+		return true;
+	}
+
+	void compute(uint32_t idx) {
+		const entry &en = entries[idx];
+		glm::mat4 m = glm::mat4_cast(en.rotation);
+		m[0] *= en.scale.x;
+		m[1] *= en.scale.y;
+		m[2] *= en.scale.z;
+		m[3] = glm::vec4(en.translation, 1.f);
+		if (en.hasmat) {
+			m = m * en.mat;
+		}
+		if (en.parent >= 0) {
+			m = worldmats[en.parent] * m;
+		} else if (en.hasparentmat) {
+			m = en.parentmat * m;
+		}
+		worldmats[idx] = m;
+	}
+
+	void update(struct math_context* math3d) {
+		const uint32_t num = (uint32_t)entries.size();
+		worldmats.resize(num);
+
+		// sort entries by depth, levels[d] is the start of depth d in order
+		levels.assign(1, 0);
+		for (const auto &en : entries) {
+			if (en.depth + 1 >= levels.size())
+				levels.resize(en.depth + 2, 0);
+			++levels[en.depth + 1];
+		}
+		for (size_t ii = 1; ii < levels.size(); ++ii) {
+			levels[ii] += levels[ii-1];
+		}
+		order.resize(num);
+		offsets.assign(levels.begin(), levels.end());
+		for (uint32_t ii = 0; ii < num; ++ii) {
+			order[offsets[entries[ii].depth]++] = ii;
+		}
+
+		for (size_t d = 0; d + 1 < levels.size(); ++d) {
+			const uint32_t first = levels[d];
+			const uint32_t count = levels[d+1] - first;
+			if (count < PARALLEL_LEVEL_SIZE || workers.size() == 0) {
+				for (uint32_t ii = first; ii < first + count; ++ii) {
+					compute(order[ii]);
+				}
 			} else {
-				return false;
+				workers.run((count + JOB_SIZE - 1) / JOB_SIZE, [&](uint32_t job, uint32_t) {
+					const uint32_t from = first + job * JOB_SIZE;
+					const uint32_t to = std::min(from + JOB_SIZE, first + count);
+					for (uint32_t ii = from; ii < to; ++ii) {
+						compute(order[ii]);
+					}
+				});
 			}
 		}
-		mat = math3d_mul_matrix(math3d, *parentmat, mat);
+
+		for (uint32_t ii = 0; ii < num; ++ii) {
+			auto &s = *entries[ii].s;
+			math3d_update(math3d, s.worldmat, math_import(math3d, &worldmats[ii][0][0], MATH_TYPE_MAT, 1));
+		}
 	}
-	math3d_update(math3d, s.worldmat, mat);
-	worldmats.insert_or_assign(id, s.worldmat);
-	return true;
-}
+
+	std::vector<entry>		entries;
+	std::vector<glm::mat4>	worldmats;
+	std::vector<uint32_t>	order;
+	std::vector<uint32_t>	levels;
+	std::vector<uint32_t>	offsets;
+	worker_pool				workers;
+};
 
 #define MUTABLE_TICK 128
 
+static int
+scene_init(lua_State *L) {
+	auto w = getworld(L);
+	w->scene_cache = new scene_cache;
+	return 0;
+}
+
+static int
+scene_exit(lua_State *L) {
+	auto w = getworld(L);
+	delete w->scene_cache;
+	w->scene_cache = nullptr;
+	return 0;
+}
+
+static int
+set_workers(lua_State *L) {
+	auto w = getworld(L);
+	const lua_Integer n = luaL_checkinteger(L, 1);
+	if (n < 0 || n > 64) {
+		return luaL_error(L, "Invalid scene workers: %d", (int)n);
+	}
+	w->scene_cache->workers.resize((uint32_t)n);
+	return 0;
+}
+
 static int
 entity_init(lua_State *L) {
 	auto w = getworld(L);
@@ -137,14 +272,16 @@ scene_changed(lua_State *L) {
 	}
 
 	// step.2
-	bee::flatmap<component::eid, math_t> worldmats;
+	auto sc = w->scene_cache;
+	sc->clear();
+	bee::flatmap<component::eid, int> index;
 	for (auto& e : ecs::select<component::scene_mutable, component::scene, component::eid>(w->ecs)) {
 		auto& s = e.get<component::scene>();
 		component::eid id = e.get<component::eid>();
 		auto selfchanged = is_changed(changed, id);
 		if (selfchanged || (s.parent != 0 && is_changed(changed, s.parent))) {
 			e.enable_tag<component::scene_changed>();
-			if (!worldmat_update(worldmats, math3d, s, id, w)) {
+			if (!sc->add(index, math3d, s, id, w)) {
 				return luaL_error(L, "entity(%d)'s parent(%d) cannot be found.", id, s.parent);
 			}
 			s.movement = w->frame;
@@ -157,6 +294,9 @@ scene_changed(lua_State *L) {
 		}
 	}
 
+	// step.3
+	sc->update(math3d);
+
 	++w->frame;
 
 	return 0;
@@ -204,6 +344,9 @@ extern "C" int
 luaopen_system_scene(lua_State *L) {
 	luaL_checkversion(L);
 	luaL_Reg l[] = {
+		{ "init", scene_init },
+		{ "exit", scene_exit },
+		{ "set_workers", set_workers },
 		{ "entity_init", entity_init },
 		{ "scene_changed", scene_changed },
 		{ "end_frame", end_frame },
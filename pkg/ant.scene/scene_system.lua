@@ -0,0 +1,13 @@
+local ecs = ...
+local world = ecs.world
+
+local setting = import_package "ant.settings"
+local SCENE_WORKERS<const> = setting:get "scene/workers" or 0
+
+local scene = world:clibs "system.scene"
+
+local sw_sys = ecs.system "scene_worker_system"
+
+function sw_sys:post_init()
+	scene.set_workers(SCENE_WORKERS)
+end
@@ -2,7 +2,8 @@ local lfs = require "bee.filesystem"
 local fastio = require "fastio"
 local datalist = require "datalist"
 local mount = require "mount"
-local new_vfsrepo = require "vfsrepo".new
+local vfsrepo_class = require "vfsrepo"
+local new_vfsrepo = vfsrepo_class.new
 
 local REPO_MT = {}
 REPO_MT.__index = REPO_MT
@@ -25,16 +26,7 @@ local function import_hash(self)
 	if self._nohash then
 		return false
 	end
-	local hashspath = self._cachepath / "hashs"
-	if not lfs.exists(hashspath) then
-		return
-	end
-	local hashs = {}
-	for line in fastio.readall_s(hashspath:string()):gmatch "(.-)\n+" do
-		local sha1, timestamp, path = line:match "(%S+) (%S+) (.+)"
-		hashs[path] = {sha1, tonumber(timestamp, 16)}
-	end
-	return hashs
+	return vfsrepo_class.load_hash((self._cachepath / "hashs"):string())
 end
 
 local function read_content(v)
@@ -65,11 +57,8 @@ local function export_filehash(self, vfsrepo)
 end
 
 local function export_hash(self, vfsrepo, mode)
-	local hashspath = self._cachepath / "hashs"
-	local hashs = vfsrepo:export_hash()
-	local f <close> = assert(io.open(hashspath:string(), mode))
+	local hashs = vfsrepo:save_hash((self._cachepath / "hashs"):string(), mode)
 	for path, v in pairs(hashs) do
-		f:write(string.format("%s %09x %s\n", v[1], v[2], path))
 		self._hashs[path] = v
 	end
 end
@@ -212,6 +212,44 @@ local function dump_dir(dir)
 	return table.concat(r, "\n")
 end
 
+-- hash all the files without hash (or with a hash imported from the cache) in one native batch
+local function hash_files(root)
+	local items = {}
+	local n = 0
+	local function collect_(dir)
+		for i = 1, #dir do
+			local item = dir[i]
+			if item.dir then
+				collect_(item.dir)
+			elseif item.path and (not item.hash or item.verify) then
+				n = n + 1
+				items[n] = item
+			end
+		end
+	end
+	collect_(root)
+	if n == 0 then
+		return
+	end
+	local paths = {}
+	local sizes = {}
+	for i = 1, n do
+		local item = items[i]
+		paths[i] = item.path
+		sizes[i] = item.verify and item.size or false
+	end
+	local hashs
+	hashs, sizes = fastio.sha1_batch(paths, sizes)
+	for i = 1, n do
+		local item = items[i]
+		if hashs[i] then
+			item.hash = hashs[i]
+		end
+		item.size = sizes[i]
+		item.verify = nil
+	end
+end
+
 local function calc_hash(dir)
 	local n = #dir
 	local dir_content = {}
@@ -224,9 +262,6 @@ local function calc_hash(dir)
 			item.hash = fastio.str2sha1(item.content)
 			dir_content[i] = "d " .. item.name .. " " .. item.hash .. "\n"
 		else
-			if not item.hash then
-				item.hash = fastio.sha1(item.path)
-			end
 			dir_content[i] = "f " .. item.name .. " " .. item.hash .. "\n"
 		end
 	end
@@ -239,12 +274,12 @@ local function export_hash(root, name)
 		for _, item in ipairs(dir) do
 			if item.dir then
 				export_(item.dir, prefix .. item.name .. "/")
-			elseif item.hash and item.path then
+			elseif item.hash and item.path and item.size then
 				local path = item.path
 				if name then
 					path = path .. name
 				end
-				result[path] = { item.hash, item.timestamp }
+				result[path] = { item.hash, item.timestamp, item.size }
 			end
 		end
 	end
@@ -277,7 +312,10 @@ local function import_hash(index, hashs, name)
 				end
 				local h = hashs[fullpath]
 				if h and item.timestamp == h[2] then
+					-- the size is checked when the files are hashed
 					item.hash = h[1]
+					item.size = h[3]
+					item.verify = true
 				end
 			end
 		end
@@ -287,6 +325,9 @@ end
 local repo_meta = {}; repo_meta.__index = repo_meta
 
 local function update_all(root, hashs)
+	if hashs ~= false then
+		hash_files(root._dir)
+	end
 	local root_content = hashs ~= false and calc_hash(root._dir)
 	root._root = {
 		name = "",
@@ -491,6 +532,34 @@ function repo_meta:import_hash(hashs)
 	import_hash(self._index, hashs, self._name)
 end
 
+-- hash cache file: a header line, then "sha1 timestamp size path" for each file, timestamp and size are hex
+local HASH_HEADER <const> = "#hashs 2\n"
+
+function repo.load_hash(filename)
+	local content = fastio.readall_s_noerr(filename)
+	if not content or content:sub(1, #HASH_HEADER) ~= HASH_HEADER then
+		-- missing, or an old format
+		return
+	end
+	local hashs = {}
+	for sha1, timestamp, size, path in content:gmatch("(%x+) (%x+) (%x+) ([^\n]+)\n", #HASH_HEADER + 1) do
+		hashs[path] = { sha1, tonumber(timestamp, 16), tonumber(size, 16) }
+	end
+	return hashs
+end
+
+function repo_meta:save_hash(filename, mode)
+	local hashs = self:export_hash()
+	local f <close> = assert(io.open(filename, mode))
+	if f:seek "end" == 0 then
+		f:write(HASH_HEADER)
+	end
+	for path, v in pairs(hashs) do
+		f:write(string.format("%s %09x %x %s\n", v[1], v[2], v[3], path))
+	end
+	return hashs
+end
+
 function repo_meta:root()
 	return self._root.hash
 end
@@ -48,6 +48,7 @@ int luaopen_material_core(lua_State *L);
 int luaopen_math3d(lua_State* L);
 int luaopen_math3d_adapter(lua_State* L);
 int luaopen_math3d_adapter_test(lua_State *L);
+int luaopen_meshopt(lua_State *L);
 int luaopen_motion_sampler(lua_State *L);
 int luaopen_motion_tween(lua_State *L);
 int luaopen_noise(lua_State *L);
@@ -60,11 +61,13 @@ int luaopen_render_material(lua_State *L);
 int luaopen_render_queue(lua_State *L);
 int luaopen_render_mesh(lua_State *L);
 int luaopen_render_cache(lua_State *L);
+int luaopen_render_tileculling(lua_State *L);
 int luaopen_rmlui(lua_State* L);
 int luaopen_system_cull(lua_State* L);
 int luaopen_system_render(lua_State *L);
 int luaopen_entity_drawer(lua_State *L);
 int luaopen_system_scene(lua_State* L);
+int luaopen_system_animation(lua_State* L);
 int luaopen_textureman_client(lua_State *L);
 int luaopen_textureman_server(lua_State *L);
 int luaopen_vfs(lua_State* L);
@@ -123,6 +126,7 @@ void ant_loadmodules(lua_State* L) {
         { "render.mesh",           luaopen_render_mesh},
         { "system.render",      luaopen_system_render},
         { "render.cache",        luaopen_render_cache},
+        { "render.tileculling",  luaopen_render_tileculling},
         { "entity.drawer",      luaopen_entity_drawer},
         { "motion.sampler",     luaopen_motion_sampler},
         { "motion.tween",       luaopen_motion_tween},
@@ -134,10 +138,12 @@ void ant_loadmodules(lua_State* L) {
         { "cell.core", luaopen_cell_core },
         { "firmware", luaopen_firmware },
         { "system.scene", luaopen_system_scene },
+        { "system.animation", luaopen_system_animation },
         { "cull.core", luaopen_system_cull},
         { "zip", luaopen_zip },
 #if !BX_PLATFORM_IOS && !BX_PLATFORM_ANDROID
         { "ozz.offline", luaopen_ozz_offline },
+        { "meshopt", luaopen_meshopt },
         { "bee.filewatch", luaopen_bee_filewatch },
         { "bee.subprocess", luaopen_bee_subprocess },
 #if !BX_PLATFORM_LINUX
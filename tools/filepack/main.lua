@@ -47,6 +47,7 @@ do print "step2. compile resource."
     local tiny_vfs = vfsrepo.new_tiny(repopath)
     local names, paths = std_vfs:export_resources()
     local tasks = {}
+    local total = 0
     local function compile_resource(i, cfg, name, path)
         local lpath = cr.compile_file(cfg, name, path)
         resource_cache[lpath] = nil
@@ -54,9 +55,17 @@ do print "step2. compile resource."
     for _, setting in ipairs(config_resource) do
         local cfg = cr.init_setting(tiny_vfs, setting)
         for i = 1, #names do
-            tasks[#tasks+1] = { compile_resource, i, cfg, names[i], paths[i] }
+            -- only the resources whose dependencies changed are compiled
+            local lpath, dirty = cr.check_file(cfg, names[i], paths[i])
+            if dirty then
+                tasks[#tasks+1] = { compile_resource, i, cfg, names[i], paths[i] }
+            else
+                resource_cache[lpath] = nil
+            end
+            total = total + 1
         end
     end
+    print(("  compile %d of %d resources."):format(#tasks, total))
     for _, resp in ltask.parallel(tasks) do
         if resp.error then
             log.error(resp.error)
@@ -73,52 +82,144 @@ end
 
 local writer = {}
 
-function writer.zip(bundlepath)
-    local zippath = bundlepath / "00.zip"
+-- text files are deflated in the bundle, the others are stored for mmap
+local compress_ext <const> = {
+    lua = true,
+    ecs = true,
+    prefab = true,
+    ant = true,
+    html = true,
+    css = true,
+    state = true,
+    varyings = true,
+}
+local COMPRESS_LEVEL <const> = 6
+
+local function compress_level(path)
+    if path == nil or compress_ext[path:match "%.([^./]+)$"] then
+        return COMPRESS_LEVEL
+    end
+end
+
+-- rebuild the bundle when the garbage is more than this ratio of it
+local GARBAGE_RATIO <const> = 0.5
+
+local function bundle_capacity(count)
+    -- reserve some slots for appending
+    return count + count // 4 + 256
+end
+
+local function print_report(stat)
+    print(("  bundle: %d files, %d reused, %d removed, %d bytes written, %d bytes copied, %d bytes garbage, %d bytes total."):format(
+        stat.count, stat.reused, stat.removed, stat.written, stat.copied, stat.garbage, stat.size))
+end
+
+-- appends the new files to the bundle, and removes the old files from its index.
+-- it's rebuilt if the index is full, or it has too much garbage.
+-- the new bundle is written to a temp file, and renamed to 00.bundle when it's finished.
+function writer.bundle(bundlepath, count)
+    local bundle = bundlepath / "00.bundle"
+    local tmppath = bundlepath / "00.tmp.bundle"
     local hashpath = bundlepath / "00.hash"
+    fs.create_directories(bundlepath)
+    local live = {}
+    local contents = {}
+    local files = {}
     local m = {}
     function m.root(content)
         local f <close> = assert(io.open(hashpath:string(), "wb"))
         f:write(content)
     end
-    if fs.exists(zippath) then
-        local oldzippath = bundlepath / "00.old.zip"
-        fs.rename(zippath, oldzippath)
-        local oldzip = zip.open(oldzippath:string(), "r")
-        if oldzip then
-            local newzip = assert(zip.open(zippath:string(), "w"))
-            function m.writefile(path, content)
-                if oldzip:exist(path) then
-                    newzip:copyfrom(path, oldzip)
-                else
-                    newzip:add(path, content)
-                end
-            end
-            function m.copyfile(path, localpath)
-                if oldzip:exist(path) then
-                    newzip:copyfrom(path, oldzip)
-                else
-                    newzip:addfile(path, localpath)
-                end
+    function m.writefile(path, content)
+        live[path] = true
+        contents[#contents+1] = { path, content }
+    end
+    function m.copyfile(path, localpath)
+        live[path] = true
+        files[#files+1] = { path, localpath, compress_level(localpath) }
+    end
+    -- reuse(hash) returns true if the bundle has it already
+    local function write_new(w, reuse)
+        local newfiles = {}
+        for _, v in ipairs(files) do
+            if not reuse(v[1]) then
+                newfiles[#newfiles+1] = v
             end
-            function m.close()
-                oldzip:close()
-                newzip:close()
-                fs.remove(oldzippath)
+        end
+        for _, v in ipairs(contents) do
+            if not reuse(v[1]) then
+                w:add(v[1], v[2], compress_level())
             end
-            return m
         end
+        w:addfiles(newfiles)
     end
-    fs.create_directories(bundlepath)
-    local zipfile = assert(zip.open(zippath:string(), "w"))
-    function m.writefile(path, content)
-        zipfile:add(path, content)
+    local function append(w)
+        for _, hash in ipairs(w:list()) do
+            if not live[hash] then
+                w:remove(hash)
+            end
+        end
+        local function exist(hash)
+            return w:exist(hash)
+        end
+        local stat = w:stat()
+        local newcount = 0
+        for _, v in ipairs(files) do
+            if not exist(v[1]) then
+                newcount = newcount + 1
+            end
+        end
+        for _, v in ipairs(contents) do
+            if not exist(v[1]) then
+                newcount = newcount + 1
+            end
+        end
+        if stat.count + newcount > stat.capacity or stat.garbage > stat.size * GARBAGE_RATIO then
+            return false
+        end
+        write_new(w, exist)
+        stat = w:stat()
+        w:close()
+        return stat
     end
-    function m.copyfile(path, localpath)
-        zipfile:addfile(path, localpath)
+    local function rebuild()
+        local oldbundle
+        if fs.exists(bundle) then
+            oldbundle = zip.bundle(bundle:string())
+        end
+        local w = assert(zip.bundle_writer(tmppath:string(), bundle_capacity(count)))
+        local function reuse(hash)
+            if oldbundle and oldbundle:exist(hash) then
+                w:copyfrom(hash, oldbundle)
+                return true
+            end
+        end
+        write_new(w, reuse)
+        local stat = w:stat()
+        w:close()
+        if oldbundle then
+            oldbundle:close()
+        end
+        return stat
     end
     function m.close()
-        zipfile:close()
+        local stat
+        if fs.exists(bundle) then
+            fs.copy_file(bundle, tmppath, fs.copy_options.overwrite_existing)
+            local w = zip.bundle_append(tmppath:string())
+            if w then
+                stat = append(w)
+                if not stat then
+                    w:abort()
+                end
+            end
+        end
+        if not stat then
+            stat = rebuild()
+        end
+        fs.rename(tmppath, bundle)
+        print_report(stat)
+        fs.remove(bundlepath / "00.zip")
     end
     return m
 end
@@ -186,7 +287,11 @@ do print "step4. pack file and dir."
             return app_path "ant" / "bundle"
         end
     end
-    local w = writer.zip(bundle_path())
+    local count = 0
+    for _ in pairs(std_vfs._filehash) do
+        count = count + 1
+    end
+    local w = writer.bundle(bundle_path(), count)
     w.root(std_vfs:root())
     for hash, v in pairs(std_vfs._filehash) do
         if v.dir then